@@ -0,0 +1,174 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"math"
+	"time"
+	"unsafe"
+)
+
+// Completion tracks an asynchronous RDMA operation started with WriteAsync or ReadAsync.
+//
+// Operations are matched to their completions by work request id. Send completions on a
+// connection arrive in posting order, so waiting for an operation also reaps every
+// operation posted before it.
+type Completion struct {
+	res       *RDMAResources
+	wrID      C.uint64_t
+	data      []byte
+	character string
+	done      bool
+	err       error
+}
+
+// WriteAsync starts an RDMA write of `contents` to `offset` in the remote peer's buffer
+// and returns without waiting for it to complete.
+//
+// The contents are copied to the same offset in the local registered buffer, which must
+// not be touched by another operation until the write completes. Unlike Write, no framing
+// or synchronization with the peer takes place: the peer learns about the data through
+// whatever protocol the caller runs on top, for example a Write issued once the
+// asynchronous writes completed. Up to RDMAHandler.SendDepth-1 operations can be in
+// flight; when the send queue is full, WriteAsync waits for the oldest one first.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns a Completion to wait on and nil error. On failure, it returns nil
+// and the error encountered.
+//
+// Example:
+//
+//	var pending []*rdmahandler.Completion
+//	for i, chunk := range chunks {
+//	    c, err := h.WriteAsync(clientRes, i*chunkSize, chunk, "client")
+//	    if err != nil {
+//	        log.Fatalf("RDMA write failed: %v", err)
+//	    }
+//	    pending = append(pending, c)
+//	}
+//	for _, c := range pending {
+//	    if err := c.Wait(); err != nil {
+//	        log.Fatalf("RDMA write failed: %v", err)
+//	    }
+//	}
+func (h *RDMAHandler) WriteAsync(res *RDMAResources, offset int, contents []byte, character string) (*Completion, error) {
+	if err := res.checkRange(offset, len(contents)); err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	if len(contents) > 0 {
+		C.memcpy(unsafe.Add(unsafe.Pointer(res.res.buf), offset), unsafe.Pointer(&contents[0]), C.size_t(len(contents)))
+	}
+	return postAsync(res, C.IBV_WR_RDMA_WRITE, offset, len(contents), character)
+}
+
+// ReadAsync starts an RDMA read of `length` bytes at `offset` in the remote peer's buffer
+// and returns without waiting for it to complete.
+//
+// The data lands at the same offset in the local registered buffer and is available from
+// the Completion's Bytes method once Wait returns. See WriteAsync for the rules on
+// outstanding operations.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns a Completion to wait on and nil error. On failure, it returns nil
+// and the error encountered.
+func (h *RDMAHandler) ReadAsync(res *RDMAResources, offset int, length int, character string) (*Completion, error) {
+	if err := res.checkRange(offset, length); err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	c, err := postAsync(res, C.IBV_WR_RDMA_READ, offset, length, character)
+	if err != nil {
+		return nil, err
+	}
+	c.data = unsafe.Slice((*byte)(unsafe.Add(unsafe.Pointer(res.res.buf), offset)), length)
+	return c, nil
+}
+
+// Wait blocks until the operation completes and returns its outcome, giving up after the
+// connection's timeout. Calling Wait again returns the same outcome.
+func (c *Completion) Wait() error {
+	return c.WaitTimeout(0)
+}
+
+// WaitTimeout is like Wait but gives up after `timeout` instead of the connection's
+// timeout. A timed out operation is still in flight and can be waited for again.
+func (c *Completion) WaitTimeout(timeout time.Duration) error {
+	if c.done {
+		return c.err
+	}
+	if C.poll_async(c.res.res, c.wrID, timeoutMsec(timeout)) != 0 {
+		if C.test_async(c.res.res, c.wrID) == 0 {
+			return fmt.Errorf("%s: asynchronous operation %d timed out", c.character, uint64(c.wrID))
+		}
+		c.err = fmt.Errorf("%s: asynchronous operation %d failed", c.character, uint64(c.wrID))
+	}
+	c.done = true
+	return c.err
+}
+
+// timeoutMsec converts a timeout to the milliseconds the C layer waits, where 0 selects
+// the connection's default. A positive timeout is rounded up, so one below a millisecond
+// does not turn into the default.
+func timeoutMsec(timeout time.Duration) C.int {
+	if timeout <= 0 {
+		return 0
+	}
+	msec := timeout / time.Millisecond
+	if timeout%time.Millisecond != 0 {
+		msec++
+	}
+	if msec > math.MaxInt32 {
+		msec = math.MaxInt32
+	}
+	return C.int(msec)
+}
+
+// Test reaps the completions available without blocking and reports whether the
+// operation has completed, along with its outcome once it has.
+func (c *Completion) Test() (bool, error) {
+	if c.done {
+		return true, c.err
+	}
+	switch C.test_async(c.res.res, c.wrID) {
+	case 0:
+		return false, nil
+	case 1:
+		c.done = true
+	default:
+		c.done = true
+		c.err = fmt.Errorf("%s: asynchronous operation %d failed", c.character, uint64(c.wrID))
+	}
+	return true, c.err
+}
+
+// Bytes returns the data fetched by a completed ReadAsync. The slice is backed by the
+// registered buffer and is only valid until another operation touches the same range.
+// It returns nil for writes.
+func (c *Completion) Bytes() []byte {
+	return c.data
+}
+
+// postAsync posts an asynchronous operation on `length` bytes at `offset` and returns
+// the Completion tracking it.
+func postAsync(res *RDMAResources, opcode C.int, offset int, length int, character string) (*Completion, error) {
+	var wrID C.uint64_t
+
+	if C.post_async(res.res, opcode, C.size_t(offset), C.size_t(length), &wrID) != 0 {
+		return nil, fmt.Errorf("%s: failed to post SR", character)
+	}
+	return &Completion{res: res, wrID: wrID, character: character}, nil
+}
+
+// checkRange verifies that `length` bytes at `offset` fit in the registered buffer.
+func (res *RDMAResources) checkRange(offset int, length int) error {
+	if offset < 0 || length < 0 || offset+length > res.bufSize() {
+		return fmt.Errorf("range [%d, %d) exceeds buffer of %d bytes", offset, offset+length, res.bufSize())
+	}
+	return nil
+}
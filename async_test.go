@@ -0,0 +1,28 @@
+package rdmahandler
+
+import (
+	"math"
+	"testing"
+	"time"
+)
+
+func TestTimeoutMsec(t *testing.T) {
+	tests := []struct {
+		timeout time.Duration
+		want    int
+	}{
+		{0, 0},
+		{-time.Second, 0},
+		{time.Nanosecond, 1},
+		{500 * time.Microsecond, 1},
+		{time.Millisecond, 1},
+		{time.Millisecond + time.Nanosecond, 2},
+		{20 * time.Second, 20000},
+		{math.MaxInt64, math.MaxInt32},
+	}
+	for _, tt := range tests {
+		if got := int(timeoutMsec(tt.timeout)); got != tt.want {
+			t.Errorf("timeoutMsec(%v) = %d, want %d", tt.timeout, got, tt.want)
+		}
+	}
+}
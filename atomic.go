@@ -0,0 +1,136 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// AtomicKind selects the operation of an AtomicOp.
+type AtomicKind int
+
+const (
+	AtomicFetchAdd AtomicKind = iota
+	AtomicCompareSwap
+)
+
+// AtomicOp is one operation of a batch run by Atomics, on the 8-byte word at Offset in
+// the remote region named Region, or in the peer's connection buffer if Region is empty.
+// Fetch and add adds Add to the word; compare and swap stores Swap if the word equals
+// Expect. Atomics sets Old to the value the word had before the operation.
+type AtomicOp struct {
+	Kind   AtomicKind
+	Region string
+	Offset int
+	Add    uint64
+	Expect uint64
+	Swap   uint64
+	Old    uint64
+}
+
+// FetchAdd atomically adds `delta` to the 64-bit word at `offset` in the remote peer's
+// connection buffer and returns the value it had before.
+//
+// The operation is carried out by the remote NIC without involving the remote CPU, and
+// is atomic with respect to the atomic operations of every connection to the peer, which
+// makes it suitable for sequence counters shared by many clients. `offset` must be a
+// multiple of 8. The word is kept in the peer's byte order. Both devices must support
+// atomic operations.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns the previous value and nil error. On failure, it returns 0 and
+// the error encountered.
+//
+// Example:
+//
+//	seq, err := h.FetchAdd(clientRes, 0, 1, "client")
+//	if err != nil {
+//	    log.Fatalf("RDMA fetch and add failed: %v", err)
+//	}
+func (h *RDMAHandler) FetchAdd(res *RDMAResources, offset int, delta uint64, character string) (uint64, error) {
+	ops := []AtomicOp{{Kind: AtomicFetchAdd, Offset: offset, Add: delta}}
+	err := h.Atomics(res, ops, character)
+	return ops[0].Old, err
+}
+
+// CompareSwap atomically replaces the 64-bit word at `offset` in the remote peer's
+// connection buffer with `swap` if it equals `expect`, and returns the value it had
+// before; the swap took place if that value equals `expect`. See FetchAdd.
+//
+// Example:
+//
+//	// take a lease held in word 8, 0 meaning free
+//	old, err := h.CompareSwap(clientRes, 8, 0, myID, "client")
+//	if err == nil && old == 0 {
+//	    // the lease is ours
+//	}
+func (h *RDMAHandler) CompareSwap(res *RDMAResources, offset int, expect uint64, swap uint64, character string) (uint64, error) {
+	ops := []AtomicOp{{Kind: AtomicCompareSwap, Offset: offset, Expect: expect, Swap: swap}}
+	err := h.Atomics(res, ops, character)
+	return ops[0].Old, err
+}
+
+// Atomics runs a batch of atomic operations and sets the Old field of each.
+//
+// The operations are posted as one chain of work requests, see PostBatch, and only the
+// last one is signaled, so a batch costs about one round trip rather than one per
+// operation; the NIC executes up to QPAttributes.MaxReadAtomic of them at once.
+// Operations on the same word take effect in order. Regions must have been advertised
+// with RegionAtomic access.
+//
+// On success, it returns nil. On failure, it returns the error encountered, and the Old
+// fields are not valid.
+func (h *RDMAHandler) Atomics(res *RDMAResources, ops []AtomicOp, character string) error {
+	if len(ops) == 0 {
+		return nil
+	}
+	for _, op := range ops {
+		if op.Kind != AtomicFetchAdd && op.Kind != AtomicCompareSwap {
+			return fmt.Errorf("%s: invalid atomic operation %d", character, op.Kind)
+		}
+		if op.Offset%8 != 0 {
+			return fmt.Errorf("%s: atomic operation on unaligned offset %d", character, op.Offset)
+		}
+	}
+
+	results, err := res.Borrow(8 * len(ops))
+	if err != nil {
+		return fmt.Errorf("%s: %v", character, err)
+	}
+	defer results.Release()
+
+	batch := make([]BatchOp, len(ops))
+	for i, op := range ops {
+		kind := BatchFetchAdd
+		if op.Kind == AtomicCompareSwap {
+			kind = BatchCompareSwap
+		}
+		batch[i] = BatchOp{
+			Kind:   kind,
+			Local:  Segment{Buf: results, Offset: 8 * i, Length: 8},
+			Region: op.Region,
+			Offset: op.Offset,
+			Add:    op.Add,
+			Expect: op.Expect,
+			Swap:   op.Swap,
+		}
+	}
+	c, err := postBatch(res, batch, 0, character)
+	if err != nil {
+		return err
+	}
+	if err := c.Wait(); err != nil {
+		return err
+	}
+
+	words := unsafe.Slice((*uint64)(unsafe.Pointer(results.blk.addr)), len(ops))
+	for i := range ops {
+		ops[i].Old = words[i]
+	}
+	return nil
+}
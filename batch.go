@@ -0,0 +1,138 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// BatchKind selects the operation of a BatchOp.
+type BatchKind int
+
+const (
+	BatchWrite BatchKind = iota
+	BatchRead
+	BatchFetchAdd
+	BatchCompareSwap
+)
+
+// BatchOp is one operation of a batch posted with PostBatch. Local is the source of a
+// write, the destination of a read, or the 8 bytes receiving the previous value of the
+// word an atomic operation works on. Offset is the remote offset in the region named
+// Region, or in the peer's connection buffer if Region is empty. Add, Expect and Swap
+// are the operands of the atomic operations, as in AtomicOp.
+type BatchOp struct {
+	Kind   BatchKind
+	Local  Segment
+	Region string
+	Offset int
+	Add    uint64
+	Expect uint64
+	Swap   uint64
+}
+
+// PostBatch starts a batch of RDMA writes, reads and atomic operations and returns
+// without waiting for them. The returned Completion completes once all of them did.
+//
+// The operations are posted as a chain of linked work requests with a single call into C
+// and a single doorbell, rather than one of each per operation. Only every
+// `signalEvery`-th operation, or with 0 only the last one, generates a completion; the
+// others are reaped along with the next signaled one, since completions arrive in order.
+// This saves MMIO, completion processing and cgo transitions, which dominate the cost of
+// small operations. Batches longer than the send queue, or than 64 operations, are split
+// into several chains.
+//
+// Every operation is checked against the range and access of its remote memory before
+// anything is posted. Local memory is used in place, so it must stay untouched until
+// the batch completed. If posting fails partway, PostBatch waits for the operations
+// that were posted before it returns.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns the Completion of the batch and nil error. On failure, it
+// returns nil and the error encountered.
+//
+// Example:
+//
+//	ops := make([]rdmahandler.BatchOp, len(records))
+//	for i := range records {
+//	    ops[i] = rdmahandler.BatchOp{Kind: rdmahandler.BatchWrite, Local: records[i], Offset: i * recordSize}
+//	}
+//	c, err := h.PostBatch(clientRes, ops, 0, "client")
+//	if err != nil {
+//	    log.Fatalf("Failed to post batch: %v", err)
+//	}
+//	if err := c.Wait(); err != nil {
+//	    log.Fatalf("Batch failed: %v", err)
+//	}
+func (h *RDMAHandler) PostBatch(res *RDMAResources, ops []BatchOp, signalEvery int, character string) (*Completion, error) {
+	return postBatch(res, ops, signalEvery, character)
+}
+
+// postBatch checks the operations of a batch and posts them.
+func postBatch(res *RDMAResources, ops []BatchOp, signalEvery int, character string) (*Completion, error) {
+	if len(ops) == 0 {
+		return nil, fmt.Errorf("%s: empty batch", character)
+	}
+	if signalEvery < 0 {
+		return nil, fmt.Errorf("%s: invalid signaling interval %d", character, signalEvery)
+	}
+	cops := make([]C.struct_batch_op, len(ops))
+	for i, op := range ops {
+		var opcode C.int
+		switch op.Kind {
+		case BatchWrite:
+			opcode = C.IBV_WR_RDMA_WRITE
+		case BatchRead:
+			opcode = C.IBV_WR_RDMA_READ
+		case BatchFetchAdd:
+			opcode = C.IBV_WR_ATOMIC_FETCH_AND_ADD
+		case BatchCompareSwap:
+			opcode = C.IBV_WR_ATOMIC_CMP_AND_SWP
+		default:
+			return nil, fmt.Errorf("%s: invalid batch operation %d", character, op.Kind)
+		}
+		sge, err := op.Local.sge(res)
+		if err != nil {
+			return nil, fmt.Errorf("%s: operation %d: local memory %v", character, i, err)
+		}
+		if opcode != C.IBV_WR_RDMA_WRITE && opcode != C.IBV_WR_RDMA_READ && (op.Local.Length != 8 || op.Offset%8 != 0) {
+			return nil, fmt.Errorf("%s: operation %d: atomic operations work on aligned 8-byte words", character, i)
+		}
+		desc, err := res.remoteRegion(opcode, op.Region, op.Offset, op.Local.Length)
+		if err != nil {
+			return nil, fmt.Errorf("%s: operation %d: %v", character, i, err)
+		}
+
+		c := &cops[i]
+		c.opcode = opcode
+		c.sge = sge
+		if desc != nil {
+			c.remote_addr = desc.addr + C.uint64_t(op.Offset)
+			c.rkey = desc.rkey
+		} else {
+			c.remote_addr = res.res.remote_props.addr + C.uint64_t(op.Offset)
+			c.rkey = res.res.remote_props.rkey
+		}
+		c.compare_add = C.uint64_t(op.Add)
+		if op.Kind == BatchCompareSwap {
+			c.compare_add = C.uint64_t(op.Expect)
+		}
+		c.swap = C.uint64_t(op.Swap)
+	}
+
+	var wrID C.uint64_t
+	if C.post_batch(res.res, (*C.struct_batch_op)(unsafe.Pointer(&cops[0])), C.int(len(cops)), C.int(signalEvery), &wrID) != 0 {
+		// local memory must not be reused while the chains that went out still use it
+		if wrID != 0 {
+			c := &Completion{res: res, wrID: wrID, character: character}
+			c.Wait()
+		}
+		return nil, fmt.Errorf("%s: failed to post batch", character)
+	}
+	return &Completion{res: res, wrID: wrID, character: character}, nil
+}
@@ -0,0 +1,51 @@
+package rdmahandler
+
+import (
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"testing"
+)
+
+// TestC builds and runs the C tests in testdata. A test named <file>_test.c includes the
+// package's <file>.c to reach its static functions and is linked with the other C files.
+// The tests fake what they use of the verbs, so they need no RDMA device.
+func TestC(t *testing.T) {
+	cc := os.Getenv("CC")
+	if cc == "" {
+		cc = "cc"
+	}
+	if _, err := exec.LookPath(cc); err != nil {
+		t.Skipf("no C compiler: %v", err)
+	}
+	tests, err := filepath.Glob("testdata/*_test.c")
+	if err != nil {
+		t.Fatal(err)
+	}
+	sources, err := filepath.Glob("*.c")
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	for _, test := range tests {
+		name := strings.TrimSuffix(filepath.Base(test), "_test.c")
+		t.Run(name, func(t *testing.T) {
+			bin := filepath.Join(t.TempDir(), name)
+			args := []string{"-Wall", "-I.", "-o", bin, test}
+			for _, s := range sources {
+				// rdma_cm.c needs librdmacm and is only built with -tags rdmacm
+				if s != name+".c" && s != "rdma_cm.c" {
+					args = append(args, s)
+				}
+			}
+			args = append(args, "-libverbs", "-lpthread")
+			if out, err := exec.Command(cc, args...).CombinedOutput(); err != nil {
+				t.Fatalf("failed to build %s: %v\n%s", test, err, out)
+			}
+			if out, err := exec.Command(bin).CombinedOutput(); err != nil {
+				t.Fatalf("%s: %v\n%s", test, err, out)
+			}
+		})
+	}
+}
@@ -0,0 +1,36 @@
+//go:build rdmacm
+
+package rdmahandler
+
+/*
+#cgo CFLAGS: -DRDMA_CM
+#cgo LDFLAGS: -lrdmacm
+#include "rdma_operations.h"
+*/
+import "C"
+import "fmt"
+
+// establishCM connects the resources allocated by newResources through the RDMA
+// connection manager, the counterpart of establish. On failure the C resources are
+// released and `resources` must not be used again.
+func establishCM(resources *RDMAResources, h *RDMAHandler) error {
+	if C.cm_resolve(resources.res) != 0 {
+		C.cm_destroy(resources.res)
+		freeResources(resources)
+		return fmt.Errorf("failed to resolve connection with RDMA CM")
+	}
+	if C.resources_create(resources.res) != 0 {
+		C.cm_destroy(resources.res)
+		freeResources(resources)
+		return fmt.Errorf("failed to create resources")
+	}
+	if h.Notify {
+		resources.res.notify = 1
+	}
+	if C.cm_connect_qp(resources.res) != 0 {
+		C.resources_destroy(resources.res)
+		freeResources(resources)
+		return fmt.Errorf("failed to connect QPs with RDMA CM")
+	}
+	return nil
+}
@@ -0,0 +1,11 @@
+//go:build !rdmacm
+
+package rdmahandler
+
+import "fmt"
+
+// establishCM fails in builds without the rdmacm tag, which leave out librdmacm.
+func establishCM(resources *RDMAResources, h *RDMAHandler) error {
+	freeResources(resources)
+	return fmt.Errorf("RDMA CM support not built in, build with -tags rdmacm")
+}
@@ -0,0 +1,552 @@
+// Command rdmabench measures the throughput and latency of rdmahandler connections, in the
+// spirit of ib_write_bw and ib_write_lat.
+//
+// It sweeps operation, message size, queue depth and connection count and prints one JSON
+// object per case on stdout, with p50/p99/p999 latency, operations per second and GB/s.
+// The client drives the benchmark and the server mirrors the client's plan, so both must
+// be started with the same sweep flags. In loopback mode the server is started as a child
+// process, which together with a Soft-RoCE (rxe) device lets the whole suite run on a
+// single box; see scripts/rxe_loopback.sh.
+//
+// Usage:
+//
+//	rdmabench -mode loopback -ops write,read,notify,send,async-write -sizes 64,4096,65536 -depths 1,16 -conns 1,4
+//	rdmabench -mode server -port 19875 [sweep flags]
+//	rdmabench -mode client -addr 10.0.0.1 -port 19875 [sweep flags]
+package main
+
+import (
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"os/exec"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/liver/rdmahandler"
+)
+
+type config struct {
+	mode    string
+	addr    string
+	port    int
+	ops     []string
+	sizes   []int
+	depths  []int
+	conns   []int
+	iters   int
+	verbose bool
+	cm      bool
+	warm    bool
+}
+
+// result is the machine-readable outcome of one benchmark case.
+type result struct {
+	Op        string  `json:"op"`
+	Size      int     `json:"size"`
+	Depth     int     `json:"depth"`
+	Conns     int     `json:"conns"`
+	Ops       int     `json:"ops"`
+	Seconds   float64 `json:"seconds"`
+	OpsPerSec float64 `json:"ops_per_sec"`
+	GBPerSec  float64 `json:"gb_per_sec"`
+	P50us     float64 `json:"p50_us"`
+	P99us     float64 `json:"p99_us"`
+	P999us    float64 `json:"p999_us"`
+	Error     string  `json:"error,omitempty"`
+}
+
+// benchCase is one point of the sweep.
+type benchCase struct {
+	op    string
+	size  int
+	depth int
+	conns int
+}
+
+func main() {
+	var cfg config
+	var ops, sizes, depths, conns string
+
+	flag.StringVar(&cfg.mode, "mode", "loopback", "server, client or loopback")
+	flag.StringVar(&cfg.addr, "addr", "127.0.0.1", "server address for client mode")
+	flag.IntVar(&cfg.port, "port", 19875, "first TCP port, connection i uses port+i")
+	flag.StringVar(&ops, "ops", "write,read,notify,send,async-write,async-read", "operations to run")
+	flag.StringVar(&sizes, "sizes", "64,1024,16384,65536", "message sizes in bytes")
+	flag.StringVar(&depths, "depths", "1,8,32", "queue depths for asynchronous and batched operations")
+	flag.StringVar(&conns, "conns", "1,4", "connection counts")
+	flag.IntVar(&cfg.iters, "iters", 10000, "operations per connection and case")
+	flag.BoolVar(&cfg.verbose, "v", false, "print connection setup progress")
+	flag.BoolVar(&cfg.cm, "cm", false, "connect with the RDMA CM, needs a build with -tags rdmacm")
+	flag.BoolVar(&cfg.warm, "warm", false, "connect case takes client QPs from a warm QP pool")
+	flag.Parse()
+
+	cfg.ops = strings.Split(ops, ",")
+	cfg.sizes = parseInts(sizes)
+	cfg.depths = parseInts(depths)
+	cfg.conns = parseInts(conns)
+	if cfg.verbose {
+		rdmahandler.SetLogLevel(rdmahandler.LogInfo)
+	} else {
+		rdmahandler.SetLogLevel(rdmahandler.LogError)
+	}
+
+	switch cfg.mode {
+	case "server":
+		for _, c := range plan(&cfg) {
+			if err := serveCase(&cfg, c); err != nil {
+				log.Fatalf("server: %v", err)
+			}
+		}
+	case "client":
+		runClient(&cfg)
+	case "loopback":
+		server := exec.Command(os.Args[0], serverArgs(os.Args[1:])...)
+		server.Stderr = os.Stderr
+		if err := server.Start(); err != nil {
+			log.Fatalf("failed to start server: %v", err)
+		}
+		runClient(&cfg)
+		if err := server.Wait(); err != nil {
+			log.Fatalf("server: %v", err)
+		}
+	default:
+		log.Fatalf("unknown mode %q", cfg.mode)
+	}
+}
+
+// serverArgs returns the arguments of the server child of loopback mode: the sweep flags
+// of `args` with the mode replaced by server. The flag package keeps the last value of a
+// flag, so the inherited mode must go rather than be overridden by a leading one.
+func serverArgs(args []string) []string {
+	out := []string{"-mode", "server"}
+	for i := 0; i < len(args); i++ {
+		switch a := args[i]; {
+		case a == "-mode" || a == "--mode":
+			i++
+		case strings.HasPrefix(a, "-mode=") || strings.HasPrefix(a, "--mode="):
+		default:
+			out = append(out, a)
+		}
+	}
+	return out
+}
+
+// plan lists the benchmark cases in the order both sides run them. Queue depth only
+// applies to the asynchronous and batched operations.
+func plan(cfg *config) []benchCase {
+	var cases []benchCase
+	for _, conns := range cfg.conns {
+		cases = append(cases, benchCase{op: "connect", depth: 1, conns: conns})
+		for _, op := range cfg.ops {
+			depths := []int{1}
+			if strings.HasPrefix(op, "async-") || strings.HasPrefix(op, "batch-") {
+				depths = cfg.depths
+			}
+			for _, size := range cfg.sizes {
+				for _, depth := range depths {
+					cases = append(cases, benchCase{op: op, size: size, depth: depth, conns: conns})
+				}
+			}
+		}
+	}
+	return cases
+}
+
+func runClient(cfg *config) {
+	enc := json.NewEncoder(os.Stdout)
+	for _, c := range plan(cfg) {
+		r := runCase(cfg, c)
+		if err := enc.Encode(r); err != nil {
+			log.Fatal(err)
+		}
+		if r.Error != "" {
+			log.Fatalf("client: %s", r.Error)
+		}
+	}
+}
+
+// handlerFor returns the handler settings a case runs with on both sides.
+func handlerFor(c benchCase) *rdmahandler.RDMAHandler {
+	return &rdmahandler.RDMAHandler{Notify: c.op == "notify", SendDepth: c.depth + 1}
+}
+
+// optionsFor returns the connection options a case runs with on both sides. The
+// receive slots are made large enough for the messages of a send case.
+func optionsFor(cfg *config, c benchCase, addr string, port int) rdmahandler.Options {
+	return rdmahandler.Options{Addr: addr, Port: port, MessageSize: max(c.size, 4096), CM: cfg.cm}
+}
+
+// dial connects to the server, retrying while the server is not listening yet.
+func dial(cfg *config, h *rdmahandler.RDMAHandler, c benchCase, port int) (*rdmahandler.RDMAResources, error) {
+	deadline := time.Now().Add(10 * time.Second)
+	for {
+		res, err := h.Dial(optionsFor(cfg, c, cfg.addr, port))
+		if err == nil || time.Now().After(deadline) {
+			return res, err
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
+
+// runCase runs one case on the client side, one goroutine per connection.
+func runCase(cfg *config, c benchCase) result {
+	r := result{Op: c.op, Size: c.size, Depth: c.depth, Conns: c.conns}
+	h := handlerFor(c)
+	if c.op == "connect" && cfg.warm {
+		pool, err := h.NewQPPool(optionsFor(cfg, c, "", 0), c.conns)
+		if err != nil {
+			r.Error = err.Error()
+			return r
+		}
+		defer pool.Close()
+		h.QPPool = pool
+	}
+
+	conns := make([]*rdmahandler.RDMAResources, c.conns)
+	setup := make([]time.Duration, 0, c.conns)
+	for i := range conns {
+		start := time.Now()
+		res, err := dial(cfg, h, c, cfg.port+i)
+		if err != nil {
+			r.Error = err.Error()
+			return r
+		}
+		setup = append(setup, time.Since(start))
+		conns[i] = res
+	}
+	defer func() {
+		for _, res := range conns {
+			h.Destroy(res)
+		}
+	}()
+	if c.op == "connect" {
+		r.Ops = len(setup)
+		for _, d := range setup {
+			r.Seconds += d.Seconds()
+		}
+		r.OpsPerSec = float64(r.Ops) / r.Seconds
+		fillPercentiles(&r, setup)
+		return r
+	}
+
+	var wg sync.WaitGroup
+	var mu sync.Mutex
+	var lats []time.Duration
+	var firstErr error
+	start := time.Now()
+	for _, res := range conns {
+		wg.Add(1)
+		go func(res *rdmahandler.RDMAResources) {
+			defer wg.Done()
+			l, err := clientLoop(cfg, h, res, c)
+			mu.Lock()
+			defer mu.Unlock()
+			lats = append(lats, l...)
+			if err != nil && firstErr == nil {
+				firstErr = err
+			}
+		}(res)
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	if firstErr != nil {
+		r.Error = firstErr.Error()
+		return r
+	}
+	r.Ops = len(lats)
+	r.Seconds = elapsed.Seconds()
+	r.OpsPerSec = float64(r.Ops) / r.Seconds
+	r.GBPerSec = float64(r.Ops) * float64(c.size) / r.Seconds / 1e9
+	fillPercentiles(&r, lats)
+	return r
+}
+
+// clientLoop drives one connection through a case and returns the latency of each
+// operation. Asynchronous operations keep `depth` operations in flight, each in its own
+// slot of the buffer, and end with a Write the server waits for. Batched operations post
+// `depth` operations at a time and count the latency of the batch for each of them.
+func clientLoop(cfg *config, h *rdmahandler.RDMAHandler, res *rdmahandler.RDMAResources, c benchCase) ([]time.Duration, error) {
+	payload := make([]byte, c.size)
+	lats := make([]time.Duration, 0, cfg.iters)
+
+	switch c.op {
+	case "write", "notify":
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if err := h.Write(res, payload, "client"); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+	case "read":
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if _, err := h.ReadInto(res, payload, "client"); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+	case "send":
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if err := h.Send(res, payload, "client"); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+		if _, err := h.Recv(res, "client"); err != nil {
+			return nil, err
+		}
+	case "large":
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if err := h.SendLarge(res, payload, "client"); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+	case "ring":
+		ring, err := h.OpenRing(res, "bench", ringSize(c), "client")
+		if err != nil {
+			return nil, err
+		}
+		defer ring.Close()
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if err := ring.Send(payload); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+		if _, err := ring.Recv(); err != nil {
+			return nil, err
+		}
+	case "rpc":
+		rpc := h.NewRPC(res, "client")
+		defer rpc.Close()
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if _, err := rpc.Call(1, payload); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+	case "fetch-add":
+		for i := 0; i < cfg.iters; i++ {
+			start := time.Now()
+			if _, err := h.FetchAdd(res, 0, 1, "client"); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(start))
+		}
+		if err := h.Write(res, nil, "client"); err != nil {
+			return nil, err
+		}
+	case "async-write", "async-read":
+		type pending struct {
+			c     *rdmahandler.Completion
+			start time.Time
+		}
+		inflight := make([]pending, 0, c.depth)
+		for i := 0; i < cfg.iters; i++ {
+			if len(inflight) == c.depth {
+				if err := inflight[0].c.Wait(); err != nil {
+					return nil, err
+				}
+				lats = append(lats, time.Since(inflight[0].start))
+				inflight = inflight[1:]
+			}
+			offset := (i % c.depth) * c.size
+			start := time.Now()
+			var comp *rdmahandler.Completion
+			var err error
+			if c.op == "async-write" {
+				comp, err = h.WriteAsync(res, offset, payload, "client")
+			} else {
+				comp, err = h.ReadAsync(res, offset, c.size, "client")
+			}
+			if err != nil {
+				return nil, err
+			}
+			inflight = append(inflight, pending{comp, start})
+		}
+		for _, p := range inflight {
+			if err := p.c.Wait(); err != nil {
+				return nil, err
+			}
+			lats = append(lats, time.Since(p.start))
+		}
+		if err := h.Write(res, nil, "client"); err != nil {
+			return nil, err
+		}
+	case "batch-write":
+		local, err := res.Borrow(c.depth * c.size)
+		if err != nil {
+			return nil, err
+		}
+		defer local.Release()
+		ops := make([]rdmahandler.BatchOp, c.depth)
+		for j := range ops {
+			seg := rdmahandler.Segment{Buf: local, Offset: j * c.size, Length: c.size}
+			ops[j] = rdmahandler.BatchOp{Kind: rdmahandler.BatchWrite, Local: seg, Offset: j * c.size}
+		}
+		for i := 0; i < cfg.iters; i += c.depth {
+			n := c.depth
+			if cfg.iters-i < n {
+				n = cfg.iters - i
+			}
+			start := time.Now()
+			comp, err := h.PostBatch(res, ops[:n], 0, "client")
+			if err != nil {
+				return nil, err
+			}
+			if err := comp.Wait(); err != nil {
+				return nil, err
+			}
+			lat := time.Since(start)
+			for j := 0; j < n; j++ {
+				lats = append(lats, lat)
+			}
+		}
+		if err := h.Write(res, nil, "client"); err != nil {
+			return nil, err
+		}
+	default:
+		return nil, fmt.Errorf("unknown operation %q", c.op)
+	}
+	return lats, nil
+}
+
+// serveCase accepts the connections of one case and plays the passive side of it.
+func serveCase(cfg *config, c benchCase) error {
+	h := handlerFor(c)
+	conns := make([]*rdmahandler.RDMAResources, c.conns)
+	for i := range conns {
+		res, err := h.Dial(optionsFor(cfg, c, "", cfg.port+i))
+		if err != nil {
+			return err
+		}
+		conns[i] = res
+	}
+	defer func() {
+		for _, res := range conns {
+			h.Destroy(res)
+		}
+	}()
+
+	var wg sync.WaitGroup
+	errs := make(chan error, len(conns))
+	for _, res := range conns {
+		wg.Add(1)
+		go func(res *rdmahandler.RDMAResources) {
+			defer wg.Done()
+			errs <- serverLoop(cfg, h, res, c)
+		}(res)
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func serverLoop(cfg *config, h *rdmahandler.RDMAHandler, res *rdmahandler.RDMAResources, c benchCase) error {
+	buf := make([]byte, c.size)
+	switch c.op {
+	case "connect":
+	case "write", "notify":
+		for i := 0; i < cfg.iters; i++ {
+			if _, err := h.ReadInto(res, buf, "server"); err != nil {
+				return err
+			}
+		}
+	case "read":
+		for i := 0; i < cfg.iters; i++ {
+			if err := h.Write(res, buf, "server"); err != nil {
+				return err
+			}
+		}
+	case "send":
+		for i := 0; i < cfg.iters; i++ {
+			if _, err := h.Recv(res, "server"); err != nil {
+				return err
+			}
+		}
+		return h.Send(res, nil, "server")
+	case "large":
+		for i := 0; i < cfg.iters; i++ {
+			if _, err := h.RecvStream(res, io.Discard, "server"); err != nil {
+				return err
+			}
+		}
+	case "rpc":
+		rpc := h.NewRPC(res, "server")
+		rpc.Handle(1, func(req []byte) ([]byte, error) {
+			return req, nil
+		})
+		<-rpc.Done()
+	case "ring":
+		ring, err := h.OpenRing(res, "bench", ringSize(c), "server")
+		if err != nil {
+			return err
+		}
+		defer ring.Close()
+		for i := 0; i < cfg.iters; i++ {
+			if _, err := ring.Recv(); err != nil {
+				return err
+			}
+		}
+		return ring.Send(nil)
+	default:
+		if _, err := h.Read(res, "server"); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// ringSize returns the ring size of a case, large enough for four messages.
+func ringSize(c benchCase) int {
+	return max(1<<20, (4*(c.size+48)+15)&^15)
+}
+
+// fillPercentiles stores the p50, p99 and p999 of `lats` in microseconds.
+func fillPercentiles(r *result, lats []time.Duration) {
+	if len(lats) == 0 {
+		return
+	}
+	sort.Slice(lats, func(i, j int) bool { return lats[i] < lats[j] })
+	at := func(p float64) float64 {
+		i := int(p * float64(len(lats)))
+		if i >= len(lats) {
+			i = len(lats) - 1
+		}
+		return float64(lats[i].Nanoseconds()) / 1e3
+	}
+	r.P50us = at(0.50)
+	r.P99us = at(0.99)
+	r.P999us = at(0.999)
+}
+
+func parseInts(s string) []int {
+	var out []int
+	for _, f := range strings.Split(s, ",") {
+		n, err := strconv.Atoi(strings.TrimSpace(f))
+		if err != nil {
+			log.Fatalf("invalid number %q", f)
+		}
+		out = append(out, n)
+	}
+	return out
+}
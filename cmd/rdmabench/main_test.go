@@ -0,0 +1,25 @@
+package main
+
+import (
+	"reflect"
+	"testing"
+)
+
+func TestServerArgs(t *testing.T) {
+	tests := []struct {
+		args []string
+		want []string
+	}{
+		{nil, []string{"-mode", "server"}},
+		{[]string{"-mode", "loopback", "-addr", "10.0.0.1"}, []string{"-mode", "server", "-addr", "10.0.0.1"}},
+		{[]string{"-addr", "10.0.0.1", "--mode", "loopback", "-sizes", "64"},
+			[]string{"-mode", "server", "-addr", "10.0.0.1", "-sizes", "64"}},
+		{[]string{"-mode=loopback", "-iters", "10", "--mode=loopback"}, []string{"-mode", "server", "-iters", "10"}},
+		{[]string{"-modes", "x"}, []string{"-mode", "server", "-modes", "x"}},
+	}
+	for _, tt := range tests {
+		if got := serverArgs(tt.args); !reflect.DeepEqual(got, tt.want) {
+			t.Errorf("serverArgs(%q) = %q, want %q", tt.args, got, tt.want)
+		}
+	}
+}
@@ -0,0 +1,413 @@
+#include <rdma_operations.h>
+
+/******************************************************************************
+Completion queue operations
+A completion queue is either private to one connection or shared by several
+connections opened on the same device. Completions are drained in batches and
+dispatched to the connection owning the QP they belong to, so one thread can
+make progress on behalf of every connection attached to the queue.
+******************************************************************************/
+/******************************************************************************
+ * Function: comp_queue_create
+ *
+ * Input
+ * ib_ctx device context to create the CQ on
+ * cqe initial number of CQ entries
+ * blocking create a completion channel so waiters can sleep
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new queue with one reference held by the caller, NULL on failure
+ *
+ * Description
+ * Create a completion queue on an already opened device. The device context
+ * stays owned by the caller.
+ ******************************************************************************/
+struct comp_queue *comp_queue_create(struct ibv_context *ib_ctx, int cqe, int blocking)
+{
+	struct ibv_device_attr device_attr;
+	struct comp_queue *q;
+	pthread_condattr_t condattr;
+
+	if (ibv_query_device(ib_ctx, &device_attr))
+	{
+		log_error("ibv_query_device failed\n");
+		return NULL;
+	}
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+	{
+		log_error("failed to allocate completion queue\n");
+		return NULL;
+	}
+	q->ib_ctx = ib_ctx;
+	q->max_cqe = device_attr.max_cqe;
+	q->cqe = cqe < q->max_cqe ? cqe : q->max_cqe;
+	q->refcnt = 1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	if (blocking)
+	{
+		q->channel = ibv_create_comp_channel(ib_ctx);
+		if (!q->channel)
+		{
+			log_error("failed to create completion channel\n");
+			goto comp_queue_create_exit;
+		}
+	}
+
+	q->cq = ibv_create_cq(ib_ctx, q->cqe, NULL, q->channel, 0);
+	if (!q->cq)
+	{
+		log_error("failed to create CQ with %u entries\n", q->cqe);
+		goto comp_queue_create_exit;
+	}
+	return q;
+
+comp_queue_create_exit:
+	if (q->channel)
+		ibv_destroy_comp_channel(q->channel);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+	return NULL;
+}
+/******************************************************************************
+ * Function: comp_queue_open
+ *
+ * Input
+ * dev_name IB device name, NULL for the first device found
+ * ib_port IB port of the connections sharing the queue, 0 for the default
+ * cqe initial number of CQ entries
+ * blocking create a completion channel so waiters can sleep
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new queue with one reference held by the caller, NULL on failure
+ *
+ * Description
+ * Create a completion queue that connections can share on a device taken
+ * from the device cache, which keeps a device per IB port. The queue holds a
+ * reference to the device.
+ ******************************************************************************/
+struct comp_queue *comp_queue_open(const char *dev_name, int ib_port, int cqe, int blocking)
+{
+	struct rdma_device *dev;
+	struct comp_queue *q;
+
+	dev = device_get(dev_name, ib_port ? ib_port : config.ib_port);
+	if (!dev)
+		return NULL;
+
+	q = comp_queue_create(dev->ib_ctx, cqe, blocking);
+	if (!q)
+	{
+		device_put(dev);
+		return NULL;
+	}
+	q->dev = dev;
+	return q;
+}
+/******************************************************************************
+ * Function: comp_queue_hold
+ *
+ * Input
+ * q completion queue
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Take a reference to the queue.
+ ******************************************************************************/
+void comp_queue_hold(struct comp_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->refcnt++;
+	pthread_mutex_unlock(&q->lock);
+}
+/******************************************************************************
+ * Function: comp_queue_put
+ *
+ * Input
+ * q completion queue
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Drop a reference to the queue and destroy it with the last one.
+ ******************************************************************************/
+int comp_queue_put(struct comp_queue *q)
+{
+	int rc = 0;
+	int last;
+
+	pthread_mutex_lock(&q->lock);
+	last = --q->refcnt == 0;
+	pthread_mutex_unlock(&q->lock);
+	if (!last)
+		return 0;
+
+	if (ibv_destroy_cq(q->cq))
+	{
+		log_error("failed to destroy CQ\n");
+		rc = 1;
+	}
+	if (q->channel)
+		if (ibv_destroy_comp_channel(q->channel))
+		{
+			log_error("failed to destroy completion channel\n");
+			rc = 1;
+		}
+	if (q->dev)
+		if (device_put(q->dev))
+			rc = 1;
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q->table);
+	free(q);
+	return rc;
+}
+/******************************************************************************
+ * Function: table_slot
+ *
+ * Input
+ * table open addressed table of attached connections
+ * size number of slots, a power of two
+ * qp_num QP number to look up
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the slot holding qp_num, or the empty slot where it would be inserted
+ *
+ * Description
+ * Linear probing lookup in the dispatch table.
+ ******************************************************************************/
+static struct cq_entry *table_slot(struct cq_entry *table, uint32_t size, uint32_t qp_num)
+{
+	uint32_t i = (qp_num * 2654435761u) & (size - 1);
+
+	while (table[i].res && table[i].qp_num != qp_num)
+		i = (i + 1) & (size - 1);
+	return &table[i];
+}
+/******************************************************************************
+ * Function: table_grow
+ *
+ * Input
+ * q completion queue, locked
+ *
+ * Output
+ * q->table has room for at least one more connection
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Keep the dispatch table at most half full, doubling it when needed.
+ ******************************************************************************/
+static int table_grow(struct comp_queue *q)
+{
+	struct cq_entry *table;
+	uint32_t size;
+	uint32_t i;
+
+	if ((q->table_used + 1) * 2 <= q->table_size)
+		return 0;
+
+	size = q->table_size ? q->table_size * 2 : 8;
+	table = calloc(size, sizeof(*table));
+	if (!table)
+	{
+		log_error("failed to grow completion dispatch table\n");
+		return 1;
+	}
+	for (i = 0; i < q->table_size; i++)
+		if (q->table[i].res)
+			*table_slot(table, size, q->table[i].qp_num) = q->table[i];
+	free(q->table);
+	q->table = table;
+	q->table_size = size;
+	return 0;
+}
+/******************************************************************************
+ * Function: comp_queue_attach
+ *
+ * Input
+ * q completion queue
+ * res connection whose QP was created on q->cq
+ * cqe number of CQ entries the connection may occupy at once
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Register the connection for completion dispatch and take a reference to the
+ * queue on its behalf. The CQ is resized when the attached connections could
+ * otherwise overrun it.
+ ******************************************************************************/
+int comp_queue_attach(struct comp_queue *q, struct resources *res, int cqe)
+{
+	struct cq_entry *slot;
+	int need;
+	int rc = 1;
+
+	pthread_mutex_lock(&q->lock);
+	need = q->reserved + cqe;
+	if (need > q->cqe)
+	{
+		if (need > q->max_cqe || ibv_resize_cq(q->cq, need))
+		{
+			log_error("failed to resize CQ to %d entries\n", need);
+			goto comp_queue_attach_exit;
+		}
+		q->cqe = need;
+	}
+	if (table_grow(q))
+		goto comp_queue_attach_exit;
+
+	slot = table_slot(q->table, q->table_size, res->qp->qp_num);
+	slot->qp_num = res->qp->qp_num;
+	slot->res = res;
+	q->table_used++;
+	q->reserved = need;
+	q->refcnt++;
+	rc = 0;
+
+comp_queue_attach_exit:
+	pthread_mutex_unlock(&q->lock);
+	return rc;
+}
+/******************************************************************************
+ * Function: comp_queue_detach
+ *
+ * Input
+ * q completion queue
+ * res attached connection
+ * cqe number of CQ entries reserved by comp_queue_attach
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Stop dispatching completions to the connection. Completions of its QP still
+ * in the CQ are dropped when found. The reference taken by comp_queue_attach
+ * is not dropped, the caller does so with comp_queue_put.
+ ******************************************************************************/
+void comp_queue_detach(struct comp_queue *q, struct resources *res, int cqe)
+{
+	struct cq_entry *slot;
+	struct cq_entry moved;
+	uint32_t i;
+
+	pthread_mutex_lock(&q->lock);
+	slot = q->table_size ? table_slot(q->table, q->table_size, res->qp->qp_num) : NULL;
+	if (slot && slot->res == res)
+	{
+		slot->res = NULL;
+		q->table_used--;
+		q->reserved -= cqe;
+		/* re-insert the rest of the probe cluster so lookups stay correct */
+		i = (slot - q->table + 1) & (q->table_size - 1);
+		while (q->table[i].res)
+		{
+			moved = q->table[i];
+			q->table[i].res = NULL;
+			*table_slot(q->table, q->table_size, moved.qp_num) = moved;
+			i = (i + 1) & (q->table_size - 1);
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+/******************************************************************************
+ * Function: comp_queue_drain
+ *
+ * Input
+ * q completion queue, locked by the caller
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * number of completions dispatched, -1 if polling the CQ failed
+ *
+ * Description
+ * Poll up to POLL_BATCH completions in one call and dispatch each of them to
+ * the connection owning its QP.
+ ******************************************************************************/
+int comp_queue_drain(struct comp_queue *q)
+{
+	struct ibv_wc wc[POLL_BATCH];
+	struct cq_entry *slot;
+	int poll_result;
+	int i;
+
+	poll_result = ibv_poll_cq(q->cq, POLL_BATCH, wc);
+	if (poll_result < 0)
+	{
+		log_error("poll CQ failed\n");
+		return -1;
+	}
+	for (i = 0; i < poll_result; i++)
+	{
+		slot = q->table_size ? table_slot(q->table, q->table_size, wc[i].qp_num) : NULL;
+		if (slot && slot->res)
+			process_wc(slot->res, &wc[i]);
+	}
+	return poll_result;
+}
+/******************************************************************************
+ * Function: comp_queue_poll
+ *
+ * Input
+ * q completion queue
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * number of completions dispatched, -1 on failure
+ *
+ * Description
+ * Dispatch the completions currently in the CQ without waiting, for use by a
+ * progress loop serving every attached connection. Nothing is done when a
+ * waiter is already driving the queue.
+ ******************************************************************************/
+int comp_queue_poll(struct comp_queue *q)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (!q->polling)
+	{
+		n = comp_queue_drain(q);
+		if (n > 0)
+			pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
@@ -0,0 +1,425 @@
+#include <rdma_operations.h>
+
+/******************************************************************************
+Device operations
+An opened device context together with a protection domain on it and the
+attributes of the device and port. Devices are cached process wide by device
+name and IB port, so every connection and completion queue on the same port
+shares one context, PD and memory pool instead of opening the device,
+querying it and allocating a PD of its own. A device stays open while a
+reference is held.
+******************************************************************************/
+static struct rdma_device *devices;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+ * Function: device_locality
+ *
+ * Input
+ * dev device whose name is set
+ *
+ * Output
+ * dev->numa_node and dev->local_cpus describe where the device is attached
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Read the NUMA node of the device and the CPUs local to it from sysfs. Both
+ * are left unknown when sysfs does not tell, e.g. for software devices.
+ ******************************************************************************/
+static void device_locality(struct rdma_device *dev)
+{
+	char path[128];
+	char list[1024];
+	char *p;
+	FILE *f;
+	long first;
+	long last;
+
+	dev->numa_node = -1;
+	CPU_ZERO(&dev->local_cpus);
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", dev->name);
+	f = fopen(path, "r");
+	if (f)
+	{
+		if (fscanf(f, "%d", &dev->numa_node) != 1)
+			dev->numa_node = -1;
+		fclose(f);
+	}
+
+	/* a list of ranges like "0-15,32-47" */
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/local_cpulist", dev->name);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	p = fgets(list, sizeof(list), f);
+	fclose(f);
+	while (p && *p >= '0' && *p <= '9')
+	{
+		first = last = strtol(p, &p, 10);
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, &dev->local_cpus);
+		if (*p == ',')
+			p++;
+	}
+	log_info("device %s is on NUMA node %d with %d local CPU(s)\n", dev->name, dev->numa_node,
+			CPU_COUNT(&dev->local_cpus));
+}
+
+/******************************************************************************
+ * Function: device_open
+ *
+ * Input
+ * dev_name IB device name, NULL for the first device found
+ * ib_port IB port to query
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new device with one reference held by the caller, NULL on failure
+ *
+ * Description
+ * Open a device, query it and the port, find the NUMA node it is attached
+ * to, and allocate a PD and a memory pool on it.
+ ******************************************************************************/
+static struct rdma_device *device_open(const char *dev_name, int ib_port)
+{
+	struct ibv_device **dev_list;
+	struct rdma_device *dev;
+	int num_devices;
+	int mr_flags;
+	int i;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+	{
+		log_error("failed to allocate device\n");
+		return NULL;
+	}
+
+	log_info("searching for IB devices in host\n");
+	dev_list = ibv_get_device_list(&num_devices);
+	if (!dev_list)
+	{
+		log_error("failed to get IB devices list\n");
+		goto device_open_exit;
+	}
+	log_info("found %d device(s)\n", num_devices);
+	for (i = 0; i < num_devices; i++)
+	{
+		if (!dev_name || !strcmp(ibv_get_device_name(dev_list[i]), dev_name))
+		{
+			if (!dev_name)
+				log_info("device not specified, using first one found: %s\n",
+						ibv_get_device_name(dev_list[i]));
+			snprintf(dev->name, sizeof(dev->name), "%s", ibv_get_device_name(dev_list[i]));
+			dev->ib_ctx = ibv_open_device(dev_list[i]);
+			break;
+		}
+	}
+	ibv_free_device_list(dev_list);
+	if (!dev->ib_ctx)
+	{
+		log_error("failed to open IB device %s\n", dev_name ? dev_name : "(any)");
+		goto device_open_exit;
+	}
+
+	if (ibv_query_port(dev->ib_ctx, ib_port, &dev->port_attr))
+	{
+		log_error("ibv_query_port on port %u failed\n", ib_port);
+		goto device_open_exit;
+	}
+	if (ibv_query_device(dev->ib_ctx, &dev->device_attr))
+	{
+		log_error("ibv_query_device failed\n");
+		goto device_open_exit;
+	}
+	dev->pd = ibv_alloc_pd(dev->ib_ctx);
+	if (!dev->pd)
+	{
+		log_error("ibv_alloc_pd failed\n");
+		goto device_open_exit;
+	}
+	device_locality(dev);
+	mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	/* registering for atomics fails on devices without them */
+	if (dev->device_attr.atomic_cap != IBV_ATOMIC_NONE)
+		mr_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+	dev->pool = mem_pool_create(dev->pd, dev->numa_node, mr_flags);
+	if (!dev->pool)
+		goto device_open_exit;
+	dev->ib_port = ib_port;
+	dev->any_name = !dev_name;
+	dev->refcnt = 1;
+	return dev;
+
+device_open_exit:
+	if (dev->pd)
+		ibv_dealloc_pd(dev->pd);
+	if (dev->ib_ctx)
+		ibv_close_device(dev->ib_ctx);
+	free(dev);
+	return NULL;
+}
+/******************************************************************************
+ * Function: device_get
+ *
+ * Input
+ * dev_name IB device name, NULL for the first device found
+ * ib_port IB port the device is used with
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the device with a reference held by the caller, NULL on failure
+ *
+ * Description
+ * Look the device up in the cache, opening and caching it on first use.
+ * Lookups without a name reuse the device opened by the first such lookup.
+ ******************************************************************************/
+struct rdma_device *device_get(const char *dev_name, int ib_port)
+{
+	struct rdma_device *dev;
+
+	pthread_mutex_lock(&devices_lock);
+	for (dev = devices; dev; dev = dev->next)
+	{
+		if (dev->ib_port != ib_port)
+			continue;
+		if (dev_name ? !strcmp(dev->name, dev_name) : dev->any_name)
+		{
+			dev->refcnt++;
+			goto device_get_exit;
+		}
+	}
+
+	/* opened under the lock so concurrent connections do not open it twice */
+	dev = device_open(dev_name, ib_port);
+	if (dev)
+	{
+		dev->next = devices;
+		devices = dev;
+	}
+
+device_get_exit:
+	pthread_mutex_unlock(&devices_lock);
+	return dev;
+}
+/******************************************************************************
+ * Function: device_hold
+ *
+ * Input
+ * dev device
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Take another reference to a device the caller already holds one to.
+ ******************************************************************************/
+void device_hold(struct rdma_device *dev)
+{
+	pthread_mutex_lock(&devices_lock);
+	dev->refcnt++;
+	pthread_mutex_unlock(&devices_lock);
+}
+/******************************************************************************
+ * Function: device_put
+ *
+ * Input
+ * dev device
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Drop a reference to the device. The last one removes it from the cache,
+ * deallocates the PD and closes the device context.
+ ******************************************************************************/
+int device_put(struct rdma_device *dev)
+{
+	struct rdma_device **link;
+	int rc = 0;
+
+	pthread_mutex_lock(&devices_lock);
+	if (--dev->refcnt)
+	{
+		pthread_mutex_unlock(&devices_lock);
+		return 0;
+	}
+	for (link = &devices; *link; link = &(*link)->next)
+	{
+		if (*link == dev)
+		{
+			*link = dev->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	if (dev->watching)
+	{
+		__atomic_store_n(&dev->stop, 1, __ATOMIC_RELAXED);
+		pthread_join(dev->events, NULL);
+	}
+	if (mem_pool_destroy(dev->pool))
+		rc = 1;
+	if (ibv_dealloc_pd(dev->pd))
+	{
+		log_error("failed to deallocate PD\n");
+		rc = 1;
+	}
+	if (ibv_close_device(dev->ib_ctx))
+	{
+		log_error("failed to close device context\n");
+		rc = 1;
+	}
+	free(dev);
+	return rc;
+}
+/******************************************************************************
+ * Function: device_pin_thread
+ *
+ * Input
+ * dev device
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Restrict the calling thread to the CPUs local to the device, so a thread
+ * polling its completion queues runs on the NIC's NUMA node. Fails when the
+ * local CPUs are unknown.
+ ******************************************************************************/
+int device_pin_thread(struct rdma_device *dev)
+{
+	int rc;
+
+	if (!CPU_COUNT(&dev->local_cpus))
+	{
+		log_error("CPUs local to device %s are unknown\n", dev->name);
+		return 1;
+	}
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(dev->local_cpus), &dev->local_cpus);
+	if (rc)
+	{
+		log_error("failed to set CPU affinity: %s\n", strerror(rc));
+		return 1;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: device_events
+ *
+ * Input
+ * arg device whose asynchronous events are handled
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * NULL
+ *
+ * Description
+ * Thread body reading the asynchronous events of a device until told to
+ * stop. Shared receive queues reaching their low watermark are refilled, QPs
+ * on a shared receive queue that will consume no more of its receives are
+ * marked for resources_recycle, other events are logged. Every event is
+ * acknowledged once handled, which lets the destruction of the object it
+ * refers to proceed.
+ ******************************************************************************/
+static void *device_events(void *arg)
+{
+	struct rdma_device *dev = arg;
+	struct ibv_async_event event;
+	struct resources *res;
+	struct pollfd pfd;
+
+	while (!__atomic_load_n(&dev->stop, __ATOMIC_RELAXED))
+	{
+		pfd.fd = dev->ib_ctx->async_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		/* wake up regularly to notice device_put asking to stop */
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (ibv_get_async_event(dev->ib_ctx, &event))
+			continue;
+
+		switch (event.event_type)
+		{
+		case IBV_EVENT_SRQ_LIMIT_REACHED:
+			shared_rq_limit_reached(event.element.srq->srq_context);
+			break;
+		case IBV_EVENT_QP_LAST_WQE_REACHED:
+			res = event.element.qp->qp_context;
+			__atomic_store_n(&res->last_wqe, 1, __ATOMIC_RELEASE);
+			break;
+		default:
+			log_info("asynchronous event on device %s: %s\n", dev->name,
+					ibv_event_type_str(event.event_type));
+			break;
+		}
+		ibv_ack_async_event(&event);
+	}
+	return NULL;
+}
+/******************************************************************************
+ * Function: device_watch
+ *
+ * Input
+ * dev device
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Start the thread handling the asynchronous events of the device, unless it
+ * is already running. It runs until the device is closed.
+ ******************************************************************************/
+int device_watch(struct rdma_device *dev)
+{
+	int flags;
+	int rc = 0;
+
+	pthread_mutex_lock(&devices_lock);
+	if (dev->watching)
+		goto device_watch_exit;
+
+	flags = fcntl(dev->ib_ctx->async_fd, F_GETFL);
+	if (flags < 0 || fcntl(dev->ib_ctx->async_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		log_error("failed to make the asynchronous event channel non-blocking\n");
+		rc = 1;
+		goto device_watch_exit;
+	}
+	if (pthread_create(&dev->events, NULL, device_events, dev))
+	{
+		log_error("failed to start asynchronous event thread\n");
+		rc = 1;
+		goto device_watch_exit;
+	}
+	dev->watching = 1;
+
+device_watch_exit:
+	pthread_mutex_unlock(&devices_lock);
+	return rc;
+}
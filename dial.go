@@ -0,0 +1,187 @@
+package rdmahandler
+
+import (
+	"fmt"
+	"sync"
+)
+
+// minBufferSize is the smallest registered buffer a connection can be created with.
+const minBufferSize = 4096
+
+// minMessageSize is the smallest receive slot a connection can be created with, enough
+// for the control messages of large transfers.
+const minMessageSize = 64
+
+// Options holds the parameters of a single connection. Every field is optional except
+// the port; zero values select the defaults.
+//
+// Addr is the address of the server to connect to. If it is empty, the connection waits
+// for a client on Port instead, like InitServer. Device names the IB device to use, the
+// first one found if empty, and IBPort the port on it, 1 if zero. GIDIndex selects the
+// local GID used for routing, as RoCE requires; -1 disables GID routing, which only works
+// on InfiniBand within one subnet. BufferSize sets the size of the registered buffer and
+// thereby the largest message, 10 MiB if zero; both peers must use the same size.
+//
+// The queue pair attributes are negotiated during the handshake: the path MTU is the
+// smaller of the active MTUs of both ports, and the number of RDMA reads and atomics in
+// flight the smaller of what the initiating and the responding device support. MTU, in
+// bytes from 256 to 4096, and MaxReadAtomic lower the values offered by this side.
+// MinRNRTimer, AckTimeout, RetryCount and RNRRetry set the corresponding QP attributes
+// in their IB encoding; zero keeps the defaults of 0x12, 0x12, 6 and 0, so an infinite
+// ACK timeout cannot be requested.
+//
+// MessageSize sets the size of the slots of the receive ring used by Send and Recv, and
+// thereby the largest message they carry, 4 KiB if zero; both peers must use the same
+// size. RecvDepth sets the number of slots, that is how many messages the peer can send
+// before this side receives them, 64 if zero. Connections on a SharedRQ take their
+// message size from the queue instead.
+//
+// CM sets the connection up with the RDMA connection manager instead of over a TCP
+// connection: Addr and Port then name the peer's IP address and RDMA CM port, the CM
+// resolves the route and thereby the device, port and GID to use, ignoring Device,
+// IBPort and GIDIndex, and the connection data travels in the private data of the
+// connect request and reply. Without a TCP socket, Write and Read need Notify and
+// ExchangeRegions is not available. Both peers must set it, and it requires building
+// with the rdmacm tag, which links librdmacm.
+//
+// The options are kept with the connection rather than in process-wide state, so any
+// number of connections with different options can be set up at the same time.
+type Options struct {
+	Addr          string
+	Port          int
+	Device        string
+	IBPort        int
+	GIDIndex      int
+	BufferSize    int
+	MTU           int
+	MaxReadAtomic int
+	MinRNRTimer   int
+	AckTimeout    int
+	RetryCount    int
+	RNRRetry      int
+	MessageSize   int
+	RecvDepth     int
+	CM            bool
+}
+
+// QPAttributes reports the queue pair attributes negotiated for a connection.
+// MaxReadAtomic is the number of RDMA reads and atomics the connection can have in
+// flight towards the peer, MaxDestReadAtomic the number the peer can have in flight
+// towards it. MaxInline is the largest payload sent inline in the work request, and
+// MaxSGE and MaxReadSGE the number of scatter/gather entries a work request takes for
+// writes and reads.
+type QPAttributes struct {
+	MTU               int
+	MaxReadAtomic     int
+	MaxDestReadAtomic int
+	MaxInline         int
+	MaxSGE            int
+	MaxReadSGE        int
+}
+
+// QPAttributes returns the queue pair attributes negotiated with the peer.
+func (res *RDMAResources) QPAttributes() QPAttributes {
+	return QPAttributes{
+		MTU:               128 << int(res.res.path_mtu),
+		MaxReadAtomic:     int(res.res.max_rd_atomic),
+		MaxDestReadAtomic: int(res.res.max_dest_rd_atomic),
+		MaxInline:         int(res.res.max_inline),
+		MaxSGE:            int(res.res.max_send_sge),
+		MaxReadSGE:        int(res.res.max_read_sge),
+	}
+}
+
+// mtuEnum converts an MTU in bytes to enum ibv_mtu.
+func mtuEnum(mtu int) (int, error) {
+	for e, size := 1, 256; size <= 4096; e, size = e+1, size*2 {
+		if mtu == size {
+			return e, nil
+		}
+	}
+	return 0, fmt.Errorf("invalid MTU %d", mtu)
+}
+
+// check validates the options that newResources cannot pass on unchecked.
+func (opts *Options) check() error {
+	if opts.BufferSize != 0 && opts.BufferSize < minBufferSize {
+		return fmt.Errorf("buffer size %d is below the minimum of %d bytes", opts.BufferSize, minBufferSize)
+	}
+	if opts.MTU != 0 {
+		if _, err := mtuEnum(opts.MTU); err != nil {
+			return err
+		}
+	}
+	if opts.MaxReadAtomic < 0 || opts.MaxReadAtomic > 255 {
+		return fmt.Errorf("invalid number of reads in flight %d", opts.MaxReadAtomic)
+	}
+	if opts.MinRNRTimer < 0 || opts.MinRNRTimer > 31 || opts.AckTimeout < 0 || opts.AckTimeout > 31 {
+		return fmt.Errorf("QP timers must be between 0 and 31")
+	}
+	if opts.MessageSize < 0 || opts.MessageSize > 0 && opts.MessageSize < minMessageSize || opts.RecvDepth < 0 {
+		return fmt.Errorf("invalid receive ring of %d slots of %d bytes", opts.RecvDepth, opts.MessageSize)
+	}
+	if opts.RetryCount < 0 || opts.RetryCount > 7 || opts.RNRRetry < 0 || opts.RNRRetry > 7 {
+		return fmt.Errorf("QP retry counts must be between 0 and 7")
+	}
+	return nil
+}
+
+// Dial establishes a connection with the given options. It is safe to call from several
+// goroutines at once.
+//
+// On success, it returns a pointer to the initialized RDMAResources and nil error. On
+// failure, it returns nil and the error encountered.
+//
+// Example:
+//
+//	res, err := h.Dial(rdmahandler.Options{Addr: "192.168.1.10", Port: 8080, Device: "mlx5_1"})
+//	if err != nil {
+//	    log.Fatalf("Failed to connect: %v", err)
+//	}
+func (h *RDMAHandler) Dial(opts Options) (*RDMAResources, error) {
+	return initRDMAConnection(opts, h)
+}
+
+// DialMany establishes one connection per entry of `opts` concurrently, so setting up N
+// connections takes about as long as the slowest one rather than the sum of all.
+//
+// On success, it returns the connections in the order of `opts` and nil error. If any
+// connection fails, the ones that succeeded are destroyed and it returns nil and the
+// first error encountered.
+//
+// Example:
+//
+//	var opts []rdmahandler.Options
+//	for _, node := range cluster {
+//	    opts = append(opts, rdmahandler.Options{Addr: node, Port: 8080})
+//	}
+//	conns, err := h.DialMany(opts)
+//	if err != nil {
+//	    log.Fatalf("Failed to connect to cluster: %v", err)
+//	}
+func (h *RDMAHandler) DialMany(opts []Options) ([]*RDMAResources, error) {
+	conns := make([]*RDMAResources, len(opts))
+	errs := make([]error, len(opts))
+
+	var wg sync.WaitGroup
+	for i := range opts {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			conns[i], errs[i] = h.Dial(opts[i])
+		}(i)
+	}
+	wg.Wait()
+
+	for i, err := range errs {
+		if err != nil {
+			for _, res := range conns {
+				if res != nil {
+					h.Destroy(res)
+				}
+			}
+			return nil, fmt.Errorf("connection %d to %s:%d: %v", i, opts[i].Addr, opts[i].Port, err)
+		}
+	}
+	return conns, nil
+}
@@ -0,0 +1,58 @@
+package rdmahandler
+
+import "testing"
+
+func TestMTUEnum(t *testing.T) {
+	tests := []struct {
+		mtu     int
+		want    int
+		wantErr bool
+	}{
+		{256, 1, false},
+		{512, 2, false},
+		{1024, 3, false},
+		{2048, 4, false},
+		{4096, 5, false},
+		{0, 0, true},
+		{128, 0, true},
+		{1500, 0, true},
+		{8192, 0, true},
+		{-1024, 0, true},
+	}
+	for _, tt := range tests {
+		got, err := mtuEnum(tt.mtu)
+		if (err != nil) != tt.wantErr || got != tt.want {
+			t.Errorf("mtuEnum(%d) = %d, %v, want %d, error %v", tt.mtu, got, err, tt.want, tt.wantErr)
+		}
+	}
+}
+
+func TestOptionsCheck(t *testing.T) {
+	tests := []struct {
+		name    string
+		opts    Options
+		wantErr bool
+	}{
+		{"defaults", Options{}, false},
+		{"everything set", Options{BufferSize: 1 << 20, MTU: 1024, MaxReadAtomic: 16, MinRNRTimer: 12, AckTimeout: 14,
+			RetryCount: 7, RNRRetry: 7, MessageSize: 4096, RecvDepth: 64}, false},
+		{"minimum buffer", Options{BufferSize: minBufferSize}, false},
+		{"small buffer", Options{BufferSize: minBufferSize - 1}, true},
+		{"odd MTU", Options{MTU: 1500}, true},
+		{"negative reads in flight", Options{MaxReadAtomic: -1}, true},
+		{"too many reads in flight", Options{MaxReadAtomic: 256}, true},
+		{"RNR timer", Options{MinRNRTimer: 32}, true},
+		{"ack timeout", Options{AckTimeout: -1}, true},
+		{"minimum message", Options{MessageSize: minMessageSize}, false},
+		{"small message", Options{MessageSize: minMessageSize - 1}, true},
+		{"negative message", Options{MessageSize: -1}, true},
+		{"negative receive depth", Options{RecvDepth: -1}, true},
+		{"retry count", Options{RetryCount: 8}, true},
+		{"RNR retry", Options{RNRRetry: -1}, true},
+	}
+	for _, tt := range tests {
+		if err := tt.opts.check(); (err != nil) != tt.wantErr {
+			t.Errorf("%s: check() = %v, want error %v", tt.name, err, tt.wantErr)
+		}
+	}
+}
@@ -8,8 +8,8 @@ package rdmahandler
 */
 import "C"
 import (
-	"encoding/binary"
 	"fmt"
+	"time"
 	"unsafe"
 )
 
@@ -36,7 +36,46 @@ type RDMACommunicator interface {
 //	}
 //	// Use handler to perform RDMA operations
 //	...
-type RDMAHandler struct{}
+//
+// Setting Notify makes the connections created by the handler signal message arrival
+// over the queue pair itself: Write pushes the frame into the peer's receive area with
+// an RDMA write with immediate, Read waits for that completion and hands the area back
+// with a credit, and the TCP socket is only used during connection setup. Both peers
+// must use the same setting. In this mode the registered buffer is split into a send
+// and a receive area, halving the maximum message size.
+//
+// SendDepth sets how many send work requests a connection can have in flight, which
+// bounds the number of outstanding asynchronous operations, and CQDepth the size of its
+// completion queue. Zero selects the defaults; the completion queue is never made
+// smaller than the send and receive queues it serves.
+//
+// By default waiting for a completion busy-polls the completion queue. Setting Blocking
+// attaches a completion channel instead: a waiter polls for SpinTime, then arms the queue
+// and sleeps until the next completion, so idle connections cost no CPU. Timeout bounds
+// every wait on the connection and can be changed later with SetTimeout; zero selects
+// the default of 20 seconds.
+//
+// SharedCQ attaches the connections to a completion queue shared with other connections
+// on the same device instead of giving each its own; the device is then the one the
+// queue was opened on, and Blocking and CQDepth are taken from the queue. Connections
+// must use the IB port the queue was opened for.
+//
+// SharedRQ likewise makes the connections receive the messages of Recv through a receive
+// queue shared with other connections on the same device and IB port, see SharedRQ.
+//
+// QPPool lets the connections take warm queue pairs from a pool and return them to it
+// when they are destroyed, see QPPool.
+type RDMAHandler struct {
+	Notify    bool
+	SendDepth int
+	CQDepth   int
+	Blocking  bool
+	SpinTime  time.Duration
+	Timeout   time.Duration
+	SharedCQ  *SharedCQ
+	SharedRQ  *SharedRQ
+	QPPool    *QPPool
+}
 
 // InitServer initializes an RDMA server on the specified port. It sets up
 // the necessary RDMA resources and returns a pointer to these resources along with
@@ -57,7 +96,7 @@ type RDMAHandler struct{}
 //	// Use res (RDMAResources) as needed
 //	...
 func (h *RDMAHandler) InitServer(port int) (*RDMAResources, error) {
-	return initRDMAConnection("", port)
+	return initRDMAConnection(Options{Port: port}, h)
 }
 
 // InitClient establishes a connection to an RDMA server at the specified IP address and port.
@@ -80,7 +119,7 @@ func (h *RDMAHandler) InitServer(port int) (*RDMAResources, error) {
 //	// Use clientRes (RDMAResources) for client-side operations
 //	...
 func (h *RDMAHandler) InitClient(ip string, port int) (*RDMAResources, error) {
-	return initRDMAConnection(ip, port)
+	return initRDMAConnection(Options{Addr: ip, Port: port}, h)
 }
 
 //	Write sends the given contents to a remote RDMA peer using the specified RDMAResources.
@@ -95,8 +134,13 @@ func (h *RDMAHandler) InitClient(ip string, port int) (*RDMAResources, error) {
 // `character` is used in error messages to identify the operation or the role of the peer
 // (e.g., "client" or "server").
 //
-// This function first synchronizes the data, then performs the RDMA write operation, and
-// finally checks for completion. Any error encountered during these steps is returned.
+// The contents are framed in the registered buffer behind a small header carrying the
+// payload length and a sequence number, and only the header and payload bytes are
+// transferred. Contents larger than the buffer capacity are rejected.
+//
+// This function first stages the frame and synchronizes the data, then performs the RDMA
+// write operation, and finally checks for completion. Any error encountered during these
+// steps is returned.
 //
 // On success, it returns nil. On failure, it returns an error detailing the issue encountered.
 //
@@ -111,22 +155,16 @@ func (h *RDMAHandler) InitClient(ip string, port int) (*RDMAResources, error) {
 //	    log.Fatalf("RDMA write failed: %v", err)
 //	}
 func (h *RDMAHandler) Write(res *RDMAResources, contents []byte, character string) error {
-	if err := syncData(res); err != nil {
-		return err
+	if res.lease != leaseNone {
+		return fmt.Errorf("%s: buffer is leased", character)
 	}
-
-	C.memcpy(unsafe.Pointer(res.res.buf), unsafe.Pointer(&contents[0]), C.ulong(binary.Size(contents)));
-
-	if C.post_send(&res.res, C.IBV_WR_RDMA_WRITE) != 0 {
-		return fmt.Errorf("%s: failed to post SR", character)
+	if len(contents) > res.maxPayload() {
+		return fmt.Errorf("%s: message of %d bytes exceeds buffer capacity of %d bytes", character, len(contents), res.maxPayload())
 	}
-	if C.poll_completion(&res.res) != 0 {
-		return fmt.Errorf("%s: poll completion failed", character)
-	}
-	if err := syncData(res); err != nil {
-		return err
+	if len(contents) > 0 {
+		C.memcpy(res.payload(), unsafe.Pointer(&contents[0]), C.size_t(len(contents)))
 	}
-	return nil
+	return writeFrame(res, len(contents), character)
 }
 
 // Read performs an RDMA read operation using the given RDMAResources and retrieves data from a remote RDMA peer.
@@ -137,11 +175,13 @@ func (h *RDMAHandler) Write(res *RDMAResources, contents []byte, character strin
 // `character` is a string used to identify the operation or the role of the peer in error messages
 // (e.g., "client" or "server").
 //
-// This function synchronizes the data before and after the RDMA read operation. If any error
-// occurs during these steps, the function returns an empty string along with the error.
+// This function synchronizes the data before and after the RDMA read operation. The frame
+// header is fetched first, then exactly the payload bytes it describes, so the returned
+// slice holds precisely the bytes passed to the peer's Write. If any error occurs during
+// these steps, the function returns nil along with the error.
 //
-// On successful completion of the read operation, it returns the read data as a string and nil error.
-// On failure, it returns an empty string and the error encountered.
+// On successful completion of the read operation, it returns the read data and nil error.
+// On failure, it returns nil and the error encountered.
 //
 // Example:
 //
@@ -151,21 +191,19 @@ func (h *RDMAHandler) Write(res *RDMAResources, contents []byte, character strin
 //	}
 //	fmt.Println("Received data:", data)
 func (h *RDMAHandler) Read(res *RDMAResources, character string) ([]byte, error) {
-	if err := syncData(res); err != nil {
-		return nil, err
-	}
-	if C.post_send(&res.res, C.IBV_WR_RDMA_READ) != 0 {
-		return nil, fmt.Errorf("%s: failed to post SR", character)
+	if res.lease != leaseNone {
+		return nil, fmt.Errorf("%s: buffer is leased", character)
 	}
-	if C.poll_completion(&res.res) != 0 {
-		return nil, fmt.Errorf("%s: poll completion after post_send failed", character)
-	}
-	if err := syncData(res); err != nil {
+	length, err := readFrame(res, character)
+	if err != nil {
 		return nil, err
 	}
 
-	byteSlice := C.GoBytes(unsafe.Pointer(res.res.buf), C.int(C.strlen(res.res.buf)))
+	byteSlice := C.GoBytes(res.rxPayload(), C.int(length))
 
+	if err := finishRead(res, character); err != nil {
+		return nil, err
+	}
 	return byteSlice, nil
 }
 
@@ -189,7 +227,16 @@ func (h *RDMAHandler) Read(res *RDMAResources, character string) ([]byte, error)
 //	    log.Fatalf("Failed to destroy RDMA resources: %v", err)
 //	}
 func (h *RDMAHandler) Destroy(res *RDMAResources) error {
-	if C.resources_destroy(&res.res) != 0 {
+	var rc C.int
+	if res.pool == nil || !res.pool.recycle(res.res) {
+		rc = C.resources_destroy(res.res)
+		C.free(unsafe.Pointer(res.res))
+	}
+	res.res = nil
+	if err := res.destroyRegions(); err != nil {
+		return err
+	}
+	if rc != 0 {
 
 		return fmt.Errorf("failed to destroy resources")
 	}
@@ -200,9 +247,11 @@ func (h *RDMAHandler) Destroy(res *RDMAResources) error {
 // an RDMA (Remote Direct Memory Access) connection. It serves as a wrapper around
 // the C-level struct_resources, providing a Go-friendly interface for RDMA operations.
 //
-// The `res` field is an instance of C.struct_resources, which holds the necessary
-// RDMA resources and configurations such as the protection domain, memory regions,
-// queue pairs, and other essential components for establishing RDMA connections.
+// The `res` field points to a C.struct_resources allocated in C memory, which holds the
+// necessary RDMA resources and configurations such as the protection domain, memory
+// regions, queue pairs, and other essential components for establishing RDMA connections.
+// Keeping it out of the Go heap lets C code, such as a shared completion queue, refer to
+// the connection between calls.
 //
 // This struct is used throughout the RDMA handling code to maintain the state and
 // resources of an RDMA connection, either as a client or a server.
@@ -214,53 +263,234 @@ func (h *RDMAHandler) Destroy(res *RDMAResources) error {
 //	// Use resources in RDMA operations such as Read, Write, etc.
 //	...
 type RDMAResources struct {
-	res C.struct_resources
+	res     *C.struct_resources
+	lease   leaseKind
+	regions []*Region              // regions registered on the connection
+	remote  []C.struct_region_desc // regions advertised by the peer
+	pool    *QPPool                // pool the resources are recycled to
+}
+
+// leaseKind tells which part of the registered buffer is handed out to the caller.
+type leaseKind int
+
+const (
+	leaseNone leaseKind = iota
+	leaseWrite
+	leaseRead
+)
+
+// payload returns the address of the outgoing message payload in the registered buffer,
+// immediately behind the frame header.
+func (res *RDMAResources) payload() unsafe.Pointer {
+	return unsafe.Add(unsafe.Pointer(res.res.buf), C.MSG_HDR_SIZE)
+}
+
+// SetTimeout changes how long operations on the connection wait for a completion before
+// failing. A non-positive timeout restores the default of 20 seconds.
+func (res *RDMAResources) SetTimeout(timeout time.Duration) {
+	if timeout <= 0 {
+		res.res.timeout_msec = C.MAX_POLL_CQ_TIMEOUT
+		return
+	}
+	res.res.timeout_msec = timeoutMsec(timeout)
+}
+
+// rxPayload returns the address of the payload of the last message read.
+func (res *RDMAResources) rxPayload() unsafe.Pointer {
+	if res.res.notify != 0 {
+		return unsafe.Add(unsafe.Pointer(res.res.buf), res.bufSize()/2+C.MSG_HDR_SIZE)
+	}
+	return res.payload()
+}
+
+// maxPayload returns the largest message the connection can carry.
+func (res *RDMAResources) maxPayload() int {
+	if res.res.notify != 0 {
+		return res.bufSize()/2 - C.MSG_HDR_SIZE
+	}
+	return res.bufSize() - C.MSG_HDR_SIZE
+}
+
+// bufSize returns the size of the connection's registered buffer.
+func (res *RDMAResources) bufSize() int {
+	return int(res.res.cfg.buf_size)
 }
 
 // initRDMAConnection initializes the RDMA resources and establishes a connection
-// either as a client or a server based on the provided IP address.
+// either as a client or a server based on the provided options.
 //
-// `ip` is the IP address of the RDMA server to connect to. If `ip` is an empty string,
-// the function sets up as a server, otherwise it sets up as a client.
+// `opts` gives the connection parameters. If `opts.Addr` is an empty string, the
+// function sets up as a server, otherwise it sets up as a client.
 //
-// `port` is the port number used for the RDMA connection.
+// `h` supplies the connection settings, see RDMAHandler.
 //
 // This function configures the RDMA connection parameters, creates the necessary
 // resources, and connects the queue pairs (QPs). If any step in this process fails,
-// it cleans up any partially created resources and returns an error.
+// it cleans up any partially created resources and returns an error. The parameters
+// are kept in the connection's own resources, so connections can be initialized
+// concurrently.
 //
 // On success, it returns a pointer to the initialized RDMAResources and nil error.
 // On failure, it returns nil and an error explaining the failure.
 //
 // Example:
 //
-//	res, err := initRDMAConnection("192.168.1.10", 8080)
+//	res, err := initRDMAConnection(Options{Addr: "192.168.1.10", Port: 8080}, &RDMAHandler{})
 //	if err != nil {
 //	    log.Fatalf("RDMA connection initialization failed: %v", err)
 //	}
-func initRDMAConnection(ip string, port int) (*RDMAResources, error) {
-	var resources RDMAResources
-
-	serverAddr := C.CString(ip)
-	defer C.free(unsafe.Pointer(serverAddr))
-
-	if ip != "" {
+func initRDMAConnection(opts Options, h *RDMAHandler) (*RDMAResources, error) {
+	if opts.Addr != "" {
 		fmt.Println("client now setting up")
-		C.config.server_name = serverAddr
 	} else {
 		fmt.Println("server now setting up")
-		C.config.server_name = nil
 	}
-	C.config.tcp_port = C.uint32_t(port)
 
-	if C.resources_create(&resources.res) != 0 {
-		return nil, fmt.Errorf("failed to create resources")
+	resources, err := newResources(h, opts)
+	if err != nil {
+		return nil, err
+	}
+	if opts.CM {
+		err = establishCM(resources, h)
+	} else {
+		err = establish(resources, h, opts)
+	}
+	if err != nil {
+		return nil, err
+	}
+	return resources, nil
+}
+
+// newResources allocates the C resources of a connection and applies the settings of
+// `h` and the parameters in `opts` to them. Fields such as the socket or the shared
+// device can be filled in before the connection is established with establish.
+func newResources(h *RDMAHandler, opts Options) (*RDMAResources, error) {
+	if err := opts.check(); err != nil {
+		return nil, err
+	}
+	if err := h.checkShared(opts); err != nil {
+		return nil, err
+	}
+
+	resources := &RDMAResources{res: (*C.struct_resources)(C.malloc(C.sizeof_struct_resources))}
+	C.resources_init(resources.res)
+
+	cfg := &resources.res.cfg
+	if opts.Addr != "" {
+		cfg.server_name = C.CString(opts.Addr)
+	}
+	if opts.Device != "" {
+		cfg.dev_name = C.CString(opts.Device)
+	}
+	cfg.tcp_port = C.uint32_t(opts.Port)
+	if opts.IBPort != 0 {
+		cfg.ib_port = C.int(opts.IBPort)
+	}
+	cfg.gid_idx = C.int(opts.GIDIndex)
+	if opts.BufferSize != 0 {
+		cfg.buf_size = C.size_t(opts.BufferSize)
+	}
+	if opts.MTU != 0 {
+		mtu, _ := mtuEnum(opts.MTU)
+		cfg.mtu = C.int(mtu)
+	}
+	cfg.max_rd_atomic = C.int(opts.MaxReadAtomic)
+	if opts.MinRNRTimer != 0 {
+		cfg.min_rnr_timer = C.int(opts.MinRNRTimer)
+	}
+	if opts.AckTimeout != 0 {
+		cfg.timeout = C.int(opts.AckTimeout)
+	}
+	if opts.RetryCount != 0 {
+		cfg.retry_cnt = C.int(opts.RetryCount)
+	}
+	if opts.RNRRetry != 0 {
+		cfg.rnr_retry = C.int(opts.RNRRetry)
+	}
+	if opts.MessageSize != 0 {
+		cfg.msg_size = C.uint32_t(opts.MessageSize)
+	}
+	if opts.RecvDepth != 0 {
+		cfg.msg_depth = C.int(opts.RecvDepth)
+	}
+
+	resources.res.send_depth = C.int(h.SendDepth)
+	resources.res.cq_depth = C.int(h.CQDepth)
+	resources.res.spin_usec = C.int(h.SpinTime.Microseconds())
+	resources.res.timeout_msec = timeoutMsec(h.Timeout)
+	if h.Blocking {
+		resources.res.blocking = 1
 	}
-	if C.connect_qp(&resources.res) != 0 {
-		C.resources_destroy(&resources.res)
-		return nil, fmt.Errorf("failed to connect QPs")
+	if h.SharedCQ != nil {
+		resources.res.cq = h.SharedCQ.q
 	}
-	return &resources, nil
+	if h.SharedRQ != nil {
+		resources.res.srq = h.SharedRQ.q
+	}
+	return resources, nil
+}
+
+// establish creates the RDMA resources allocated by newResources, or takes them from the
+// handler's QP pool, and connects the queue pairs. On failure the C resources are
+// released and `resources` must not be used again.
+func establish(resources *RDMAResources, h *RDMAHandler, opts Options) error {
+	// the names are only needed to set the connection up
+	defer func() {
+		if resources.res != nil {
+			cfg := &resources.res.cfg
+			C.free(unsafe.Pointer(cfg.server_name))
+			C.free(unsafe.Pointer(cfg.dev_name))
+			cfg.server_name = nil
+			cfg.dev_name = nil
+		}
+	}()
+
+	if h.QPPool != nil {
+		h.QPPool.take(resources, h, opts)
+	}
+	if C.resources_create(resources.res) != 0 {
+		if resources.res.qp != nil {
+			// a warm QP outlives a failed TCP connection
+			C.resources_destroy(resources.res)
+		}
+		freeResources(resources)
+		return fmt.Errorf("failed to create resources")
+	}
+	if h.Notify {
+		resources.res.notify = 1
+	}
+	if C.connect_qp(resources.res) != 0 {
+		C.resources_destroy(resources.res)
+		freeResources(resources)
+		return fmt.Errorf("failed to connect QPs")
+	}
+	return nil
+}
+
+// checkShared verifies that the shared queues of `h` serve the IB port connections with
+// `opts` use.
+func (h *RDMAHandler) checkShared(opts Options) error {
+	ibPort := opts.IBPort
+	if ibPort == 0 {
+		ibPort = int(C.config.ib_port)
+	}
+	if h.SharedCQ != nil && h.SharedCQ.IBPort() != ibPort {
+		return fmt.Errorf("shared completion queue serves IB port %d, not %d", h.SharedCQ.IBPort(), ibPort)
+	}
+	if h.SharedRQ != nil && h.SharedRQ.IBPort() != ibPort {
+		return fmt.Errorf("shared receive queue serves IB port %d, not %d", h.SharedRQ.IBPort(), ibPort)
+	}
+	return nil
+}
+
+// freeResources releases the C memory of a connection whose resources were never
+// created or have been destroyed.
+func freeResources(resources *RDMAResources) {
+	cfg := &resources.res.cfg
+	C.free(unsafe.Pointer(cfg.server_name))
+	C.free(unsafe.Pointer(cfg.dev_name))
+	C.free(unsafe.Pointer(resources.res))
+	resources.res = nil
 }
 
 // syncData synchronizes data over the socket associated with the provided RDMA resources.
@@ -284,9 +514,83 @@ func initRDMAConnection(ip string, port int) (*RDMAResources, error) {
 //	    log.Fatalf("Data synchronization failed: %v", err)
 //	}
 func syncData(res *RDMAResources) error {
+	localChar := C.char('R')
 	var tempChar C.char
-	if C.sock_sync_data(res.res.sock, 1, C.CString("R"), &tempChar) != 0 {
+	if res.res.sock < 0 {
+		return fmt.Errorf("no TCP socket to sync over, use Notify")
+	}
+	if C.sock_sync_data(res.res.sock, 1, &localChar, &tempChar) != 0 {
 		return fmt.Errorf("sync error")
 	}
 	return nil
 }
+
+// writeFrame sends the `length` payload bytes already staged in the registered buffer
+// to the remote peer.
+//
+// It writes the frame header, synchronizes with the peer, RDMA-writes the header and
+// payload to the remote buffer, waits for the completion and synchronizes again. In
+// notification mode the frame is pushed into the peer's receive area instead and no
+// synchronization over the TCP socket takes place.
+// `character` is used in error messages to identify the role of the peer.
+func writeFrame(res *RDMAResources, length int, character string) error {
+	if res.res.notify != 0 {
+		if C.frame_push(res.res, C.uint32_t(length)) != 0 {
+			return fmt.Errorf("%s: failed to push frame", character)
+		}
+		return nil
+	}
+
+	C.frame_stage(res.res, C.uint32_t(length))
+
+	if err := syncData(res); err != nil {
+		return err
+	}
+	if C.post_send(res.res, C.IBV_WR_RDMA_WRITE, 0, C.size_t(C.MSG_HDR_SIZE+length)) != 0 {
+		return fmt.Errorf("%s: failed to post SR", character)
+	}
+	if C.poll_completion(res.res) != 0 {
+		return fmt.Errorf("%s: poll completion failed", character)
+	}
+	if err := syncData(res); err != nil {
+		return err
+	}
+	return nil
+}
+
+// readFrame fetches the frame staged by the remote peer into the registered buffer
+// and returns its payload length. The payload is left in place at rxPayload. In
+// notification mode it waits for the peer to push a frame instead, and finishRead must
+// be called once the payload has been consumed.
+//
+// `character` is used in error messages to identify the role of the peer.
+func readFrame(res *RDMAResources, character string) (int, error) {
+	var length C.uint32_t
+
+	if res.res.notify != 0 {
+		if C.frame_pop(res.res, &length) != 0 {
+			return 0, fmt.Errorf("%s: failed to receive frame", character)
+		}
+		return int(length), nil
+	}
+
+	if err := syncData(res); err != nil {
+		return 0, err
+	}
+	if C.frame_read(res.res, &length) != 0 {
+		return 0, fmt.Errorf("%s: failed to read frame", character)
+	}
+	if err := syncData(res); err != nil {
+		return 0, err
+	}
+	return int(length), nil
+}
+
+// finishRead hands the receive area back to the peer after the payload returned by
+// readFrame has been consumed. It is a no-op outside of notification mode.
+func finishRead(res *RDMAResources, character string) error {
+	if res.res.notify != 0 && C.frame_release(res.res) != 0 {
+		return fmt.Errorf("%s: failed to return credit", character)
+	}
+	return nil
+}
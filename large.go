@@ -0,0 +1,269 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"unsafe"
+)
+
+// Large transfers move payloads of any size through the peer's registered buffer, which
+// is split into up to largeMaxDepth slots of at most largeChunkSize bytes.
+const (
+	largeChunkSize = 1 << 20
+	largeMaxDepth  = 8
+)
+
+// Control messages of a large transfer, exchanged with Send and Recv.
+const (
+	largeBegin uint32 = iota + 1 // announces the total size and the slot layout
+	largeChunk                   // a chunk was written to a slot
+	largeAck                     // the slot of a chunk can be reused
+)
+
+// largeMsg is the wire format of the control messages of a large transfer.
+type largeMsg struct {
+	Kind   uint32
+	Slot   uint32
+	Length uint64 // total size for largeBegin, chunk size for largeChunk
+	Chunk  uint32 // slot size, largeBegin only
+	Depth  uint32 // number of slots, largeBegin only
+}
+
+// SendLarge transfers `data` to the remote peer, which receives it with RecvLarge or
+// RecvStream. Unlike Write and Send, the payload may be larger than the connection's
+// buffer; see SendStream.
+func (h *RDMAHandler) SendLarge(res *RDMAResources, data []byte, character string) error {
+	return h.SendStream(res, bytes.NewReader(data), int64(len(data)), character)
+}
+
+// SendStream transfers `size` bytes read from `r` to the remote peer, which receives
+// them with RecvStream or RecvLarge.
+//
+// The payload is split into chunks that are copied into registered staging blocks
+// borrowed from the memory pool and RDMA-written into slots of the peer's buffer. A chunk
+// is announced with a message that follows the write on the queue pair, so it reaches
+// the peer only once the chunk has landed, and the peer acknowledges every chunk once
+// it consumed it. Several chunks are in flight at once: while the NIC writes one, the
+// next is read from `r`. Pinned memory stays bounded by the staging blocks and the
+// buffers, whatever the size of the payload.
+//
+// The transfer uses both connection buffers and the Send/Recv channel, so no other
+// operation may run on the connection until it completes.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+//
+// Example:
+//
+//	f, err := os.Open("snapshot.bin")
+//	if err != nil {
+//	    log.Fatal(err)
+//	}
+//	fi, _ := f.Stat()
+//	if err := h.SendStream(clientRes, f, fi.Size(), "client"); err != nil {
+//	    log.Fatalf("RDMA transfer failed: %v", err)
+//	}
+func (h *RDMAHandler) SendStream(res *RDMAResources, r io.Reader, size int64, character string) error {
+	if size < 0 {
+		return fmt.Errorf("%s: invalid size %d", character, size)
+	}
+	chunk, depth := res.largeLayout()
+
+	stage := make([]*PoolBuffer, depth)
+	defer func() {
+		for _, b := range stage {
+			if b != nil {
+				b.Release()
+			}
+		}
+	}()
+	for i := range stage {
+		b, err := res.Borrow(chunk)
+		if err != nil {
+			return fmt.Errorf("%s: %v", character, err)
+		}
+		stage[i] = b
+	}
+
+	begin := largeMsg{Kind: largeBegin, Length: uint64(size), Chunk: uint32(chunk), Depth: uint32(depth)}
+	if err := h.Send(res, begin.encode(), character); err != nil {
+		return err
+	}
+
+	var last *Completion
+	var sent int64
+	chunks := 0
+	for sent < size {
+		slot := chunks % depth
+		// the slot, and its staging block, are free once the chunk sent from it was acknowledged
+		if chunks >= depth {
+			if err := h.recvLargeAck(res, character); err != nil {
+				return err
+			}
+		}
+		n := chunk
+		if size-sent < int64(n) {
+			n = int(size - sent)
+		}
+		if _, err := io.ReadFull(r, stage[slot].Bytes()[:n]); err != nil {
+			return fmt.Errorf("%s: reading payload: %v", character, err)
+		}
+		if _, err := h.WriteAsyncFrom(res, stage[slot], n, slot*chunk, character); err != nil {
+			return err
+		}
+		c, err := postMessage(res, largeMsg{Kind: largeChunk, Slot: uint32(slot), Length: uint64(n)}.encode(), character)
+		if err != nil {
+			return err
+		}
+		last = c
+		sent += int64(n)
+		chunks++
+	}
+
+	for i := 0; i < chunks && i < depth; i++ {
+		if err := h.recvLargeAck(res, character); err != nil {
+			return err
+		}
+	}
+	if last != nil {
+		return last.Wait()
+	}
+	return nil
+}
+
+// RecvLarge receives a payload sent with SendLarge or SendStream and returns it.
+func (h *RDMAHandler) RecvLarge(res *RDMAResources, character string) ([]byte, error) {
+	var data []byte
+	_, err := h.recvChunks(res, character, func(total int64) {
+		data = make([]byte, 0, total)
+	}, func(p []byte) error {
+		data = append(data, p...)
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// RecvStream receives a payload sent with SendStream or SendLarge and writes it to `w`
+// chunk by chunk, as the chunks arrive. Each chunk is acknowledged once `w` accepted it,
+// so a slow writer slows the sender down rather than growing memory.
+//
+// On success, it returns the number of bytes received and nil error. On failure, it
+// returns the bytes written so far and the error encountered.
+func (h *RDMAHandler) RecvStream(res *RDMAResources, w io.Writer, character string) (int64, error) {
+	return h.recvChunks(res, character, nil, func(p []byte) error {
+		_, err := w.Write(p)
+		return err
+	})
+}
+
+// recvChunks receives the chunks of a large transfer, passing the announced size to
+// `begin` and every chunk, in order, to `consume` before acknowledging it.
+func (h *RDMAHandler) recvChunks(res *RDMAResources, character string, begin func(total int64), consume func(p []byte) error) (int64, error) {
+	m, err := h.recvLargeMsg(res, largeBegin, character)
+	if err != nil {
+		return 0, err
+	}
+	chunk, depth := int(m.Chunk), int(m.Depth)
+	if chunk <= 0 || depth <= 0 || chunk*depth > res.bufSize() {
+		return 0, fmt.Errorf("%s: %d slots of %d bytes do not fit the buffer", character, depth, chunk)
+	}
+	total := int64(m.Length)
+	if begin != nil {
+		begin(total)
+	}
+
+	var last *Completion
+	var got int64
+	for got < total {
+		m, err := h.recvLargeMsg(res, largeChunk, character)
+		if err != nil {
+			return got, err
+		}
+		if int(m.Slot) >= depth || m.Length > uint64(chunk) || int64(m.Length) > total-got {
+			return got, fmt.Errorf("%s: invalid chunk of %d bytes in slot %d", character, m.Length, m.Slot)
+		}
+		p := unsafe.Slice((*byte)(unsafe.Add(unsafe.Pointer(res.res.buf), int(m.Slot)*chunk)), int(m.Length))
+		if err := consume(p); err != nil {
+			return got, err
+		}
+		got += int64(m.Length)
+
+		last, err = postMessage(res, largeMsg{Kind: largeAck, Slot: m.Slot}.encode(), character)
+		if err != nil {
+			return got, err
+		}
+	}
+	if last != nil {
+		return got, last.Wait()
+	}
+	return got, nil
+}
+
+// recvLargeAck waits for the peer to acknowledge the oldest chunk in flight.
+func (h *RDMAHandler) recvLargeAck(res *RDMAResources, character string) error {
+	_, err := h.recvLargeMsg(res, largeAck, character)
+	return err
+}
+
+// recvLargeMsg receives a control message of a large transfer and checks its kind.
+func (h *RDMAHandler) recvLargeMsg(res *RDMAResources, kind uint32, character string) (largeMsg, error) {
+	b, err := h.Recv(res, character)
+	if err != nil {
+		return largeMsg{}, err
+	}
+	m, err := decodeLargeMsg(b, kind)
+	if err != nil {
+		return m, fmt.Errorf("%s: %v", character, err)
+	}
+	return m, nil
+}
+
+// decodeLargeMsg reads a control message of a large transfer and checks its kind.
+func decodeLargeMsg(b []byte, kind uint32) (largeMsg, error) {
+	var m largeMsg
+	if err := binary.Read(bytes.NewReader(b), binary.BigEndian, &m); err != nil || m.Kind != kind {
+		return m, fmt.Errorf("unexpected message during large transfer")
+	}
+	return m, nil
+}
+
+// largeLayout returns the slot size and the number of slots a large transfer splits the
+// peer's buffer into.
+func (res *RDMAResources) largeLayout() (int, int) {
+	chunk := largeChunkSize
+	if chunk > res.bufSize() {
+		chunk = res.bufSize()
+	}
+	depth := res.bufSize() / chunk
+	if depth > largeMaxDepth {
+		depth = largeMaxDepth
+	}
+	return chunk, depth
+}
+
+// encode returns the wire format of a control message.
+func (m largeMsg) encode() []byte {
+	var b bytes.Buffer
+	binary.Write(&b, binary.BigEndian, m)
+	return b.Bytes()
+}
+
+// postMessage sends a control message without waiting for it to complete.
+func postMessage(res *RDMAResources, msg []byte, character string) (*Completion, error) {
+	var wrID C.uint64_t
+	if C.msg_post(res.res, unsafe.Pointer(&msg[0]), C.uint32_t(len(msg)), &wrID) != 0 {
+		return nil, fmt.Errorf("%s: failed to send message", character)
+	}
+	return &Completion{res: res, wrID: wrID, character: character}, nil
+}
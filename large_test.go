@@ -0,0 +1,41 @@
+package rdmahandler
+
+import "testing"
+
+func TestLargeMsgRoundTrip(t *testing.T) {
+	tests := []largeMsg{
+		{Kind: largeBegin, Length: 5<<30 + 3, Chunk: largeChunkSize, Depth: largeMaxDepth},
+		{Kind: largeChunk, Slot: 7, Length: largeChunkSize},
+		{Kind: largeAck, Slot: 3},
+	}
+	for _, m := range tests {
+		b := m.encode()
+		if len(b) != 24 {
+			t.Fatalf("encode(%+v) returned %d bytes, want 24", m, len(b))
+		}
+		got, err := decodeLargeMsg(b, m.Kind)
+		if err != nil {
+			t.Errorf("decodeLargeMsg(%+v): %v", m, err)
+		} else if got != m {
+			t.Errorf("decodeLargeMsg(encode(%+v)) = %+v", m, got)
+		}
+	}
+}
+
+func TestDecodeLargeMsgRejects(t *testing.T) {
+	b := largeMsg{Kind: largeChunk, Slot: 1, Length: 64}.encode()
+	tests := []struct {
+		name string
+		b    []byte
+		kind uint32
+	}{
+		{"wrong kind", b, largeAck},
+		{"truncated", b[:len(b)-1], largeChunk},
+		{"empty", nil, largeChunk},
+	}
+	for _, tt := range tests {
+		if _, err := decodeLargeMsg(tt.b, tt.kind); err == nil {
+			t.Errorf("%s: decodeLargeMsg succeeded", tt.name)
+		}
+	}
+}
@@ -0,0 +1,149 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"io"
+	"unsafe"
+)
+
+// Acquire leases `n` bytes of the registered buffer for a zero-copy write.
+//
+// The returned slice is backed directly by the memory registered with the NIC, so the
+// caller can serialize a message straight into it instead of building it in a Go slice
+// and having Write copy it. The lease is completed with Commit, which sends the first
+// bytes of the slice to the remote peer, or abandoned with Release.
+//
+// `res` is a pointer to RDMAResources that must be previously initialized and represent
+// an established RDMA connection. Only one lease can be held per connection, and Write
+// and Read are refused while it is held.
+//
+// On success, it returns the leased slice and nil error. On failure, it returns nil and
+// the error encountered.
+//
+// Example:
+//
+//	buf, err := h.Acquire(clientRes, 4096)
+//	if err != nil {
+//	    log.Fatalf("Failed to acquire buffer: %v", err)
+//	}
+//	n := encodeRecord(buf)
+//	if err := h.Commit(clientRes, n, "client"); err != nil {
+//	    log.Fatalf("RDMA write failed: %v", err)
+//	}
+func (h *RDMAHandler) Acquire(res *RDMAResources, n int) ([]byte, error) {
+	if res.lease != leaseNone {
+		return nil, fmt.Errorf("buffer is already leased")
+	}
+	if n < 0 || n > res.maxPayload() {
+		return nil, fmt.Errorf("lease of %d bytes exceeds buffer capacity of %d bytes", n, res.maxPayload())
+	}
+	res.lease = leaseWrite
+	return unsafe.Slice((*byte)(res.payload()), n), nil
+}
+
+// Commit sends the first `n` bytes of the slice leased by Acquire to the remote peer
+// and releases the lease.
+//
+// The bytes are framed and transferred exactly as Write would, but without copying them
+// into the registered buffer first. The leased slice must not be used after Commit
+// returns, whether or not it succeeds.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+func (h *RDMAHandler) Commit(res *RDMAResources, n int, character string) error {
+	if res.lease != leaseWrite {
+		return fmt.Errorf("%s: commit without a leased buffer", character)
+	}
+	res.lease = leaseNone
+	if n < 0 || n > res.maxPayload() {
+		return fmt.Errorf("%s: commit of %d bytes exceeds buffer capacity of %d bytes", character, n, res.maxPayload())
+	}
+	return writeFrame(res, n, character)
+}
+
+// Release gives back a lease obtained with Acquire or ReadLease without sending anything.
+// Slices handed out under the lease must not be used afterwards. Releasing a connection
+// that holds no lease is a no-op.
+//
+// In notification mode releasing a read lease returns the receive area to the peer,
+// which is the only step that can fail.
+func (h *RDMAHandler) Release(res *RDMAResources) error {
+	kind := res.lease
+	res.lease = leaseNone
+	if kind == leaseRead {
+		return finishRead(res, "release")
+	}
+	return nil
+}
+
+// ReadLease performs an RDMA read like Read, but returns the payload in place instead
+// of copying it into a newly allocated slice.
+//
+// The returned slice is backed by the registered buffer and stays valid until Release
+// is called, which the caller must do before the next operation on the connection.
+//
+// `character` is a string used to identify the operation or the role of the peer in error messages
+// (e.g., "client" or "server").
+//
+// On success, it returns the payload and nil error. On failure, it returns nil and the
+// error encountered, and no lease is held.
+//
+// Example:
+//
+//	msg, err := h.ReadLease(serverRes, "server")
+//	if err != nil {
+//	    log.Fatalf("RDMA read failed: %v", err)
+//	}
+//	parseRecord(msg)
+//	if err := h.Release(serverRes); err != nil {
+//	    log.Fatalf("Failed to release buffer: %v", err)
+//	}
+func (h *RDMAHandler) ReadLease(res *RDMAResources, character string) ([]byte, error) {
+	if res.lease != leaseNone {
+		return nil, fmt.Errorf("%s: buffer is leased", character)
+	}
+	length, err := readFrame(res, character)
+	if err != nil {
+		return nil, err
+	}
+	res.lease = leaseRead
+	return unsafe.Slice((*byte)(res.rxPayload()), length), nil
+}
+
+// ReadInto performs an RDMA read like Read, but copies the payload into `dst` instead
+// of allocating a new slice.
+//
+// If `dst` is too small for the received message, nothing is copied, the message is
+// discarded and io.ErrShortBuffer is returned along with the size of the message.
+//
+// `character` is a string used to identify the operation or the role of the peer in error messages
+// (e.g., "client" or "server").
+//
+// On success, it returns the number of bytes copied into `dst` and nil error. On failure,
+// it returns the error encountered.
+func (h *RDMAHandler) ReadInto(res *RDMAResources, dst []byte, character string) (int, error) {
+	if res.lease != leaseNone {
+		return 0, fmt.Errorf("%s: buffer is leased", character)
+	}
+	length, err := readFrame(res, character)
+	if err != nil {
+		return 0, err
+	}
+	n := 0
+	if length <= len(dst) {
+		n = copy(dst, unsafe.Slice((*byte)(res.rxPayload()), length))
+	}
+	if err := finishRead(res, character); err != nil {
+		return 0, err
+	}
+	if n < length {
+		return length, io.ErrShortBuffer
+	}
+	return n, nil
+}
@@ -0,0 +1,233 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"net"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+// Listener accepts RDMA connections from any number of clients on one TCP port.
+//
+// Unlike InitServer, which accepts a single client and closes the listening socket, a
+// Listener keeps the port open and performs the connection handshakes of incoming
+// clients concurrently in the background. Every accepted client gets its own queue pair
+// and registered buffer, while the device context and protection domain are opened once
+// and shared by all connections of the listener, as are the handler's SharedCQ and
+// SharedRQ if set.
+// Clients connect with InitClient as usual.
+//
+// Example:
+//
+//	l, err := h.Listen(8080)
+//	if err != nil {
+//	    log.Fatalf("Failed to listen: %v", err)
+//	}
+//	defer l.Close()
+//	for {
+//	    res, err := l.Accept()
+//	    if errors.Is(err, net.ErrClosed) {
+//	        break
+//	    }
+//	    if err != nil {
+//	        log.Printf("Handshake failed: %v", err)
+//	        continue
+//	    }
+//	    go serve(res)
+//	}
+type Listener struct {
+	h     RDMAHandler
+	opts  Options
+	fd    C.int
+	dev   *C.struct_rdma_device
+	conns chan accepted
+	done  chan struct{}
+	wg    sync.WaitGroup
+	once  sync.Once
+
+	mu      sync.Mutex
+	closed  bool
+	pending map[C.int]struct{} // duplicates of the sockets of handshakes in progress
+}
+
+// accepted is the outcome of the handshake with one client.
+type accepted struct {
+	res *RDMAResources
+	err error
+}
+
+// Listen starts accepting RDMA connections on the specified TCP port. The settings of
+// the handler at the time of the call apply to every accepted connection.
+//
+// On success, it returns the Listener and nil error. On failure, it returns nil and the
+// error encountered.
+func (h *RDMAHandler) Listen(port int) (*Listener, error) {
+	return h.ListenWith(Options{Port: port})
+}
+
+// ListenWith is like Listen but takes the port and the parameters of the accepted
+// connections from `opts`. Its Addr field is ignored, and CM is not supported.
+func (h *RDMAHandler) ListenWith(opts Options) (*Listener, error) {
+	opts.Addr = ""
+	if opts.CM {
+		return nil, fmt.Errorf("listener accepts connections over TCP only")
+	}
+	if err := h.checkShared(opts); err != nil {
+		return nil, err
+	}
+
+	var dev *C.struct_rdma_device
+	if h.SharedCQ != nil {
+		dev = h.SharedCQ.q.dev
+		C.device_hold(dev)
+	} else if h.SharedRQ != nil {
+		dev = h.SharedRQ.q.dev
+		C.device_hold(dev)
+	} else {
+		var devName *C.char
+		if opts.Device != "" {
+			devName = C.CString(opts.Device)
+			defer C.free(unsafe.Pointer(devName))
+		}
+		ibPort := C.int(C.config.ib_port)
+		if opts.IBPort != 0 {
+			ibPort = C.int(opts.IBPort)
+		}
+		dev = C.device_get(devName, ibPort)
+	}
+	if dev == nil {
+		return nil, fmt.Errorf("failed to open device")
+	}
+
+	fd := C.sock_listen(C.int(opts.Port))
+	if fd < 0 {
+		C.device_put(dev)
+		return nil, fmt.Errorf("failed to listen on port %d", opts.Port)
+	}
+
+	l := &Listener{
+		h:       *h,
+		opts:    opts,
+		fd:      fd,
+		dev:     dev,
+		conns:   make(chan accepted),
+		done:    make(chan struct{}),
+		pending: make(map[C.int]struct{}),
+	}
+	l.wg.Add(1)
+	go l.acceptLoop()
+	return l, nil
+}
+
+// Accept waits for the next client whose handshake completed and returns its
+// connection. A failed handshake is reported as an error without closing the listener.
+// Once the listener is closed, Accept returns net.ErrClosed.
+func (l *Listener) Accept() (*RDMAResources, error) {
+	select {
+	case a := <-l.conns:
+		return a.res, a.err
+	case <-l.done:
+		return nil, net.ErrClosed
+	}
+}
+
+// Close stops accepting clients and releases the listener's port and its reference to
+// the shared device. Handshakes in progress are aborted by shutting their sockets down,
+// so a client that stopped responding does not hold Close up. Their connections are
+// destroyed, while connections already returned by Accept stay open.
+func (l *Listener) Close() error {
+	var err error
+	l.once.Do(func() {
+		close(l.done)
+		l.mu.Lock()
+		l.closed = true
+		for fd := range l.pending {
+			C.sock_shutdown(fd)
+		}
+		l.mu.Unlock()
+		C.sock_shutdown(l.fd)
+		l.wg.Wait()
+		C.close(l.fd)
+		if C.device_put(l.dev) != 0 {
+			err = fmt.Errorf("failed to release device")
+		}
+	})
+	return err
+}
+
+// acceptLoop accepts TCP connections until the listener is closed and starts a
+// handshake for each of them.
+func (l *Listener) acceptLoop() {
+	defer l.wg.Done()
+	for {
+		fd := C.sock_accept(l.fd)
+		select {
+		case <-l.done:
+			if fd >= 0 {
+				C.close(fd)
+			}
+			return
+		default:
+		}
+		if fd < 0 {
+			// out of descriptors or a connection aborted before it was accepted
+			time.Sleep(10 * time.Millisecond)
+			continue
+		}
+		// the handshake closes fd when it fails, so Close shuts the socket down through a
+		// duplicate that stays open until the handshake returned
+		dup := C.dup(fd)
+		if dup < 0 {
+			C.close(fd)
+			continue
+		}
+		l.mu.Lock()
+		if l.closed {
+			l.mu.Unlock()
+			C.close(dup)
+			C.close(fd)
+			return
+		}
+		l.pending[dup] = struct{}{}
+		l.mu.Unlock()
+		l.wg.Add(1)
+		go l.handshake(fd, dup)
+	}
+}
+
+// handshake sets up the RDMA connection of an accepted client and hands it to Accept.
+func (l *Listener) handshake(fd C.int, dup C.int) {
+	defer l.wg.Done()
+
+	a := accepted{}
+	resources, err := newResources(&l.h, l.opts)
+	if err == nil {
+		resources.res.sock = fd
+		resources.res.dev = l.dev
+		err = establish(resources, &l.h, l.opts)
+	} else {
+		C.close(fd)
+	}
+	l.mu.Lock()
+	delete(l.pending, dup)
+	l.mu.Unlock()
+	C.close(dup)
+	if err != nil {
+		a.err = fmt.Errorf("handshake failed: %v", err)
+	} else {
+		a.res = resources
+	}
+
+	select {
+	case l.conns <- a:
+	case <-l.done:
+		if a.res != nil {
+			l.h.Destroy(a.res)
+		}
+	}
+}
@@ -0,0 +1,79 @@
+package rdmahandler
+
+import (
+	"bytes"
+	"os"
+	"testing"
+	"time"
+)
+
+// loopbackPair connects a client and a server through the device bound to the address in
+// RDMAHANDLER_TEST_ADDR, such as the Soft-RoCE device set up by scripts/rxe_loopback.sh,
+// and skips the test if it is not set.
+func loopbackPair(t *testing.T, h *RDMAHandler) (*RDMAResources, *RDMAResources) {
+	addr := os.Getenv("RDMAHANDLER_TEST_ADDR")
+	if addr == "" {
+		t.Skip("RDMAHANDLER_TEST_ADDR is not set; run scripts/rxe_loopback.sh to get an RDMA device")
+	}
+	const port = 19871
+
+	type dialed struct {
+		res *RDMAResources
+		err error
+	}
+	server := make(chan dialed, 1)
+	go func() {
+		res, err := h.Dial(Options{Port: port})
+		server <- dialed{res, err}
+	}()
+
+	var client *RDMAResources
+	var err error
+	for deadline := time.Now().Add(5 * time.Second); time.Now().Before(deadline); time.Sleep(50 * time.Millisecond) {
+		if client, err = h.Dial(Options{Addr: addr, Port: port}); err == nil {
+			break
+		}
+	}
+	if err != nil {
+		t.Fatalf("client: %v", err)
+	}
+	s := <-server
+	if s.err != nil {
+		h.Destroy(client)
+		t.Fatalf("server: %v", s.err)
+	}
+	t.Cleanup(func() {
+		h.Destroy(client)
+		h.Destroy(s.res)
+	})
+	return client, s.res
+}
+
+func TestLoopback(t *testing.T) {
+	h := &RDMAHandler{}
+	client, server := loopbackPair(t, h)
+
+	msg := []byte("hello over rxe")
+	errc := make(chan error, 1)
+	go func() {
+		errc <- h.Write(client, msg, "client")
+	}()
+	got, err := h.Read(server, "server")
+	if err != nil {
+		t.Fatalf("Read: %v", err)
+	}
+	if err := <-errc; err != nil {
+		t.Fatalf("Write: %v", err)
+	}
+	if !bytes.Equal(got, msg) {
+		t.Errorf("Read returned %q, want %q", got, msg)
+	}
+
+	old, err := h.FetchAdd(client, 64, 5, "client")
+	if err != nil {
+		t.Fatalf("FetchAdd: %v", err)
+	}
+	if now, err := h.FetchAdd(client, 64, 1, "client"); err != nil || now != old+5 {
+		t.Errorf("FetchAdd returned %d, %v, want %d", now, err, old+5)
+	}
+}
@@ -0,0 +1,454 @@
+#include <rdma_operations.h>
+
+/******************************************************************************
+Memory pool operations
+Registered memory is carved from slabs in a few size classes per PD. A slab is
+allocated and registered once and its blocks are handed out and returned many
+times, so connections and operations do not pay for ibv_reg_mr every time.
+Pinned memory still grows with the number of open connections, each of which
+holds an exclusive block of its whole buffer size.
+
+Slabs are mapped anonymously, from hugepages when mem_placement asks for
+them, and preferably on the NUMA node of the device, so the NIC does not
+cross sockets or thrash its translation tables to reach them.
+
+Blocks whose rkey is given to a peer, like connection buffers, are exclusive:
+they come from slabs holding a single block, so the peer cannot reach memory
+of other blocks through the shared memory region. Blocks only accessed through
+their lkey are packed many to a slab.
+******************************************************************************/
+static const size_t pool_class_size[POOL_CLASSES] = {
+	4096,	 /* 4 KiB */
+	65536,	 /* 64 KiB */
+	1048576, /* 1 MiB */
+	MSG_SIZE /* default connection buffer */
+};
+
+struct mem_placement mem_placement = {
+	0, /* regular pages */
+	0  /* no NUMA preference */
+};
+
+/******************************************************************************
+ * Function: mem_pool_create
+ *
+ * Input
+ * pd protection domain the memory is registered with
+ * numa_node NUMA node of the device, -1 if unknown
+ * mr_flags access flags slabs are registered with
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new, empty pool, NULL on failure
+ *
+ * Description
+ * Create a memory pool. Slabs are only allocated once blocks are requested.
+ ******************************************************************************/
+struct mem_pool *mem_pool_create(struct ibv_pd *pd, int numa_node, int mr_flags)
+{
+	struct mem_pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+	{
+		log_error("failed to allocate memory pool\n");
+		return NULL;
+	}
+	pool->pd = pd;
+	pool->numa_node = numa_node;
+	pool->mr_flags = mr_flags;
+	pthread_mutex_init(&pool->lock, NULL);
+	for (i = 0; i < POOL_CLASSES; i++)
+		pool->classes[i].size = pool_class_size[i];
+	return pool;
+}
+/******************************************************************************
+ * Function: slab_free
+ *
+ * Input
+ * slab slab whose blocks are all free
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Deregister and free the memory of a slab.
+ ******************************************************************************/
+static int slab_free(struct pool_slab *slab)
+{
+	int rc = 0;
+
+	if (ibv_dereg_mr(slab->mr))
+	{
+		log_error("failed to deregister MR\n");
+		rc = 1;
+	}
+	munmap(slab->mem, slab->size);
+	free(slab->blocks);
+	free(slab);
+	return rc;
+}
+/******************************************************************************
+ * Function: pool_map
+ *
+ * Input
+ * pool memory pool
+ * size minimum number of bytes
+ *
+ * Output
+ * mapped number of bytes mapped, size rounded up to the page size
+ *
+ * Returns
+ * the mapped, zeroed memory, NULL on failure
+ *
+ * Description
+ * Map memory for a slab according to mem_placement. Hugepages fall back to
+ * regular pages when none are available. The memory is not registered, so
+ * callers needing other access flags than the pool's can map through it too
+ * and release the memory with munmap.
+ ******************************************************************************/
+char *pool_map(struct mem_pool *pool, size_t size, size_t *mapped)
+{
+	size_t page = mem_placement.page_size;
+	unsigned long nodemask;
+	char *mem = MAP_FAILED;
+
+	if (page)
+	{
+		*mapped = (size + page - 1) & ~(page - 1);
+		mem = mmap(NULL, *mapped, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctzl(page) << MAP_HUGE_SHIFT), -1, 0);
+		if (mem == MAP_FAILED)
+			log_info("no %zu byte hugepages available, using regular pages\n", page);
+	}
+	if (mem == MAP_FAILED)
+	{
+		page = sysconf(_SC_PAGESIZE);
+		*mapped = (size + page - 1) & ~(page - 1);
+		mem = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+	}
+
+	/* before the pages are touched, so they are faulted in on the right node */
+	if (mem_placement.numa_local && pool->numa_node >= 0 && pool->numa_node < (int)(8 * sizeof(nodemask)))
+	{
+		nodemask = 1UL << pool->numa_node;
+		if (syscall(SYS_mbind, mem, *mapped, MPOL_PREFERRED, &nodemask, 8 * sizeof(nodemask), 0))
+			log_info("failed to bind slab to NUMA node %d\n", pool->numa_node);
+	}
+	return mem;
+}
+/******************************************************************************
+ * Function: mem_pool_destroy
+ *
+ * Input
+ * pool memory pool
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Free every slab of the pool and the pool itself. All blocks must have been
+ * returned.
+ ******************************************************************************/
+int mem_pool_destroy(struct mem_pool *pool)
+{
+	struct pool_slab *slab;
+	int rc = 0;
+	int i;
+
+	for (i = 0; i <= POOL_CLASSES; i++)
+	{
+		while ((slab = pool->classes[i].slabs))
+		{
+			if (slab->used)
+				log_error("destroying memory pool with %d block(s) in use\n", slab->used);
+			pool->classes[i].slabs = slab->next;
+			if (slab_free(slab))
+				rc = 1;
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return rc;
+}
+/******************************************************************************
+ * Function: slab_alloc
+ *
+ * Input
+ * pool memory pool, locked
+ * cls index of the size class, POOL_CLASSES for an oversized block
+ * size size of the blocks
+ * exclusive allocate a slab holding a single block
+ *
+ * Output
+ * the blocks of the new slab are on the free list of the class
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Allocate and register a new slab for a size class.
+ ******************************************************************************/
+static int slab_alloc(struct mem_pool *pool, int cls, size_t size, int exclusive)
+{
+	struct pool_class *c = &pool->classes[cls];
+	struct pool_slab *slab;
+	int mr_flags = pool->mr_flags;
+	int i;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+	{
+		log_error("failed to allocate slab\n");
+		return 1;
+	}
+	slab->exclusive = exclusive;
+	slab->mem = pool_map(pool, exclusive || size >= POOL_SLAB_SIZE ? size : POOL_SLAB_SIZE, &slab->size);
+	if (!slab->mem)
+	{
+		log_error("failed to map memory for slab of %zu byte blocks\n", size);
+		free(slab);
+		return 1;
+	}
+	/* packed slabs use all of a hugepage */
+	slab->nblocks = exclusive ? 1 : slab->size / size;
+	slab->blocks = calloc(slab->nblocks, sizeof(*slab->blocks));
+	if (!slab->blocks)
+	{
+		log_error("failed to allocate slab\n");
+		goto slab_alloc_exit;
+	}
+
+	slab->mr = ibv_reg_mr(pool->pd, slab->mem, slab->size, mr_flags);
+	if (!slab->mr)
+	{
+		log_error("ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+		goto slab_alloc_exit;
+	}
+	log_info("MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n",
+			slab->mem, slab->mr->lkey, slab->mr->rkey, mr_flags);
+
+	for (i = 0; i < slab->nblocks; i++)
+	{
+		slab->blocks[i].addr = slab->mem + i * size;
+		slab->blocks[i].size = size;
+		slab->blocks[i].mr = slab->mr;
+		slab->blocks[i].slab = slab;
+		slab->blocks[i].cls = cls;
+		slab->blocks[i].next = c->free[exclusive];
+		c->free[exclusive] = &slab->blocks[i];
+	}
+	slab->next = c->slabs;
+	c->slabs = slab;
+	c->stats.slabs++;
+	c->stats.free += slab->nblocks;
+	c->stats.registered_bytes += slab->size;
+	return 0;
+
+slab_alloc_exit:
+	munmap(slab->mem, slab->size);
+	free(slab->blocks);
+	free(slab);
+	return 1;
+}
+/******************************************************************************
+ * Function: pool_get
+ *
+ * Input
+ * pool memory pool
+ * size number of bytes needed
+ * exclusive the block's rkey is given to a peer
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * a registered block of at least size bytes, NULL on failure
+ *
+ * Description
+ * Borrow a block from the smallest size class that fits, registering a new
+ * slab when the class has no free block. Sizes beyond the largest class get a
+ * slab of their own that is freed again when the block is returned.
+ * Exclusive blocks are zeroed so no data of a previous user reaches a peer.
+ ******************************************************************************/
+struct pool_block *pool_get(struct mem_pool *pool, size_t size, int exclusive)
+{
+	struct pool_block *blk = NULL;
+	struct pool_class *c;
+	int cls;
+
+	for (cls = 0; cls < POOL_CLASSES && pool_class_size[cls] < size; cls++)
+		;
+	c = &pool->classes[cls];
+	if (cls == POOL_CLASSES)
+		exclusive = 1;
+
+	pthread_mutex_lock(&pool->lock);
+	c->stats.gets++;
+	if (!c->free[exclusive] || cls == POOL_CLASSES)
+	{
+		c->stats.misses++;
+		if (slab_alloc(pool, cls, cls == POOL_CLASSES ? size : c->size, exclusive))
+			goto pool_get_exit;
+	}
+	blk = c->free[exclusive];
+	c->free[exclusive] = blk->next;
+	blk->next = NULL;
+	blk->slab->used++;
+	c->stats.free--;
+	c->stats.in_use++;
+
+pool_get_exit:
+	pthread_mutex_unlock(&pool->lock);
+	if (blk && exclusive)
+		memset(blk->addr, 0, blk->size);
+	return blk;
+}
+/******************************************************************************
+ * Function: pool_put
+ *
+ * Input
+ * pool memory pool the block was borrowed from
+ * blk block
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Return a block to the pool. An oversized block is freed right away.
+ ******************************************************************************/
+void pool_put(struct mem_pool *pool, struct pool_block *blk)
+{
+	struct pool_class *c = &pool->classes[blk->cls];
+	struct pool_slab *slab = blk->slab;
+	struct pool_slab **link;
+
+	pthread_mutex_lock(&pool->lock);
+	slab->used--;
+	c->stats.in_use--;
+	if (blk->cls == POOL_CLASSES)
+	{
+		for (link = &c->slabs; *link != slab; link = &(*link)->next)
+			;
+		*link = slab->next;
+		c->stats.slabs--;
+		c->stats.registered_bytes -= slab->size;
+		pthread_mutex_unlock(&pool->lock);
+		slab_free(slab);
+		return;
+	}
+	blk->next = c->free[slab->exclusive];
+	c->free[slab->exclusive] = blk;
+	c->stats.free++;
+	pthread_mutex_unlock(&pool->lock);
+}
+/******************************************************************************
+ * Function: pool_trim
+ *
+ * Input
+ * pool memory pool
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * number of registered bytes released
+ *
+ * Description
+ * Deregister and free every slab none of whose blocks is in use.
+ ******************************************************************************/
+size_t pool_trim(struct mem_pool *pool)
+{
+	struct pool_slab *idle = NULL;
+	struct pool_slab *slab;
+	struct pool_slab **link;
+	struct pool_block **blk;
+	struct pool_class *c;
+	size_t freed = 0;
+	int i;
+	int x;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		c = &pool->classes[i];
+		/* unlink the free blocks of idle slabs, then the slabs themselves */
+		for (x = 0; x < 2; x++)
+		{
+			blk = &c->free[x];
+			while (*blk)
+			{
+				if (!(*blk)->slab->used)
+					*blk = (*blk)->next;
+				else
+					blk = &(*blk)->next;
+			}
+		}
+		link = &c->slabs;
+		while ((slab = *link))
+		{
+			if (slab->used)
+			{
+				link = &slab->next;
+				continue;
+			}
+			*link = slab->next;
+			c->stats.slabs--;
+			c->stats.free -= slab->nblocks;
+			c->stats.registered_bytes -= slab->size;
+			freed += slab->size;
+			slab->next = idle;
+			idle = slab;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while ((slab = idle))
+	{
+		idle = slab->next;
+		slab_free(slab);
+	}
+	return freed;
+}
+/******************************************************************************
+ * Function: pool_stats
+ *
+ * Input
+ * pool memory pool
+ *
+ * Output
+ * out occupancy of each size class, POOL_CLASSES + 1 entries, the last one
+ * for oversized blocks
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Copy the occupancy counters of the pool.
+ ******************************************************************************/
+void pool_stats(struct mem_pool *pool, struct pool_class_stats *out)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i <= POOL_CLASSES; i++)
+	{
+		out[i] = pool->classes[i].stats;
+		out[i].block_size = pool->classes[i].size;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
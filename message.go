@@ -0,0 +1,106 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"errors"
+	"fmt"
+	"unsafe"
+)
+
+// Send delivers `msg` to the remote peer as a single message, to be returned by its
+// Recv.
+//
+// Unlike Write, which frames a message in the registered buffer and has the peer fetch
+// it, Send uses two-sided send and receive operations: every connection pre-posts a ring
+// of fixed-size receive slots, and the message lands in the next free slot of the peer's
+// ring without any synchronization over the TCP socket. Messages are delivered in order
+// and may be up to Options.MessageSize bytes long. Messages of at most the QP's inline
+// size, see QPAttributes, are handed to the NIC inside the work request itself, saving
+// both the copy into registered memory and the NIC's read of it; larger messages are
+// copied to a registered send slot first.
+//
+// When all slots of the peer's ring hold messages it has not received yet, Send waits
+// for it to call Recv, up to the connection's timeout.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+//
+// Example:
+//
+//	if err := h.Send(clientRes, request, "client"); err != nil {
+//	    log.Fatalf("RDMA send failed: %v", err)
+//	}
+//	reply, err := h.Recv(clientRes, "client")
+func (h *RDMAHandler) Send(res *RDMAResources, msg []byte, character string) error {
+	if len(msg) > res.maxMessage() {
+		return fmt.Errorf("%s: message of %d bytes exceeds slot size of %d bytes", character, len(msg), res.maxMessage())
+	}
+	var data unsafe.Pointer
+	if len(msg) > 0 {
+		data = unsafe.Pointer(&msg[0])
+	}
+	if C.msg_send(res.res, data, C.uint32_t(len(msg))) != 0 {
+		return fmt.Errorf("%s: failed to send message", character)
+	}
+	return nil
+}
+
+// Recv waits for the next message sent by the remote peer's Send and returns a copy of
+// it. The receive slot the message arrived in is posted again right away, and the peer
+// learns about the free slot with its next message from this side, or with a separate
+// notice once half of the ring has been freed.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns the message and nil error. On failure, it returns nil and the
+// error encountered.
+func (h *RDMAHandler) Recv(res *RDMAResources, character string) ([]byte, error) {
+	var data *C.char
+	var length C.uint32_t
+	var slot C.uint64_t
+
+	if C.msg_recv(res.res, &data, &length, &slot) != 0 {
+		return nil, fmt.Errorf("%s: failed to receive message", character)
+	}
+	msg := C.GoBytes(unsafe.Pointer(data), C.int(length))
+	if C.msg_release(res.res, slot) != 0 {
+		return nil, fmt.Errorf("%s: failed to repost receive slot", character)
+	}
+	return msg, nil
+}
+
+// errIdle reports that a wait for a message ended without one.
+var errIdle = errors.New("no message arrived")
+
+// recvIdle receives a message like Recv for receivers that wait on an idle connection in a
+// loop. A wait that ends without a message returns errIdle and, unlike a timeout of Recv,
+// is neither logged nor counted in Stats.Timeouts.
+func recvIdle(res *RDMAResources, character string) ([]byte, error) {
+	var data *C.char
+	var length C.uint32_t
+	var slot C.uint64_t
+
+	switch C.msg_wait(res.res, &data, &length, &slot) {
+	case 0:
+	case 2:
+		return nil, errIdle
+	default:
+		return nil, fmt.Errorf("%s: failed to receive message", character)
+	}
+	msg := C.GoBytes(unsafe.Pointer(data), C.int(length))
+	if C.msg_release(res.res, slot) != 0 {
+		return nil, fmt.Errorf("%s: failed to repost receive slot", character)
+	}
+	return msg, nil
+}
+
+// maxMessage returns the largest message Send can deliver.
+func (res *RDMAResources) maxMessage() int {
+	return int(res.res.cfg.msg_size)
+}
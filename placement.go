@@ -0,0 +1,84 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"runtime"
+)
+
+// Hugepage sizes that can back registered memory.
+const (
+	HugePage2M = 2 << 20
+	HugePage1G = 1 << 30
+)
+
+// Placement controls where registered memory is allocated.
+//
+// HugePageSize backs the slabs of the memory pools with hugepages of that size, either
+// HugePage2M or HugePage1G, so the NIC needs far fewer translation entries for large
+// transfers; zero uses regular pages. Hugepages must have been reserved, e.g. through
+// /proc/sys/vm/nr_hugepages, otherwise regular pages are used. With 1 GiB pages every
+// exclusive block, such as a connection buffer, occupies at least one page.
+//
+// NUMALocal places the slabs on the NUMA node the device is attached to, as reported
+// by sysfs, instead of the node of whichever thread touches them first.
+type Placement struct {
+	HugePageSize int
+	NUMALocal    bool
+}
+
+// SetMemoryPlacement sets how registered memory is allocated from now on, process wide.
+// Slabs already allocated keep their placement, so it should be called before
+// connections are created.
+//
+// Example:
+//
+//	err := rdmahandler.SetMemoryPlacement(rdmahandler.Placement{
+//	    HugePageSize: rdmahandler.HugePage2M,
+//	    NUMALocal:    true,
+//	})
+func SetMemoryPlacement(p Placement) error {
+	switch p.HugePageSize {
+	case 0, HugePage2M, HugePage1G:
+	default:
+		return fmt.Errorf("unsupported hugepage size %d", p.HugePageSize)
+	}
+	C.mem_placement.page_size = C.size_t(p.HugePageSize)
+	C.mem_placement.numa_local = 0
+	if p.NUMALocal {
+		C.mem_placement.numa_local = 1
+	}
+	return nil
+}
+
+// NUMANode returns the NUMA node the connection's device is attached to, or -1 if it
+// is unknown.
+func (res *RDMAResources) NUMANode() int {
+	return int(res.res.dev.numa_node)
+}
+
+// PinThread locks the calling goroutine to its OS thread and restricts that thread to
+// the CPUs local to the connection's device, so that a goroutine polling the connection
+// runs on the NIC's NUMA node. It fails when the local CPUs are unknown. The thread
+// keeps its affinity until the process exits, so the goroutine should not unlock it.
+func (res *RDMAResources) PinThread() error {
+	return pinThread(res.res.dev)
+}
+
+// PinThread is like RDMAResources.PinThread for a goroutine running the progress loop
+// of the shared completion queue.
+func (cq *SharedCQ) PinThread() error {
+	return pinThread(cq.q.dev)
+}
+
+func pinThread(dev *C.struct_rdma_device) error {
+	runtime.LockOSThread()
+	if C.device_pin_thread(dev) != 0 {
+		runtime.UnlockOSThread()
+		return fmt.Errorf("failed to pin thread to the CPUs of the device")
+	}
+	return nil
+}
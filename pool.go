@@ -0,0 +1,131 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// PoolBuffer is a block of registered memory borrowed from the memory pool of a device.
+//
+// Every device keeps a pool of registered slabs in a few size classes, shared by all
+// connections on it. Connection buffers are taken from the pool, and operations can
+// borrow blocks of their own for data that does not fit the connection buffer or that
+// should not be copied through it. Returned blocks are reused without registering memory
+// again, which saves the cost of ibv_reg_mr but not pinned memory: every connection holds
+// an exclusive block of its full buffer size for as long as it exists, since the peer
+// gets the rkey of that block.
+//
+// Example:
+//
+//	buf, err := res.Borrow(1 << 20)
+//	if err != nil {
+//	    log.Fatalf("Failed to borrow buffer: %v", err)
+//	}
+//	defer buf.Release()
+//	n := copy(buf.Bytes(), data)
+//	c, err := h.WriteAsyncFrom(res, buf, n, 0, "client")
+type PoolBuffer struct {
+	blk  *C.struct_pool_block
+	dev  *C.struct_rdma_device
+	size int
+}
+
+// PoolClassStats describes the occupancy of one size class of a memory pool. BlockSize
+// is 0 for the class of blocks larger than the largest size class, which get registered
+// memory of their own that is released when they are returned.
+type PoolClassStats struct {
+	BlockSize       int
+	InUse           uint64
+	Free            uint64
+	Slabs           uint64
+	RegisteredBytes uint64
+	Gets            uint64
+	Misses          uint64
+}
+
+// Borrow takes a block of at least `size` bytes of registered memory from the pool of
+// the connection's device. The block can be used with the operations of any connection
+// on the same device and must be returned with Release.
+//
+// On success, it returns the buffer and nil error. On failure, it returns nil and the
+// error encountered.
+func (res *RDMAResources) Borrow(size int) (*PoolBuffer, error) {
+	if size <= 0 {
+		return nil, fmt.Errorf("invalid buffer size %d", size)
+	}
+	dev := res.res.dev
+	blk := C.pool_get(dev.pool, C.size_t(size), 0)
+	if blk == nil {
+		return nil, fmt.Errorf("failed to borrow %d bytes of registered memory", size)
+	}
+	C.device_hold(dev)
+	return &PoolBuffer{blk: blk, dev: dev, size: size}, nil
+}
+
+// Bytes returns the memory of the buffer, `size` bytes as passed to Borrow.
+func (b *PoolBuffer) Bytes() []byte {
+	return unsafe.Slice((*byte)(unsafe.Pointer(b.blk.addr)), b.size)
+}
+
+// Release returns the buffer to the pool. No operation may still be using it, and the
+// slice returned by Bytes must not be used afterwards.
+func (b *PoolBuffer) Release() {
+	if b.blk == nil {
+		return
+	}
+	C.pool_put(b.dev.pool, b.blk)
+	C.device_put(b.dev)
+	b.blk = nil
+}
+
+// WriteAsyncFrom starts an RDMA write of the first `length` bytes of `buf` to `offset`
+// in the remote peer's buffer, without staging them in the connection's buffer first.
+// It is otherwise like WriteAsync; `buf` must not be modified or released until the
+// write completes.
+func (h *RDMAHandler) WriteAsyncFrom(res *RDMAResources, buf *PoolBuffer, length int, offset int, character string) (*Completion, error) {
+	return postAsyncFrom(res, C.IBV_WR_RDMA_WRITE, buf, length, offset, character)
+}
+
+// ReadAsyncInto starts an RDMA read of `length` bytes at `offset` in the remote peer's
+// buffer into the start of `buf`. It is otherwise like ReadAsync; the data is available
+// from buf.Bytes() once the Completion is waited for.
+func (h *RDMAHandler) ReadAsyncInto(res *RDMAResources, buf *PoolBuffer, length int, offset int, character string) (*Completion, error) {
+	return postAsyncFrom(res, C.IBV_WR_RDMA_READ, buf, length, offset, character)
+}
+
+// PoolStats returns the occupancy of each size class of the memory pool of the
+// connection's device, smallest class first and oversized blocks last.
+func (res *RDMAResources) PoolStats() []PoolClassStats {
+	var cs [C.POOL_CLASSES + 1]C.struct_pool_class_stats
+	C.pool_stats(res.res.dev.pool, &cs[0])
+
+	stats := make([]PoolClassStats, len(cs))
+	for i, c := range cs {
+		stats[i] = PoolClassStats{
+			BlockSize:       int(c.block_size),
+			InUse:           uint64(c.in_use),
+			Free:            uint64(c.free),
+			Slabs:           uint64(c.slabs),
+			RegisteredBytes: uint64(c.registered_bytes),
+			Gets:            uint64(c.gets),
+			Misses:          uint64(c.misses),
+		}
+	}
+	return stats
+}
+
+// TrimPool deregisters and frees the slabs of the connection's device pool that have no
+// block in use, and returns the number of bytes released.
+func (res *RDMAResources) TrimPool() int {
+	return int(C.pool_trim(res.res.dev.pool))
+}
+
+// postAsyncFrom posts an asynchronous operation between the first `length` bytes of
+// `buf` and `offset` in the remote buffer.
+func postAsyncFrom(res *RDMAResources, opcode C.int, buf *PoolBuffer, length int, offset int, character string) (*Completion, error) {
+	return postRegionSegments(res, opcode, "", []Segment{{Buf: buf, Length: length}}, offset, character)
+}
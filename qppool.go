@@ -0,0 +1,209 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"sync"
+	"unsafe"
+)
+
+// QPPool keeps queue pairs warm for connections that come and go, such as short-lived
+// workers whose connection setup would otherwise take longer than their transfers.
+//
+// A warm queue pair has everything a connection needs besides its peer: the completion
+// queue, the registered buffer and receive ring, and the queue pair itself, moved to the
+// INIT state with its receive ring posted. Connections created by an RDMAHandler whose
+// QPPool field is set take a warm queue pair if one is idle, so connecting only exchanges
+// the connection data and moves the queue pair to RTR and RTS. When such a connection is
+// destroyed, its queue pair is reset, cleared and warmed again for the next connection
+// instead of being torn down, as long as the pool has room for it.
+//
+// A connection only uses the pool if it is built the way the pool's queue pairs are: with
+// the Device, IBPort, BufferSize, MessageSize and RecvDepth options and the SendDepth,
+// CQDepth, Blocking and SharedRQ settings the pool was created with. Connections on a
+// SharedCQ or over the RDMA CM are never pooled.
+//
+// Example:
+//
+//	pool, err := h.NewQPPool(rdmahandler.Options{BufferSize: 1 << 20}, 8)
+//	if err != nil {
+//	    log.Fatalf("Failed to create QP pool: %v", err)
+//	}
+//	defer pool.Close()
+//	h.QPPool = pool
+//	for job := range jobs {
+//	    res, err := h.Dial(rdmahandler.Options{Addr: job.Addr, Port: 8080, BufferSize: 1 << 20})
+//	    ...
+//	    h.Destroy(res)
+//	}
+type QPPool struct {
+	key    qpPoolKey
+	size   int
+	mu     sync.Mutex
+	idle   []*C.struct_resources
+	closed bool
+}
+
+// qpPoolKey holds the settings that decide how the resources of a connection are built.
+type qpPoolKey struct {
+	device      string
+	ibPort      int
+	bufferSize  int
+	messageSize int
+	recvDepth   int
+	sendDepth   int
+	cqDepth     int
+	blocking    bool
+	sharedRQ    *SharedRQ
+}
+
+// poolKey returns the key of the connections `h` creates with `opts`.
+func poolKey(h *RDMAHandler, opts Options) qpPoolKey {
+	return qpPoolKey{
+		device:      opts.Device,
+		ibPort:      opts.IBPort,
+		bufferSize:  opts.BufferSize,
+		messageSize: opts.MessageSize,
+		recvDepth:   opts.RecvDepth,
+		sendDepth:   h.SendDepth,
+		cqDepth:     h.CQDepth,
+		blocking:    h.Blocking,
+		sharedRQ:    h.SharedRQ,
+	}
+}
+
+// NewQPPool creates a pool of `size` warm queue pairs for the connections `h` creates
+// with options like `opts`, whose Addr and Port are ignored. The handler's QPPool field
+// is not set; the pool serves every handler with matching settings it is assigned to.
+//
+// On success, it returns the pool and nil error. On failure, it returns nil and the error
+// encountered.
+func (h *RDMAHandler) NewQPPool(opts Options, size int) (*QPPool, error) {
+	if size <= 0 {
+		return nil, fmt.Errorf("invalid QP pool size %d", size)
+	}
+	if h.SharedCQ != nil {
+		return nil, fmt.Errorf("QPs on a shared completion queue cannot be pooled")
+	}
+	opts.Addr = ""
+	opts.CM = false
+	p := &QPPool{key: poolKey(h, opts), size: size}
+	for i := 0; i < size; i++ {
+		resources, err := newResources(h, opts)
+		if err != nil {
+			p.Close()
+			return nil, err
+		}
+		res := resources.res
+		if C.resources_build(res) != 0 {
+			freeResources(resources)
+			p.Close()
+			return nil, fmt.Errorf("failed to create resources")
+		}
+		C.free(unsafe.Pointer(res.cfg.dev_name))
+		res.cfg.dev_name = nil
+		if C.qp_warm(res) != 0 {
+			C.resources_destroy(res)
+			freeResources(resources)
+			p.Close()
+			return nil, fmt.Errorf("failed to warm QP")
+		}
+		p.idle = append(p.idle, res)
+	}
+	return p, nil
+}
+
+// Idle returns the number of warm queue pairs waiting for a connection.
+func (p *QPPool) Idle() int {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	return len(p.idle)
+}
+
+// Close destroys the idle queue pairs. Connections still using queue pairs of the pool
+// destroy theirs when they are destroyed.
+func (p *QPPool) Close() error {
+	p.mu.Lock()
+	idle := p.idle
+	p.idle = nil
+	p.closed = true
+	p.mu.Unlock()
+
+	var err error
+	for _, res := range idle {
+		if C.resources_destroy(res) != 0 {
+			err = fmt.Errorf("failed to destroy resources")
+		}
+		C.free(unsafe.Pointer(res))
+	}
+	return err
+}
+
+// take hands a warm queue pair to a connection about to be established, if one is idle
+// and the connection is built like the pool's, and marks the connection for recycling.
+// The connection keeps its configuration and socket; the resources allocated for it by
+// newResources are freed.
+func (p *QPPool) take(resources *RDMAResources, h *RDMAHandler, opts Options) {
+	if opts.CM || h.SharedCQ != nil || poolKey(h, opts) != p.key {
+		return
+	}
+	resources.pool = p
+	fresh := resources.res
+
+	p.mu.Lock()
+	var res *C.struct_resources
+	for i := len(p.idle) - 1; i >= 0; i-- {
+		// a listener supplies the device its client connected on
+		if fresh.dev == nil || p.idle[i].dev == fresh.dev {
+			res = p.idle[i]
+			p.idle = append(p.idle[:i], p.idle[i+1:]...)
+			break
+		}
+	}
+	p.mu.Unlock()
+	if res == nil {
+		return
+	}
+
+	// the pool's resources fix what they were built with
+	cfg := fresh.cfg
+	cfg.ib_port = res.cfg.ib_port
+	cfg.buf_size = res.cfg.buf_size
+	cfg.msg_size = res.cfg.msg_size
+	cfg.msg_depth = res.cfg.msg_depth
+	res.cfg = cfg
+	res.sock = fresh.sock
+	res.spin_usec = fresh.spin_usec
+	res.timeout_msec = fresh.timeout_msec
+	if res.timeout_msec <= 0 {
+		res.timeout_msec = C.MAX_POLL_CQ_TIMEOUT
+	}
+	C.free(unsafe.Pointer(fresh))
+	resources.res = res
+}
+
+// recycle returns the resources of a connection being destroyed to the pool. It reports
+// whether the pool took them; otherwise the caller destroys them.
+func (p *QPPool) recycle(res *C.struct_resources) bool {
+	p.mu.Lock()
+	full := p.closed || len(p.idle) >= p.size
+	p.mu.Unlock()
+	if full || C.resources_recycle(res) != 0 {
+		return false
+	}
+
+	p.mu.Lock()
+	if !p.closed && len(p.idle) < p.size {
+		p.idle = append(p.idle, res)
+		res = nil
+	}
+	p.mu.Unlock()
+	if res != nil {
+		C.resources_destroy(res)
+		C.free(unsafe.Pointer(res))
+	}
+	return true
+}
@@ -0,0 +1,58 @@
+package rdmahandler
+
+import (
+	"testing"
+	"time"
+)
+
+func TestPoolKey(t *testing.T) {
+	srq := &SharedRQ{}
+	h := &RDMAHandler{SendDepth: 64, CQDepth: 128, Blocking: true}
+	base := Options{Device: "rxe0", IBPort: 1, BufferSize: 1 << 20, MessageSize: 4096, RecvDepth: 32}
+	key := poolKey(h, base)
+
+	same := []struct {
+		name string
+		h    *RDMAHandler
+		opts Options
+	}{
+		{"identical", h, base},
+		{"address and port", h, Options{Addr: "10.0.0.1", Port: 8080, Device: "rxe0", IBPort: 1, BufferSize: 1 << 20,
+			MessageSize: 4096, RecvDepth: 32}},
+		{"QP timers", h, Options{Device: "rxe0", IBPort: 1, BufferSize: 1 << 20, MessageSize: 4096, RecvDepth: 32,
+			MTU: 1024, AckTimeout: 14, RetryCount: 7}},
+		{"handler timeouts", &RDMAHandler{SendDepth: 64, CQDepth: 128, Blocking: true, SpinTime: time.Millisecond,
+			Timeout: time.Second}, base},
+	}
+	for _, tt := range same {
+		if got := poolKey(tt.h, tt.opts); got != key {
+			t.Errorf("%s: key %+v differs from %+v", tt.name, got, key)
+		}
+	}
+
+	with := func(f func(*Options)) Options {
+		opts := base
+		f(&opts)
+		return opts
+	}
+	differ := []struct {
+		name string
+		h    *RDMAHandler
+		opts Options
+	}{
+		{"device", h, with(func(o *Options) { o.Device = "mlx5_0" })},
+		{"IB port", h, with(func(o *Options) { o.IBPort = 2 })},
+		{"buffer size", h, with(func(o *Options) { o.BufferSize = 1 << 21 })},
+		{"message size", h, with(func(o *Options) { o.MessageSize = 8192 })},
+		{"receive depth", h, with(func(o *Options) { o.RecvDepth = 16 })},
+		{"send depth", &RDMAHandler{SendDepth: 32, CQDepth: 128, Blocking: true}, base},
+		{"CQ depth", &RDMAHandler{SendDepth: 64, CQDepth: 256, Blocking: true}, base},
+		{"blocking", &RDMAHandler{SendDepth: 64, CQDepth: 128}, base},
+		{"shared RQ", &RDMAHandler{SendDepth: 64, CQDepth: 128, Blocking: true, SharedRQ: srq}, base},
+	}
+	for _, tt := range differ {
+		if got := poolKey(tt.h, tt.opts); got == key {
+			t.Errorf("%s: key matches the pool's", tt.name)
+		}
+	}
+}
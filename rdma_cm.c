@@ -0,0 +1,381 @@
+//go:build rdmacm
+
+#include <rdma_operations.h>
+#include <rdma/rdma_cma.h>
+
+/******************************************************************************
+RDMA connection manager
+Instead of exchanging QP information over a TCP connection, a connection can
+be set up by the RDMA CM: it resolves the address and the route of the remote
+side, which also selects the device, port and GID to use, and carries the
+connection data of both sides in the private data of its connect request and
+reply. The QP stays the one resources_create made on the cached device; it is
+moved through its states with the attributes the CM computes for the route.
+******************************************************************************/
+#define CM_RESOLVE_TIMEOUT_MS 2000
+
+/******************************************************************************
+ * Function: cm_wait
+ *
+ * Input
+ * res pointer to resources structure
+ * expected event to wait for
+ *
+ * Output
+ * event the event, to be acknowledged by the caller
+ *
+ * Returns
+ * 0 on success, 1 if another event arrived or the channel failed
+ *
+ * Description
+ * Wait for the next event on the event channel of the connection and check
+ * that it is the expected one.
+ ******************************************************************************/
+static int cm_wait(struct resources *res, enum rdma_cm_event_type expected, struct rdma_cm_event **event)
+{
+	if (rdma_get_cm_event(res->cm_events, event))
+	{
+		log_error("failed to get RDMA CM event: %s\n", strerror(errno));
+		return 1;
+	}
+	if ((*event)->event != expected)
+	{
+		log_error("RDMA CM reported %s while waiting for %s, status %d\n", rdma_event_str((*event)->event),
+				rdma_event_str(expected), (*event)->status);
+		rdma_ack_cm_event(*event);
+		return 1;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: cm_listen
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * res->cm_id connection of the first client, res->cm_request its data
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Listen on the TCP port number of the configuration for a single connect
+ * request and stop listening again, like sock_connect does for the server.
+ ******************************************************************************/
+static int cm_listen(struct resources *res)
+{
+	struct rdma_cm_id *listen_id = NULL;
+	struct rdma_cm_id *id;
+	struct rdma_cm_event *event;
+	struct sockaddr_in addr;
+	int rc = 1;
+
+	if (rdma_create_id(res->cm_events, &listen_id, NULL, RDMA_PS_TCP))
+	{
+		log_error("failed to create RDMA CM ID: %s\n", strerror(errno));
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(res->cfg.tcp_port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (rdma_bind_addr(listen_id, (struct sockaddr *)&addr) || rdma_listen(listen_id, 1))
+	{
+		log_error("failed to listen on port %d: %s\n", res->cfg.tcp_port, strerror(errno));
+		goto cm_listen_exit;
+	}
+	log_info("waiting on port %d for RDMA CM connect request\n", res->cfg.tcp_port);
+	if (cm_wait(res, RDMA_CM_EVENT_CONNECT_REQUEST, &event))
+		goto cm_listen_exit;
+
+	id = event->id;
+	if (event->param.conn.private_data_len < sizeof(res->cm_request))
+	{
+		log_error("connect request carries %u bytes of connection data, %zu expected\n",
+				event->param.conn.private_data_len, sizeof(res->cm_request));
+		rdma_ack_cm_event(event);
+		rdma_reject(id, NULL, 0);
+		rdma_destroy_id(id);
+		goto cm_listen_exit;
+	}
+	memcpy(&res->cm_request, event->param.conn.private_data, sizeof(res->cm_request));
+	rdma_ack_cm_event(event);
+	res->cm_id = id;
+	rc = 0;
+
+cm_listen_exit:
+	rdma_destroy_id(listen_id);
+	return rc;
+}
+/******************************************************************************
+ * Function: cm_resolve
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * res->cm_id resolved connection, res->cfg.dev_name and res->cfg.ib_port the
+ * device and port it uses
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Resolve the address and the route to the server of the configuration, or
+ * wait for the connect request of a client without one, and set the device
+ * to the one the route goes through, whatever was configured. Call before
+ * resources_create, and cm_connect_qp after it.
+ ******************************************************************************/
+int cm_resolve(struct resources *res)
+{
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *resolved_addr = NULL;
+	struct rdma_cm_event *event;
+	char service[6];
+	int rc = 1;
+
+	res->cm_events = rdma_create_event_channel();
+	if (!res->cm_events)
+	{
+		log_error("failed to create RDMA CM event channel: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!res->cfg.server_name)
+	{
+		if (cm_listen(res))
+			return 1;
+		goto cm_resolve_device;
+	}
+
+	if (rdma_create_id(res->cm_events, &res->cm_id, NULL, RDMA_PS_TCP))
+	{
+		log_error("failed to create RDMA CM ID: %s\n", strerror(errno));
+		res->cm_id = NULL;
+		return 1;
+	}
+	sprintf(service, "%d", res->cfg.tcp_port);
+	rc = getaddrinfo(res->cfg.server_name, service, &hints, &resolved_addr);
+	if (rc)
+	{
+		log_error("%s for %s:%d\n", gai_strerror(rc), res->cfg.server_name, res->cfg.tcp_port);
+		return 1;
+	}
+	rc = 1;
+	if (rdma_resolve_addr(res->cm_id, NULL, resolved_addr->ai_addr, CM_RESOLVE_TIMEOUT_MS))
+	{
+		log_error("failed to resolve address %s: %s\n", res->cfg.server_name, strerror(errno));
+		goto cm_resolve_exit;
+	}
+	if (cm_wait(res, RDMA_CM_EVENT_ADDR_RESOLVED, &event))
+		goto cm_resolve_exit;
+	rdma_ack_cm_event(event);
+	if (rdma_resolve_route(res->cm_id, CM_RESOLVE_TIMEOUT_MS))
+	{
+		log_error("failed to resolve route to %s: %s\n", res->cfg.server_name, strerror(errno));
+		goto cm_resolve_exit;
+	}
+	if (cm_wait(res, RDMA_CM_EVENT_ROUTE_RESOLVED, &event))
+		goto cm_resolve_exit;
+	rdma_ack_cm_event(event);
+
+cm_resolve_device:
+	free((char *)res->cfg.dev_name);
+	res->cfg.dev_name = strdup(ibv_get_device_name(res->cm_id->verbs->device));
+	res->cfg.ib_port = res->cm_id->port_num;
+	if (!res->cfg.dev_name)
+	{
+		log_error("failed to allocate device name\n");
+		goto cm_resolve_exit;
+	}
+	log_info("RDMA CM resolved the connection to device %s, port %d\n", res->cfg.dev_name, res->cfg.ib_port);
+	rc = 0;
+
+cm_resolve_exit:
+	if (resolved_addr)
+		freeaddrinfo(resolved_addr);
+	return rc;
+}
+/******************************************************************************
+ * Function: cm_modify_qp
+ *
+ * Input
+ * res pointer to resources structure
+ * state IBV_QPS_RTR or IBV_QPS_RTS
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Transition the QP with the attributes the RDMA CM computed for the route,
+ * among them the address vector with the right GID, lowered to the
+ * negotiated MTU and reads in flight and set to the configured timers.
+ ******************************************************************************/
+static int cm_modify_qp(struct resources *res, enum ibv_qp_state state)
+{
+	struct ibv_qp_attr attr;
+	int mask;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = state;
+	if (rdma_init_qp_attr(res->cm_id, &attr, &mask))
+	{
+		log_error("failed to get QP attributes from RDMA CM: %s\n", strerror(errno));
+		return 1;
+	}
+	if (state == IBV_QPS_RTR)
+	{
+		if ((int)attr.path_mtu > res->path_mtu)
+			attr.path_mtu = res->path_mtu;
+		res->path_mtu = attr.path_mtu;
+		attr.max_dest_rd_atomic = res->max_dest_rd_atomic;
+		attr.min_rnr_timer = res->cfg.min_rnr_timer;
+	}
+	else
+	{
+		attr.timeout = res->cfg.timeout;
+		attr.retry_cnt = res->cfg.retry_cnt;
+		attr.rnr_retry = res->cfg.rnr_retry;
+		attr.max_rd_atomic = res->max_rd_atomic;
+	}
+	if (ibv_modify_qp(res->qp, &attr, mask))
+	{
+		log_error("failed to modify QP state to %s\n", state == IBV_QPS_RTR ? "RTR" : "RTS");
+		return 1;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: cm_connect_qp
+ *
+ * Input
+ * res pointer to resources structure, resolved with cm_resolve
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Connect the QP through the RDMA CM, the counterpart of connect_qp. The
+ * client sends its connection data with the connect request and moves its
+ * QP to RTS once the reply brought the server's; the server moves its QP to
+ * RTS before accepting with its own data.
+ ******************************************************************************/
+int cm_connect_qp(struct resources *res)
+{
+	struct cm_con_data_t local_con_data;
+	struct cm_con_data_t remote_con_data;
+	struct rdma_conn_param param;
+	struct rdma_cm_event *event;
+	int server = !res->cfg.server_name;
+
+	con_data_local(res, &local_con_data);
+	memset(&param, 0, sizeof(param));
+	param.private_data = &local_con_data;
+	param.private_data_len = sizeof(local_con_data);
+	param.qp_num = res->qp->qp_num;
+	param.srq = res->srq ? 1 : 0;
+	param.retry_count = res->cfg.retry_cnt;
+	param.rnr_retry_count = res->cfg.rnr_retry;
+
+	if (server && con_data_remote(res, &local_con_data, &res->cm_request))
+	{
+		rdma_reject(res->cm_id, NULL, 0);
+		return 1;
+	}
+	if (qp_warm(res))
+		return 1;
+
+	if (server)
+	{
+		if (cm_modify_qp(res, IBV_QPS_RTR) || cm_modify_qp(res, IBV_QPS_RTS))
+		{
+			rdma_reject(res->cm_id, NULL, 0);
+			return 1;
+		}
+		param.responder_resources = res->max_dest_rd_atomic;
+		param.initiator_depth = res->max_rd_atomic;
+		if (rdma_accept(res->cm_id, &param))
+		{
+			log_error("failed to accept connection: %s\n", strerror(errno));
+			return 1;
+		}
+		if (cm_wait(res, RDMA_CM_EVENT_ESTABLISHED, &event))
+			return 1;
+		rdma_ack_cm_event(event);
+		log_info("QP state was change to RTS\n");
+		res->warm = 0;
+		return 0;
+	}
+
+	param.responder_resources = local_con_data.rd_atom;
+	param.initiator_depth = local_con_data.init_rd_atom;
+	if (rdma_connect(res->cm_id, &param))
+	{
+		log_error("failed to connect to %s: %s\n", res->cfg.server_name, strerror(errno));
+		return 1;
+	}
+	/* without a QP of its own the CM hands the reply to us instead of
+	   establishing the connection */
+	if (cm_wait(res, RDMA_CM_EVENT_CONNECT_RESPONSE, &event))
+		return 1;
+	if (event->param.conn.private_data_len < sizeof(remote_con_data))
+	{
+		log_error("connect reply carries %u bytes of connection data, %zu expected\n",
+				event->param.conn.private_data_len, sizeof(remote_con_data));
+		rdma_ack_cm_event(event);
+		return 1;
+	}
+	memcpy(&remote_con_data, event->param.conn.private_data, sizeof(remote_con_data));
+	rdma_ack_cm_event(event);
+
+	if (con_data_remote(res, &local_con_data, &remote_con_data))
+		return 1;
+	if (cm_modify_qp(res, IBV_QPS_RTR) || cm_modify_qp(res, IBV_QPS_RTS))
+		return 1;
+	if (rdma_establish(res->cm_id))
+	{
+		log_error("failed to establish connection: %s\n", strerror(errno));
+		return 1;
+	}
+	log_info("QP state was change to RTS\n");
+	res->warm = 0;
+	return 0;
+}
+/******************************************************************************
+ * Function: cm_destroy
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Disconnect and release the RDMA CM connection and its event channel, if
+ * any. Safe to call more than once.
+ ******************************************************************************/
+void cm_destroy(struct resources *res)
+{
+	if (res->cm_id)
+	{
+		rdma_disconnect(res->cm_id);
+		if (rdma_destroy_id(res->cm_id))
+			log_error("failed to destroy RDMA CM ID\n");
+		res->cm_id = NULL;
+	}
+	if (res->cm_events)
+	{
+		rdma_destroy_event_channel(res->cm_events);
+		res->cm_events = NULL;
+	}
+}
@@ -5,9 +5,25 @@ struct config_t config = {
 	NULL,  /* server host name */
 	19875, /* server TCP port */
 	1,	   /* local IB port to work with */
-	0      /* gid index to use. RoCE requires GID, InfiniBand not required if in one subnet */
+	0,     /* gid index to use. RoCE requires GID, InfiniBand not required if in one subnet */
+	MSG_SIZE, /* registered buffer size */
+	0,     /* path MTU, negotiated from the active MTU of both ports */
+	0,     /* reads and atomics in flight, negotiated from both devices */
+	0x12,  /* RNR NAK timer */
+	0x12,  /* local ACK timeout */
+	6,     /* retry count */
+	0,     /* RNR retry count */
+	MSG_SLOT_SIZE, /* message slot size */
+	MSG_RECV_DEPTH /* message slots in the receive ring */
 };
 
+int log_level = LOG_LEVEL_INFO;
+
+#define stat_add(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+static int post_async_imm(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+						  uint64_t remote_addr, uint32_t rkey, uint32_t imm, uint64_t *wr_id);
+
 /******************************************************************************
 Socket operations
 For simplicity, the example program uses TCP sockets to exchange control
@@ -56,7 +72,7 @@ int sock_connect(const char *servername, int port)
 	sockfd = getaddrinfo(servername, service, &hints, &resolved_addr);
 	if (sockfd < 0)
 	{
-		fprintf(stderr, "%s for %s:%d\n", gai_strerror(sockfd), servername, port);
+		log_error("%s for %s:%d\n", gai_strerror(sockfd), servername, port);
 		goto sock_connect_exit;
 	}
 
@@ -69,7 +85,7 @@ int sock_connect(const char *servername, int port)
 			{
 				if ((tmp = connect(sockfd, iterator->ai_addr, iterator->ai_addrlen)))
 				{
-					fprintf(stdout, "failed connect \n");
+					log_info("failed connect \n");
 					close(sockfd);
 					sockfd = -1;
 				}
@@ -94,15 +110,107 @@ sock_connect_exit:
 	if (sockfd < 0)
 	{
 		if (servername)
-			fprintf(stderr, "Couldn't connect to %s:%d\n", servername, port);
+			log_error("Couldn't connect to %s:%d\n", servername, port);
 		else
 		{
 			perror("server accept");
-			fprintf(stderr, "accept() failed\n");
+			log_error("accept() failed\n");
 		}
 	}
 	return sockfd;
 }
+/******************************************************************************
+ * Function: sock_listen
+ *
+ * Input
+ * port port of service
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * listening socket (fd) on success, negative error code on failure
+ *
+ * Description
+ * Open a socket listening on the indicated port for any number of incoming
+ * connections, to be accepted with sock_accept. The port can be rebound while
+ * connections accepted on it are still open.
+ *
+ ******************************************************************************/
+int sock_listen(int port)
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	int on = 1;
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0)
+	{
+		log_error("failed to create socket\n");
+		return -1;
+	}
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listenfd, SOMAXCONN))
+	{
+		log_error("failed to listen on port %d: %s\n", port, strerror(errno));
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+/******************************************************************************
+ * Function: sock_accept
+ *
+ * Input
+ * listenfd socket returned by sock_listen
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * socket (fd) of the accepted connection, negative error code on failure
+ *
+ * Description
+ * Wait for the next incoming connection. Fails once sock_shutdown was called
+ * on the listening socket.
+ *
+ ******************************************************************************/
+int sock_accept(int listenfd)
+{
+	int sockfd;
+
+	do
+		sockfd = accept(listenfd, NULL, 0);
+	while (sockfd < 0 && errno == EINTR);
+	return sockfd;
+}
+/******************************************************************************
+ * Function: sock_shutdown
+ *
+ * Input
+ * sock socket returned by sock_listen or sock_accept
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Stop accepting connections and wake up threads blocked in sock_accept, or
+ * abort the transfers of threads blocked in sock_sync_data. The socket still
+ * has to be closed once they have returned.
+ *
+ ******************************************************************************/
+void sock_shutdown(int sock)
+{
+	shutdown(sock, SHUT_RDWR);
+}
 /******************************************************************************
  * Function: sock_sync_data
  *
@@ -124,7 +232,7 @@ sock_connect_exit:
  * order. Chaos will ensue if they are not. :)
  *
  * Also note this is a blocking function and will wait for the full data to be
- * received from the remote.
+ * received from the remote, or until the socket is shut down.
  *
  ******************************************************************************/
 int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data)
@@ -134,7 +242,7 @@ int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data)
 	int total_read_bytes = 0;
 	rc = write(sock, local_data, xfer_size);
 	if (rc < xfer_size)
-		fprintf(stderr, "Failed writing data during sock_sync_data\n");
+		log_error("Failed writing data during sock_sync_data\n");
 	else
 		rc = 0;
 	while (!rc && total_read_bytes < xfer_size)
@@ -143,366 +251,1771 @@ int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data)
 		if (read_bytes > 0)
 			total_read_bytes += read_bytes;
 		else
-			rc = read_bytes;
+			/* 0 once the remote closed or the socket was shut down */
+			rc = read_bytes ? read_bytes : -1;
 	}
 	return rc;
 }
 /******************************************************************************
 End of socket operations
 ******************************************************************************/
-/* poll_completion */
 /******************************************************************************
- * Function: poll_completion
+ * Function: now_nsec
  *
  * Input
- * res pointer to resources structure
+ * none
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, 1 on failure
+ * current value of the monotonic clock in nanoseconds
  *
  * Description
- * Poll the completion queue for a single event. This function will continue to
- * poll the queue until MAX_POLL_CQ_TIMEOUT milliseconds have passed.
- *
+ * Read the monotonic clock, which is served from the vDSO and is not subject
+ * to wall clock adjustments.
  ******************************************************************************/
-int poll_completion(struct resources *res)
+static uint64_t now_nsec(void)
 {
-	struct ibv_wc wc;
-	unsigned long start_time_msec;
-	unsigned long cur_time_msec;
-	struct timeval cur_time;
-	int poll_result;
-	int rc = 0;
-
-	gettimeofday(&cur_time, NULL);
-	start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-	do
-	{
-		poll_result = ibv_poll_cq(res->cq, 1, &wc);
-		gettimeofday(&cur_time, NULL);
-		cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-	} while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
+	struct timespec ts;
 
-	if (poll_result < 0)
-	{
-		fprintf(stderr, "poll CQ failed\n");
-		rc = 1;
-	}
-	else if (poll_result == 0)
-	{
-		fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
-		rc = 1;
-	}
-	else
-	{
-		fprintf(stdout, "completion was found in CQ with status 0x%x\n", wc.status);
-		if (wc.status != IBV_WC_SUCCESS)
-		{
-			fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status,
-					wc.vendor_err);
-			rc = 1;
-		}
-	}
-	return rc;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 /******************************************************************************
- * Function: post_send
+ * Function: now_usec
  *
  * Input
- * res pointer to resources structure
- * opcode IBV_WR_SEND, IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * none
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, error code on failure
+ * current value of the monotonic clock in microseconds
  *
  * Description
- * This function will create and post a send work request
+ * Microsecond variant of now_nsec.
  ******************************************************************************/
-int post_send(struct resources *res, int opcode)
+static uint64_t now_usec(void)
 {
-	struct ibv_send_wr sr;
-
-	struct ibv_sge sge;
-
-	struct ibv_send_wr *bad_wr = NULL;
-	int rc;
-	memset(&sge, 0, sizeof(sge));
-	sge.addr = (uintptr_t)res->buf;
-	sge.length = MSG_SIZE;
-	sge.lkey = res->mr->lkey;
-	memset(&sr, 0, sizeof(sr));
-	sr.next = NULL;
-	sr.wr_id = 0;
-	sr.sg_list = &sge;
-	sr.num_sge = 1;
-	sr.opcode = opcode;
-	sr.send_flags = IBV_SEND_SIGNALED;
-
-	if (opcode != IBV_WR_SEND)
-	{
-		sr.wr.rdma.remote_addr = res->remote_props.addr;
-		sr.wr.rdma.rkey = res->remote_props.rkey;
-	}
-
-	rc = ibv_post_send(res->qp, &sr, &bad_wr);
-	if (rc)
-		fprintf(stderr, "failed to post SR\n");
-	else
-	{
-		switch (opcode)
-		{
-		case IBV_WR_SEND:
-			fprintf(stdout, "Send Request was posted\n");
-			break;
-		case IBV_WR_RDMA_READ:
-			fprintf(stdout, "RDMA Read Request was posted\n");
-			break;
-		case IBV_WR_RDMA_WRITE:
-			fprintf(stdout, "RDMA Write Request was posted\n");
-			break;
-		default:
-			fprintf(stdout, "Unknown Request was posted\n");
-			break;
-		}
-	}
-	return rc;
+	return now_nsec() / 1000;
 }
 /******************************************************************************
- * Function: post_receive
+ * Function: stat_latency
  *
  * Input
  * res pointer to resources structure
+ * post_ns time the completed work request was posted
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, error code on failure
+ * none
  *
  * Description
- *
+ * Count the post to completion time in the log2 bucketed latency histogram.
  ******************************************************************************/
-int post_receive(struct resources *res)
+static void stat_latency(struct resources *res, uint64_t post_ns)
 {
-	struct ibv_recv_wr rr;
-	struct ibv_sge sge;
-	struct ibv_recv_wr *bad_wr;
-	int rc;
-
-	memset(&sge, 0, sizeof(sge));
-	sge.addr = (uintptr_t)res->buf;
-	sge.length = MSG_SIZE;
-	sge.lkey = res->mr->lkey;
+	uint64_t lat = now_nsec() - post_ns;
+	int bucket = lat ? 63 - __builtin_clzll(lat) : 0;
 
-	memset(&rr, 0, sizeof(rr));
-	rr.next = NULL;
-	rr.wr_id = 0;
-	rr.sg_list = &sge;
-	rr.num_sge = 1;
-
-	rc = ibv_post_recv(res->qp, &rr, &bad_wr);
-	if (rc)
-		fprintf(stderr, "failed to post RR\n");
-	else
-		fprintf(stdout, "Receive Request was posted\n");
-	return rc;
+	if (bucket >= LAT_BUCKETS)
+		bucket = LAT_BUCKETS - 1;
+	stat_add(res->stats.latency[bucket], 1);
 }
 /******************************************************************************
- * Function: resources_init
+ * Function: recv_slot
  *
  * Input
  * res pointer to resources structure
+ * wr_id wr_id of a completed receive
  *
  * Output
- * res is initialized
+ * none
  *
  * Returns
+ * the start of the slot the receive landed in
+ ******************************************************************************/
+static char *recv_slot(struct resources *res, uint64_t wr_id)
+{
+	if (wr_id & SRQ_WR_FLAG)
+		return ((struct srq_slot *)(uintptr_t)(wr_id & ~(RECV_WR_FLAG | SRQ_WR_FLAG)))->addr;
+	return res->msg_block->addr + (size_t)(wr_id & ~RECV_WR_FLAG) * res->cfg.msg_size;
+}
+/******************************************************************************
+ * Function: recv_repost
+ *
+ * Input
+ * res pointer to resources structure
+ * wr_id wr_id of a completed receive
+ *
+ * Output
  * none
  *
+ * Returns
+ * 0 on success, error code on failure
+ *
  * Description
- * res is initialized to default values
+ * Post the slot of a completed receive again, on the shared receive queue
+ * it came from or the connection's own receive ring.
  ******************************************************************************/
-void resources_init(struct resources *res)
+static int recv_repost(struct resources *res, uint64_t wr_id)
 {
-	memset(res, 0, sizeof *res);
-	res->sock = -1;
+	if (wr_id & SRQ_WR_FLAG)
+		return shared_rq_post(res->srq, (struct srq_slot *)(uintptr_t)(wr_id & ~(RECV_WR_FLAG | SRQ_WR_FLAG)));
+	return post_receive(res, wr_id & ~RECV_WR_FLAG);
 }
 /******************************************************************************
- * Function: resources_create
+ * Function: handle_recv_completion
  *
  * Input
- * res pointer to resources structure to be filled in
+ * res pointer to resources structure
+ * wc receive work completion
  *
  * Output
- * res filled in with resources
+ * none
  *
  * Returns
- * 0 on success, 1 on failure
+ * 0 on success, error code on failure
  *
  * Description
- *
- * This function creates and allocates all necessary system resources. These
- * are stored in res.
- *****************************************************************************/
-int resources_create(struct resources *res)
+ * Account for a receive completion. An RDMA write with immediate announces a
+ * frame in the local receive area and a zero-length send returns a credit
+ * for the remote receive area. A send with immediate returns message slots
+ * of the remote receive ring and, if flagged so, carries a message, which is
+ * queued for msg_recv and keeps its slot until msg_release. Any other
+ * consumed receive request is replenished right away.
+ ******************************************************************************/
+static int handle_recv_completion(struct resources *res, struct ibv_wc *wc)
 {
-	struct ibv_device **dev_list = NULL;
-	struct ibv_qp_init_attr qp_init_attr;
-	struct ibv_device *ib_dev = NULL;
-	size_t size;
-	int i;
-	int mr_flags = 0;
-	int cq_size = 0;
-	int num_devices;
-	int rc = 0;
+	struct msg_entry *entry;
+	uint32_t imm;
 
-	if (config.server_name)
-	{
-		res->sock = sock_connect(config.server_name, config.tcp_port);
-		if (res->sock < 0)
-		{
-			fprintf(stderr, "failed to establish TCP connection to server %s, port %d\n",
-					config.server_name, config.tcp_port);
-			rc = -1;
-			goto resources_create_exit;
-		}
-	}
+	stat_add(res->stats.ops[STAT_RECV], 1);
+	stat_add(res->stats.bytes[STAT_RECV], wc->byte_len);
+	if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+		res->arrived++;
+	else if (!(wc->wc_flags & IBV_WC_WITH_IMM))
+		res->credits++;
 	else
 	{
-		fprintf(stdout, "waiting on port %d for TCP connection\n", config.tcp_port);
-		res->sock = sock_connect(NULL, config.tcp_port);
-		if (res->sock < 0)
+		imm = ntohl(wc->imm_data);
+		res->msg_credits += imm & MSG_IMM_CREDITS;
+		if (imm & MSG_IMM_DATA)
 		{
-			fprintf(stderr, "failed to establish TCP connection with client on port %d\n",
-					config.tcp_port);
-			rc = -1;
-			goto resources_create_exit;
+			entry = &res->msg_queue[res->msg_tail++ % res->recv_depth];
+			entry->wr_id = wc->wr_id;
+			entry->len = wc->byte_len;
+			res->msg_ready++;
+			return 0;
 		}
 	}
-	fprintf(stdout, "TCP connection was established\n");
-	fprintf(stdout, "searching for IB devices in host\n");
-
-	dev_list = ibv_get_device_list(&num_devices);
-	if (!dev_list)
+	return recv_repost(res, wc->wr_id);
+}
+/******************************************************************************
+ * Function: process_wc
+ *
+ * Input
+ * res pointer to resources structure
+ * wc work completion found in the CQ
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Account for a single work completion. Receive completions are doorbells,
+ * send completions with a zero wr_id belong to the synchronous operation in
+ * progress and the others to asynchronous operations. Send completions are
+ * delivered in posting order, so an asynchronous completion also completes
+ * every asynchronous operation posted before it. A failed completion marks
+ * the connection as failed. Called with the lock of res->cq held.
+ ******************************************************************************/
+int process_wc(struct resources *res, struct ibv_wc *wc)
+{
+	log_debug("completion was found in CQ with status 0x%x\n", wc->status);
+	if (wc->status != IBV_WC_SUCCESS)
 	{
-		fprintf(stderr, "failed to get IB devices list\n");
-		rc = 1;
-		goto resources_create_exit;
+		log_error("got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc->status,
+				wc->vendor_err);
+		stat_add(res->stats.errors[wc->status < WC_STATUS_SLOTS ? wc->status : WC_STATUS_SLOTS - 1], 1);
+		if (wc->wr_id && !(wc->wr_id & RECV_WR_FLAG) && !res->async_error)
+			res->async_error = wc->wr_id;
+		/* other connections keep receiving from a shared queue */
+		if (wc->wr_id & SRQ_WR_FLAG)
+			recv_repost(res, wc->wr_id);
+		res->failed = 1;
+		return 1;
 	}
-
-	if (!num_devices)
+	if (wc->opcode & IBV_WC_RECV)
+		return handle_recv_completion(res, wc);
+	if (wc->wr_id)
 	{
-		fprintf(stderr, "found %d device(s)\n", num_devices);
-		rc = 1;
-		goto resources_create_exit;
+		stat_latency(res, res->async_post_ns[wc->wr_id % res->send_depth]);
+		res->async_done = wc->wr_id;
 	}
-	fprintf(stdout, "found %d device(s)\n", num_devices);
-
-	for (i = 0; i < num_devices; i++)
+	else
 	{
-		if (!config.dev_name)
-		{
-			config.dev_name = strdup(ibv_get_device_name(dev_list[i]));
-			fprintf(stdout, "device not specified, using first one found: %s\n", config.dev_name);
-		}
-
-		if (!strcmp(ibv_get_device_name(dev_list[i]), config.dev_name))
-		{
-			ib_dev = dev_list[i];
-			break;
-		}
+		stat_latency(res, res->sync_post_ns);
+		res->sync_done++;
 	}
-
-	if (!ib_dev)
+	return 0;
+}
+/******************************************************************************
+ * Function: event_ready
+ *
+ * Input
+ * res pointer to resources structure
+ * event counter to wait on, NULL to wait for an asynchronous operation
+ * wr_id asynchronous operation to wait for when event is NULL
+ *
+ * Output
+ * rc 0 if the event happened, 1 if it never will
+ *
+ * Returns
+ * 1 if the wait is over, 0 otherwise
+ *
+ * Description
+ * Check the condition poll_event waits for. Called with the lock of res->cq
+ * held.
+ ******************************************************************************/
+static int event_ready(struct resources *res, uint32_t *event, uint64_t wr_id, int *rc)
+{
+	*rc = 0;
+	if (event && *event)
 	{
-		fprintf(stderr, "IB device %s wasn't found\n", config.dev_name);
-		rc = 1;
-		goto resources_create_exit;
+		(*event)--;
+		return 1;
 	}
-
-	res->ib_ctx = ibv_open_device(ib_dev);
-	if (!res->ib_ctx)
+	if (!event)
 	{
-		fprintf(stderr, "failed to open device %s\n", config.dev_name);
-		rc = 1;
-		goto resources_create_exit;
+		if (res->async_error && res->async_error <= wr_id)
+		{
+			*rc = 1;
+			return 1;
+		}
+		if (res->async_done >= wr_id)
+			return 1;
 	}
+	*rc = res->failed;
+	return res->failed;
+}
+/******************************************************************************
+ * Function: poll_wait
+ *
+ * Input
+ * res pointer to resources structure
+ * event counter to wait on, NULL to wait for an asynchronous operation
+ * wr_id asynchronous operation to wait for when event is NULL
+ * timeout_msec how long to wait before giving up
+ *
+ * Output
+ * event is decremented once it became non-zero
+ *
+ * Returns
+ * 0 on success, 1 on failure, 2 if the wait timed out
+ *
+ * Description
+ * Wait until the awaited event happens. One waiter at a time drives the
+ * completion queue and dispatches completions to every attached connection,
+ * the others sleep until it broadcasts that completions were dispatched and
+ * take over once it leaves. The driving waiter reads the clock only every
+ * POLL_CLOCK_INTERVAL empty polls. When the queue has a completion channel,
+ * polling stops after res->spin_usec microseconds: the CQ is armed and the
+ * waiter sleeps on the channel until the next completion arrives. A timeout
+ * is left to the caller to report.
+ ******************************************************************************/
+static int poll_wait(struct resources *res, uint32_t *event, uint64_t wr_id, int timeout_msec)
+{
+	struct comp_queue *q = res->cq;
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	struct pollfd pfd;
+	struct timespec deadline;
+	uint64_t start_usec;
+	uint64_t cur_usec;
+	uint64_t deadline_usec;
+	unsigned int idle = 0;
+	int driving = 0;
+	int blocking = 0;
+	int armed = 0;
+	int timed_out = 0;
+	int failed = 0;
+	int poll_result;
+	int rc;
 
-	ibv_free_device_list(dev_list);
-	dev_list = NULL;
-	ib_dev = NULL;
+	start_usec = now_usec();
+	deadline_usec = start_usec + (uint64_t)timeout_msec * 1000;
+	deadline.tv_sec = deadline_usec / 1000000;
+	deadline.tv_nsec = (deadline_usec % 1000000) * 1000;
 
-	if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr))
+	pthread_mutex_lock(&q->lock);
+	for (;;)
 	{
-		fprintf(stderr, "ibv_query_port on port %u failed\n", config.ib_port);
-		rc = 1;
-		goto resources_create_exit;
-	}
+		if (event_ready(res, event, wr_id, &rc))
+			break;
 
-	res->pd = ibv_alloc_pd(res->ib_ctx);
-	if (!res->pd)
-	{
-		fprintf(stderr, "ibv_alloc_pd failed\n");
-		rc = 1;
-		goto resources_create_exit;
-	}
+		if (!driving && q->polling)
+		{
+			if (pthread_cond_timedwait(&q->cond, &q->lock, &deadline) == ETIMEDOUT)
+			{
+				rc = 2;
+				break;
+			}
+			continue;
+		}
+		driving = 1;
+		q->polling = 1;
 
-	cq_size = 1;
-	res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
-	if (!res->cq)
-	{
-		fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
-		rc = 1;
-		goto resources_create_exit;
+		poll_result = comp_queue_drain(q);
+		if (poll_result < 0)
+		{
+			rc = 1;
+			break;
+		}
+		if (poll_result > 0)
+		{
+			pthread_cond_broadcast(&q->cond);
+			continue;
+		}
+
+		pthread_mutex_unlock(&q->lock);
+		if (!blocking)
+		{
+			if (!(++idle % POLL_CLOCK_INTERVAL))
+			{
+				cur_usec = now_usec();
+				if (cur_usec >= deadline_usec)
+					timed_out = 1;
+				else if (q->channel && cur_usec - start_usec >= (uint64_t)res->spin_usec)
+					blocking = 1;
+			}
+		}
+		else if (!armed)
+		{
+			/* the queue is polled again before sleeping, a completion may
+			   have arrived before the CQ was armed */
+			if (ibv_req_notify_cq(q->cq, 0))
+			{
+				log_error("failed to request CQ notification\n");
+				failed = 1;
+			}
+			armed = 1;
+		}
+		else
+		{
+			cur_usec = now_usec();
+			if (cur_usec >= deadline_usec)
+				timed_out = 1;
+			else
+			{
+				pfd.fd = q->channel->fd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				poll_result = poll(&pfd, 1, (deadline_usec - cur_usec + 999) / 1000);
+				if (poll_result < 0 && errno != EINTR)
+				{
+					log_error("failed to wait for CQ event\n");
+					failed = 1;
+				}
+				else if (poll_result > 0)
+				{
+					if (ibv_get_cq_event(q->channel, &ev_cq, &ev_ctx))
+					{
+						log_error("failed to get CQ event\n");
+						failed = 1;
+					}
+					else
+						ibv_ack_cq_events(ev_cq, 1);
+					armed = 0;
+				}
+			}
+		}
+		pthread_mutex_lock(&q->lock);
+
+		if (timed_out || failed)
+		{
+			rc = failed ? 1 : 2;
+			break;
+		}
+	}
+	if (driving)
+	{
+		q->polling = 0;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return rc;
+}
+/******************************************************************************
+ * Function: poll_event
+ *
+ * Input
+ * res pointer to resources structure
+ * event counter to wait on, NULL to wait for an asynchronous operation
+ * wr_id asynchronous operation to wait for when event is NULL
+ * timeout_msec how long to wait before giving up
+ *
+ * Output
+ * event is decremented once it became non-zero
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Wait until the awaited event happens, see poll_wait. A timeout is logged
+ * and counted.
+ ******************************************************************************/
+static int poll_event(struct resources *res, uint32_t *event, uint64_t wr_id, int timeout_msec)
+{
+	int rc = poll_wait(res, event, wr_id, timeout_msec);
+
+	if (rc == 2)
+	{
+		log_error("completion wasn't found in the CQ after timeout\n");
+		stat_add(res->stats.timeouts, 1);
+		rc = 1;
+	}
+	return rc;
+}
+/******************************************************************************
+ * Function: poll_completion
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Poll the completion queue for the completion of the synchronous send
+ * request in progress. Doorbells and asynchronous completions found in the
+ * meantime are accounted for. This function will give up after
+ * res->timeout_msec milliseconds.
+ *
+ ******************************************************************************/
+int poll_completion(struct resources *res)
+{
+	return poll_event(res, &res->sync_done, 0, res->timeout_msec);
+}
+/******************************************************************************
+ * Function: poll_async
+ *
+ * Input
+ * res pointer to resources structure
+ * wr_id asynchronous operation to wait for
+ * timeout_msec how long to wait, res->timeout_msec if not positive
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Wait for the asynchronous operation wr_id to complete.
+ ******************************************************************************/
+int poll_async(struct resources *res, uint64_t wr_id, int timeout_msec)
+{
+	return poll_event(res, NULL, wr_id, timeout_msec > 0 ? timeout_msec : res->timeout_msec);
+}
+/******************************************************************************
+ * Function: test_async
+ *
+ * Input
+ * res pointer to resources structure
+ * wr_id asynchronous operation to check
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 1 if the operation completed, 0 if it is still in flight, -1 on failure
+ *
+ * Description
+ * Drain the completions currently in the CQ without waiting and report the
+ * state of the asynchronous operation wr_id. When another thread is driving
+ * the CQ, only the state already dispatched is reported.
+ ******************************************************************************/
+int test_async(struct resources *res, uint64_t wr_id)
+{
+	struct comp_queue *q = res->cq;
+	int poll_result = 1;
+	int rc;
+
+	pthread_mutex_lock(&q->lock);
+	while (!event_ready(res, NULL, wr_id, &rc) && poll_result > 0 && !q->polling)
+	{
+		poll_result = comp_queue_drain(q);
+		if (poll_result > 0)
+			pthread_cond_broadcast(&q->cond);
+	}
+	if (event_ready(res, NULL, wr_id, &rc))
+		rc = rc ? -1 : 1;
+	else
+		rc = poll_result < 0 ? -1 : 0;
+	pthread_mutex_unlock(&q->lock);
+	return rc;
+}
+/******************************************************************************
+ * Function: sr_length
+ *
+ * Input
+ * sr send work request
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * number of bytes the scatter/gather list of sr holds
+ *
+ * Description
+ * Sum up the payload of a send work request.
+ ******************************************************************************/
+static size_t sr_length(const struct ibv_send_wr *sr)
+{
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < sr->num_sge; i++)
+		length += sr->sg_list[i].length;
+	return length;
+}
+/******************************************************************************
+ * Function: sr_prepare
+ *
+ * Input
+ * res pointer to resources structure
+ * sr send work request, with wr_id 0 for synchronous operations
+ *
+ * Output
+ * sr->send_flags gains IBV_SEND_INLINE if the payload is sent inline
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Prepare a send work request about to be posted and note its post time.
+ * Sends and writes of at most res->max_inline bytes are posted inline: the
+ * payload is copied into the work request, so the NIC does not have to fetch
+ * it and the memory may be reused, or even be unregistered, once it was
+ * posted.
+ ******************************************************************************/
+static void sr_prepare(struct resources *res, struct ibv_send_wr *sr)
+{
+	size_t length = sr_length(sr);
+
+	if (length && length <= res->max_inline && sr->opcode != IBV_WR_RDMA_READ &&
+		sr->opcode != IBV_WR_ATOMIC_CMP_AND_SWP && sr->opcode != IBV_WR_ATOMIC_FETCH_AND_ADD)
+		sr->send_flags |= IBV_SEND_INLINE;
+
+	if (sr->wr_id)
+		res->async_post_ns[sr->wr_id % res->send_depth] = now_nsec();
+	else
+		res->sync_post_ns = now_nsec();
+}
+/******************************************************************************
+ * Function: sr_account
+ *
+ * Input
+ * res pointer to resources structure
+ * sr send work request that was posted
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Count a posted send work request in the connection's statistics.
+ ******************************************************************************/
+static void sr_account(struct resources *res, const struct ibv_send_wr *sr)
+{
+	int op;
+
+	switch (sr->opcode)
+	{
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		op = STAT_WRITE;
+		break;
+	case IBV_WR_RDMA_READ:
+		op = STAT_READ;
+		break;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		op = STAT_ATOMIC;
+		break;
+	default:
+		op = STAT_SEND;
+		break;
+	}
+	stat_add(res->stats.ops[op], 1);
+	stat_add(res->stats.bytes[op], sr_length(sr));
+}
+/******************************************************************************
+ * Function: post_sr
+ *
+ * Input
+ * res pointer to resources structure
+ * sr send work request, with wr_id 0 for synchronous operations
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * Post a signaled send work request, see sr_prepare, and count it once it
+ * was posted.
+ ******************************************************************************/
+static int post_sr(struct resources *res, struct ibv_send_wr *sr)
+{
+	struct ibv_send_wr *bad_wr = NULL;
+	int rc;
+
+	sr->send_flags = IBV_SEND_SIGNALED;
+	sr_prepare(res, sr);
+	rc = ibv_post_send(res->qp, sr, &bad_wr);
+	if (rc)
+		log_error("failed to post SR\n");
+	else
+	{
+		sr_account(res, sr);
+		switch (sr->opcode)
+		{
+		case IBV_WR_SEND:
+			log_debug("Send Request was posted\n");
+			break;
+		case IBV_WR_SEND_WITH_IMM:
+			log_debug("Send with immediate Request was posted\n");
+			break;
+		case IBV_WR_RDMA_READ:
+			log_debug("RDMA Read Request was posted\n");
+			break;
+		case IBV_WR_RDMA_WRITE:
+			log_debug("RDMA Write Request was posted\n");
+			break;
+		case IBV_WR_RDMA_WRITE_WITH_IMM:
+			log_debug("RDMA Write with immediate Request was posted\n");
+			break;
+		case IBV_WR_ATOMIC_CMP_AND_SWP:
+			log_debug("Compare and swap Request was posted\n");
+			break;
+		case IBV_WR_ATOMIC_FETCH_AND_ADD:
+			log_debug("Fetch and add Request was posted\n");
+			break;
+		default:
+			log_debug("Unknown Request was posted\n");
+			break;
+		}
+	}
+	return rc;
+}
+/******************************************************************************
+ * Function: post_send_sge
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode any ibv_wr_opcode supported on an RC QP except the atomic ones
+ * sg_list local memory of the transfer, in res->buf or any other registered
+ * memory on the PD
+ * num_sge number of entries in sg_list, 0 for a bare doorbell
+ * remote_addr remote address of the transfer, ignored by sends
+ * rkey rkey of the remote memory, ignored by sends
+ * imm immediate data in network order, used by the *_WITH_IMM opcodes
+ * wr_id identifier of the asynchronous operation, 0 for synchronous ones
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * This function will create and post a send work request, see post_sr.
+ ******************************************************************************/
+static int post_send_sge(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+						 uint64_t remote_addr, uint32_t rkey, uint32_t imm, uint64_t wr_id)
+{
+	struct ibv_send_wr sr;
+
+	memset(&sr, 0, sizeof(sr));
+	sr.next = NULL;
+	sr.wr_id = wr_id;
+	sr.sg_list = num_sge ? sg_list : NULL;
+	sr.num_sge = num_sge;
+	sr.opcode = opcode;
+	sr.imm_data = imm;
+	if (opcode != IBV_WR_SEND && opcode != IBV_WR_SEND_WITH_IMM)
+	{
+		sr.wr.rdma.remote_addr = remote_addr;
+		sr.wr.rdma.rkey = rkey;
+	}
+	return post_sr(res, &sr);
+}
+/******************************************************************************
+ * Function: post_send_wr
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode any ibv_wr_opcode supported on an RC QP
+ * local_offset offset of the transfer in the local buffer
+ * remote_offset offset of the transfer in the remote buffer
+ * length number of bytes to transfer, 0 for a bare doorbell
+ * imm immediate data in network order, used by the *_WITH_IMM opcodes
+ * wr_id identifier of the asynchronous operation, 0 for synchronous ones
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * Post a send work request on a range of the connection's buffer
+ ******************************************************************************/
+static int post_send_wr(struct resources *res, int opcode, size_t local_offset, size_t remote_offset,
+						size_t length, uint32_t imm, uint64_t wr_id)
+{
+	struct ibv_sge sge;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)res->buf + local_offset;
+	sge.length = length;
+	sge.lkey = res->mr->lkey;
+	return post_send_sge(res, opcode, &sge, length ? 1 : 0, res->remote_props.addr + remote_offset,
+						 res->remote_props.rkey, imm, wr_id);
+}
+/******************************************************************************
+ * Function: post_send
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode IBV_WR_SEND, IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * offset offset of the transfer in both the local and the remote buffer
+ * length number of bytes to transfer
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * This function will create and post a send work request covering length
+ * bytes starting at offset, so only the bytes actually in use go on the wire
+ ******************************************************************************/
+int post_send(struct resources *res, int opcode, size_t offset, size_t length)
+{
+	return post_send_wr(res, opcode, offset, offset, length, 0, 0);
+}
+/******************************************************************************
+ * Function: post_async
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * offset offset of the transfer in both the local and the remote buffer
+ * length number of bytes to transfer
+ *
+ * Output
+ * wr_id identifier of the posted operation, to be passed to poll_async
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Post a send work request without waiting for its completion. When the send
+ * queue is full, the oldest asynchronous operation is waited for first. One
+ * send queue entry is always kept free for synchronous operations.
+ ******************************************************************************/
+int post_async(struct resources *res, int opcode, size_t offset, size_t length, uint64_t *wr_id)
+{
+	struct ibv_sge sge;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)res->buf + offset;
+	sge.length = length;
+	sge.lkey = res->mr->lkey;
+	return post_async_sge(res, opcode, &sge, length ? 1 : 0, offset, wr_id);
+}
+/******************************************************************************
+ * Function: post_async_sge
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * sg_list local memory of the transfer, registered on the connection's PD
+ * num_sge number of entries in sg_list
+ * remote_offset offset of the transfer in the remote buffer
+ *
+ * Output
+ * wr_id identifier of the posted operation, to be passed to poll_async
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Like post_async, but the local side of the transfer is given as a
+ * scatter/gather list, e.g. blocks borrowed from the memory pool. Each entry
+ * becomes an SGE of the work request. Lists longer than the QP takes in one
+ * work request are split into several work requests on consecutive ranges
+ * of the remote buffer; wr_id is then the last of them, whose completion
+ * implies the completion of the others.
+ ******************************************************************************/
+int post_async_sge(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+				   size_t remote_offset, uint64_t *wr_id)
+{
+	return post_async_region(res, opcode, sg_list, num_sge, NULL, remote_offset, wr_id);
+}
+/******************************************************************************
+ * Function: post_async_region
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * sg_list local memory of the transfer, registered on the connection's PD
+ * num_sge number of entries in sg_list
+ * region region advertised by the remote side, NULL for its connection buffer
+ * remote_offset offset of the transfer in the region
+ *
+ * Output
+ * wr_id identifier of the posted operation, to be passed to poll_async
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Like post_async_sge, on any memory region the remote side advertised with
+ * region_sync. The range is not checked against the region: an access out of
+ * its bounds or beyond its access flags fails on the remote NIC and moves
+ * the QP to the error state.
+ ******************************************************************************/
+int post_async_region(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+					  const struct region_desc *region, size_t remote_offset, uint64_t *wr_id)
+{
+	int max_sge = opcode == IBV_WR_RDMA_READ ? res->max_read_sge : res->max_send_sge;
+	uint64_t remote_addr = (region ? region->addr : res->remote_props.addr) + remote_offset;
+	uint32_t rkey = region ? region->rkey : res->remote_props.rkey;
+	int n;
+	int i;
+
+	do
+	{
+		n = num_sge < max_sge ? num_sge : max_sge;
+		if (post_async_imm(res, opcode, sg_list, n, remote_addr, rkey, 0, wr_id))
+			return 1;
+		for (i = 0; i < n; i++)
+			remote_addr += sg_list[i].length;
+		sg_list += n;
+		num_sge -= n;
+	} while (num_sge > 0);
+	return 0;
+}
+/******************************************************************************
+ * Function: async_reserve
+ *
+ * Input
+ * res pointer to resources structure
+ * n number of operations to make room for, at most res->send_depth - 1
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Make room for n more asynchronous operations: when the send queue is too
+ * full, wait for the oldest ones first. One send queue entry is always kept
+ * free for synchronous operations.
+ ******************************************************************************/
+static int async_reserve(struct resources *res, int n)
+{
+	uint64_t oldest = 0;
+
+	pthread_mutex_lock(&res->cq->lock);
+	if (res->async_posted + n - res->async_done > (uint64_t)res->send_depth - 1)
+		oldest = res->async_posted + n - (res->send_depth - 1);
+	pthread_mutex_unlock(&res->cq->lock);
+	if (oldest && poll_async(res, oldest, 0))
+		return 1;
+	return 0;
+}
+/******************************************************************************
+ * Function: post_async_imm
+ *
+ * Input
+ * res pointer to resources structure
+ * opcode any ibv_wr_opcode supported on an RC QP
+ * sg_list local memory of the transfer, registered on the connection's PD
+ * num_sge number of entries in sg_list
+ * remote_addr remote address of the transfer, ignored by sends
+ * rkey rkey of the remote memory, ignored by sends
+ * imm immediate data in network order, used by the *_WITH_IMM opcodes
+ *
+ * Output
+ * wr_id identifier of the posted operation, to be passed to poll_async
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Like post_async_sge, for operations carrying immediate data.
+ ******************************************************************************/
+static int post_async_imm(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+						  uint64_t remote_addr, uint32_t rkey, uint32_t imm, uint64_t *wr_id)
+{
+	if (async_reserve(res, 1))
+		return 1;
+
+	*wr_id = ++res->async_posted;
+	if (post_send_sge(res, opcode, sg_list, num_sge, remote_addr, rkey, imm, *wr_id))
+	{
+		res->async_posted--;
+		return 1;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: post_batch
+ *
+ * Input
+ * res pointer to resources structure
+ * ops operations to post, in order
+ * n number of entries in ops
+ * signal_every request a completion for every signal_every-th operation, 0
+ * for only the last one
+ *
+ * Output
+ * wr_id identifier of the last operation, to be passed to poll_async. On
+ * failure, the operation to wait for before the memory of the batch is
+ * reused, 0 if no operation of the batch was posted
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Post a batch of RDMA writes, reads and atomics as chains of linked work
+ * requests, each chain with a single ibv_post_send and thus a single
+ * doorbell. Chains hold up to MAX_BATCH operations and no more than the send
+ * queue takes besides the entry kept for synchronous operations. Only every
+ * signal_every-th operation and the last one of each chain generate a
+ * completion. Send completions arrive in posting order, so a completion
+ * implies the completion of every unsignaled operation before it, whose
+ * send queue entries it frees as well. When a chain is only posted in part,
+ * the part that went out is completed with an empty signaled write if it
+ * ends unsignaled.
+ ******************************************************************************/
+int post_batch(struct resources *res, struct batch_op *ops, int n, int signal_every, uint64_t *wr_id)
+{
+	struct ibv_send_wr wrs[MAX_BATCH];
+	struct ibv_send_wr *bad_wr;
+	struct batch_op *op;
+	int chunk = res->send_depth - 1 < MAX_BATCH ? res->send_depth - 1 : MAX_BATCH;
+	uint64_t first = res->async_posted;
+	int posted;
+	int rc = 1;
+	int i;
+	int j;
+	int k;
+
+	*wr_id = 0;
+	for (i = 0; i < n; i++)
+	{
+		op = &ops[i];
+		switch (op->opcode)
+		{
+		case IBV_WR_RDMA_WRITE:
+		case IBV_WR_RDMA_READ:
+			break;
+		case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		case IBV_WR_ATOMIC_CMP_AND_SWP:
+			if (res->device_attr.atomic_cap == IBV_ATOMIC_NONE)
+			{
+				log_error("device does not support atomic operations\n");
+				return 1;
+			}
+			if (op->rkey == res->remote_props.rkey && !(res->remote_props.flags & CM_FLAG_ATOMIC))
+			{
+				log_error("remote memory does not accept atomic operations\n");
+				return 1;
+			}
+			if (op->remote_addr % sizeof(uint64_t) || op->sge.length != sizeof(uint64_t))
+			{
+				log_error("atomic operations work on aligned 8-byte words\n");
+				return 1;
+			}
+			break;
+		default:
+			log_error("operation %d of a batch has unsupported opcode %d\n", i, op->opcode);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < n; i += k)
+	{
+		k = n - i < chunk ? n - i : chunk;
+		if (async_reserve(res, k))
+			goto post_batch_exit;
+		memset(wrs, 0, k * sizeof(*wrs));
+		for (j = 0; j < k; j++)
+		{
+			op = &ops[i + j];
+			wrs[j].next = j + 1 < k ? &wrs[j + 1] : NULL;
+			wrs[j].wr_id = res->async_posted + j + 1;
+			wrs[j].sg_list = &op->sge;
+			wrs[j].num_sge = op->sge.length ? 1 : 0;
+			wrs[j].opcode = op->opcode;
+			if (j == k - 1 || (signal_every > 0 && (i + j + 1) % signal_every == 0))
+				wrs[j].send_flags = IBV_SEND_SIGNALED;
+			if (op->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD || op->opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
+			{
+				wrs[j].wr.atomic.remote_addr = op->remote_addr;
+				wrs[j].wr.atomic.rkey = op->rkey;
+				wrs[j].wr.atomic.compare_add = op->compare_add;
+				wrs[j].wr.atomic.swap = op->swap;
+			}
+			else
+			{
+				wrs[j].wr.rdma.remote_addr = op->remote_addr;
+				wrs[j].wr.rdma.rkey = op->rkey;
+			}
+			sr_prepare(res, &wrs[j]);
+		}
+
+		bad_wr = NULL;
+		posted = ibv_post_send(res->qp, wrs, &bad_wr) ? (bad_wr ? bad_wr - wrs : 0) : k;
+		/* only what went out is counted */
+		for (j = 0; j < posted; j++)
+			sr_account(res, &wrs[j]);
+		if (posted < k)
+		{
+			log_error("failed to post SR %d of a chain of %d\n", posted + 1, k);
+			res->async_posted += posted;
+			/* the part of the chain that went out may end unsignaled, an
+			   empty signaled write completes it */
+			if (posted && !(wrs[posted - 1].send_flags & IBV_SEND_SIGNALED))
+			{
+				res->async_posted++;
+				if (post_send_sge(res, IBV_WR_RDMA_WRITE, NULL, 0, res->remote_props.addr,
+								  res->remote_props.rkey, 0, res->async_posted))
+					res->failed = 1;
+			}
+			goto post_batch_exit;
+		}
+		res->async_posted += k;
+		log_debug("chain of %d work requests was posted\n", k);
+	}
+	rc = 0;
+
+post_batch_exit:
+	if (res->async_posted != first)
+		*wr_id = res->async_posted;
+	return rc;
+}
+/******************************************************************************
+ * Function: frame_stage
+ *
+ * Input
+ * res pointer to resources structure
+ * len payload length, the payload must already be at res->buf + MSG_HDR_SIZE
+ *
+ * Output
+ * res->buf starts with a message header describing the payload
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Write the message header in front of a payload staged in the local buffer
+ * and advance the send sequence number. The frame occupies exactly
+ * MSG_HDR_SIZE + len bytes of the buffer.
+ ******************************************************************************/
+void frame_stage(struct resources *res, uint32_t len)
+{
+	struct msg_hdr *hdr = (struct msg_hdr *)res->buf;
+
+	hdr->len = htonl(len);
+	hdr->seq = htonl(++res->send_seq);
+}
+/******************************************************************************
+ * Function: frame_read
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * len payload length of the frame read from the remote buffer
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Fetch the frame staged in the remote buffer into the local buffer. The
+ * header is read first so that only MSG_HDR_SIZE + len bytes are transferred.
+ * A frame carrying the sequence number of the previously read frame is stale
+ * and is reported as a failure.
+ ******************************************************************************/
+int frame_read(struct resources *res, uint32_t *len)
+{
+	struct msg_hdr *hdr = (struct msg_hdr *)res->buf;
+	uint32_t seq;
+
+	if (post_send(res, IBV_WR_RDMA_READ, 0, MSG_HDR_SIZE))
+		return 1;
+	if (poll_completion(res))
+		return 1;
+
+	*len = ntohl(hdr->len);
+	seq = ntohl(hdr->seq);
+	if (*len > MSG_MAX_PAYLOAD(res))
+	{
+		log_error("frame length %u exceeds buffer capacity %zu\n", *len, MSG_MAX_PAYLOAD(res));
+		return 1;
+	}
+	if (seq == res->recv_seq)
+	{
+		log_error("stale frame with sequence number %u\n", seq);
+		return 1;
+	}
+
+	if (*len)
+	{
+		if (post_send(res, IBV_WR_RDMA_READ, MSG_HDR_SIZE, *len))
+			return 1;
+		if (poll_completion(res))
+			return 1;
+	}
+	res->recv_seq = seq;
+	return 0;
+}
+/******************************************************************************
+ * Function: frame_push
+ *
+ * Input
+ * res pointer to resources structure
+ * len payload length, the payload must already be at res->buf + MSG_HDR_SIZE
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Notification mode counterpart of staging a frame and writing it. Waits for
+ * the remote receive area to be free, then writes the frame into it with an
+ * RDMA write with immediate so the remote side learns about the arrival from
+ * its completion queue instead of the TCP socket.
+ ******************************************************************************/
+int frame_push(struct resources *res, uint32_t len)
+{
+	struct msg_hdr *hdr = (struct msg_hdr *)res->buf;
+
+	if (poll_event(res, &res->credits, 0, res->timeout_msec))
+	{
+		log_error("remote receive area did not become free\n");
+		return 1;
+	}
+	frame_stage(res, len);
+	if (post_send_wr(res, IBV_WR_RDMA_WRITE_WITH_IMM, 0, NOTIFY_RX_OFFSET(res), MSG_HDR_SIZE + len, hdr->seq, 0))
+		return 1;
+	return poll_completion(res);
+}
+/******************************************************************************
+ * Function: frame_pop
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * len payload length of the frame, the payload is at
+ * res->buf + NOTIFY_RX_OFFSET(res) + MSG_HDR_SIZE
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Notification mode counterpart of frame_read. Waits for the remote side to
+ * announce a frame in the local receive area. The area stays owned by the
+ * caller until frame_release hands it back to the remote side.
+ ******************************************************************************/
+int frame_pop(struct resources *res, uint32_t *len)
+{
+	struct msg_hdr *hdr = (struct msg_hdr *)(res->buf + NOTIFY_RX_OFFSET(res));
+	uint32_t seq;
+
+	if (poll_event(res, &res->arrived, 0, res->timeout_msec))
+		return 1;
+
+	*len = ntohl(hdr->len);
+	seq = ntohl(hdr->seq);
+	if (*len > NOTIFY_MAX_PAYLOAD(res))
+	{
+		log_error("frame length %u exceeds buffer capacity %zu\n", *len, NOTIFY_MAX_PAYLOAD(res));
+		return 1;
+	}
+	if (seq != res->recv_seq + 1)
+	{
+		log_error("out of sequence frame %u, expected %u\n", seq, res->recv_seq + 1);
+		return 1;
+	}
+	res->recv_seq = seq;
+	return 0;
+}
+/******************************************************************************
+ * Function: frame_release
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Hand the local receive area back to the remote side by sending it a credit
+ * as a zero-length send.
+ ******************************************************************************/
+int frame_release(struct resources *res)
+{
+	if (post_send_wr(res, IBV_WR_SEND, 0, 0, 0, 0, 0))
+		return 1;
+	return poll_completion(res);
+}
+/******************************************************************************
+ * Function: post_receive
+ *
+ * Input
+ * res pointer to resources structure
+ * slot slot of the receive ring to receive into
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * Post a receive request for one slot of the receive ring. Whether the slot
+ * catches a message or a doorbell is only known once it completes.
+ ******************************************************************************/
+int post_receive(struct resources *res, uint32_t slot)
+{
+	struct ibv_recv_wr rr;
+	struct ibv_recv_wr *bad_wr;
+	struct ibv_sge sge;
+	int rc;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)res->msg_block->addr + (size_t)slot * res->cfg.msg_size;
+	sge.length = res->cfg.msg_size;
+	sge.lkey = res->msg_block->mr->lkey;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.next = NULL;
+	rr.wr_id = RECV_WR_FLAG | slot;
+	rr.sg_list = &sge;
+	rr.num_sge = 1;
+
+	rc = ibv_post_recv(res->qp, &rr, &bad_wr);
+	if (rc)
+		log_error("failed to post RR\n");
+	return rc;
+}
+/******************************************************************************
+ * Function: msg_send
+ *
+ * Input
+ * res pointer to resources structure
+ * data message to send, any memory
+ * len message length, at most res->cfg.msg_size
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Send a message into the next free slot of the remote receive ring. Waits
+ * for the remote side to return a slot when the ring is full. Messages of at
+ * most res->max_inline bytes are sent inline straight from data, longer ones
+ * are copied to the send slot first. Slots the local side reposted since it
+ * last told the remote side are returned along with the message.
+ ******************************************************************************/
+int msg_send(struct resources *res, const void *data, uint32_t len)
+{
+	uint64_t wr_id;
+
+	if (msg_post(res, data, len, &wr_id))
+		return 1;
+	return poll_async(res, wr_id, 0);
+}
+/******************************************************************************
+ * Function: msg_post
+ *
+ * Input
+ * res pointer to resources structure
+ * data message to send, any memory
+ * len message length, at most res->cfg.msg_size
+ *
+ * Output
+ * wr_id identifier of the posted send, to be passed to poll_async
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Asynchronous counterpart of msg_send for short control messages. The send
+ * is ordered after the operations posted before it, so a message can announce
+ * data just written with an asynchronous RDMA write. Messages that cannot be
+ * sent inline go through the single send slot and are waited for.
+ ******************************************************************************/
+int msg_post(struct resources *res, const void *data, uint32_t len, uint64_t *wr_id)
+{
+	struct ibv_sge sge;
+	uint32_t imm;
+
+	if (len > res->cfg.msg_size)
+	{
+		log_error("message length %u exceeds slot size %u\n", len, res->cfg.msg_size);
+		return 1;
+	}
+	if (poll_event(res, &res->msg_credits, 0, res->timeout_msec))
+	{
+		log_error("remote receive ring did not free a slot\n");
+		return 1;
+	}
+
+	memset(&sge, 0, sizeof(sge));
+	if (len <= res->max_inline)
+		sge.addr = (uintptr_t)data;
+	else
+	{
+		memcpy(res->send_slot, data, len);
+		sge.addr = (uintptr_t)res->send_slot;
+	}
+	sge.length = len;
+	sge.lkey = res->msg_block->mr->lkey;
+
+	pthread_mutex_lock(&res->cq->lock);
+	imm = MSG_IMM_DATA | res->msg_owed;
+	res->msg_owed = 0;
+	pthread_mutex_unlock(&res->cq->lock);
+
+	if (post_async_imm(res, IBV_WR_SEND_WITH_IMM, &sge, len ? 1 : 0, 0, 0, htonl(imm), wr_id))
+		return 1;
+	if (len > res->max_inline)
+		return poll_async(res, *wr_id, 0);
+	return 0;
+}
+/******************************************************************************
+ * Function: msg_take
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * data start of the message in its receive slot
+ * len message length
+ * slot receive slot holding the message, to be passed to msg_release
+ *
+ * Returns
+ * 0
+ *
+ * Description
+ * Dequeue a message that arrived, after msg_ready was consumed for it.
+ ******************************************************************************/
+static int msg_take(struct resources *res, char **data, uint32_t *len, uint64_t *slot)
+{
+	struct msg_entry entry;
+
+	pthread_mutex_lock(&res->cq->lock);
+	entry = res->msg_queue[res->msg_head++ % res->recv_depth];
+	pthread_mutex_unlock(&res->cq->lock);
+
+	*slot = entry.wr_id;
+	*len = entry.len;
+	*data = recv_slot(res, entry.wr_id);
+	return 0;
+}
+/******************************************************************************
+ * Function: msg_recv
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * data start of the message in its receive slot
+ * len message length
+ * slot receive slot holding the message, to be passed to msg_release
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Wait for the next message from the remote side. The message stays in its
+ * receive slot until msg_release hands the slot back.
+ ******************************************************************************/
+int msg_recv(struct resources *res, char **data, uint32_t *len, uint64_t *slot)
+{
+	if (poll_event(res, &res->msg_ready, 0, res->timeout_msec))
+		return 1;
+	return msg_take(res, data, len, slot);
+}
+/******************************************************************************
+ * Function: msg_wait
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * data start of the message in its receive slot
+ * len message length
+ * slot receive slot holding the message, to be passed to msg_release
+ *
+ * Returns
+ * 0 on success, 1 on failure, 2 if no message arrived in time
+ *
+ * Description
+ * Like msg_recv, for receivers that wait on an idle connection in a loop: a
+ * wait that ends without a message is neither logged nor counted as a
+ * timeout.
+ ******************************************************************************/
+int msg_wait(struct resources *res, char **data, uint32_t *len, uint64_t *slot)
+{
+	int rc = poll_wait(res, &res->msg_ready, 0, res->timeout_msec);
+
+	if (rc)
+		return rc;
+	return msg_take(res, data, len, slot);
+}
+/******************************************************************************
+ * Function: msg_release
+ *
+ * Input
+ * res pointer to resources structure
+ * slot receive slot returned by msg_recv
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Repost the slot of a consumed message. Reposted slots are returned to the
+ * remote side with the next message sent, or on their own as a zero-length
+ * send with immediate once half the ring waits to be returned. With a shared
+ * receive queue the slot goes back to the queue, and the returned credits
+ * only bound how many messages the remote side has in flight.
+ ******************************************************************************/
+int msg_release(struct resources *res, uint64_t slot)
+{
+	uint32_t returned = 0;
+
+	if (recv_repost(res, slot))
+		return 1;
+
+	pthread_mutex_lock(&res->cq->lock);
+	if (++res->msg_owed >= (uint32_t)(res->cfg.msg_depth + 1) / 2)
+	{
+		returned = res->msg_owed;
+		res->msg_owed = 0;
+	}
+	pthread_mutex_unlock(&res->cq->lock);
+	if (!returned)
+		return 0;
+
+	if (post_send_sge(res, IBV_WR_SEND_WITH_IMM, NULL, 0, 0, 0, htonl(returned), 0))
+		return 1;
+	return poll_completion(res);
+}
+/******************************************************************************
+ * Function: resources_init
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * res is initialized
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * res is initialized to default values
+ ******************************************************************************/
+void resources_init(struct resources *res)
+{
+	memset(res, 0, sizeof *res);
+	res->cfg = config;
+	res->sock = -1;
+}
+/******************************************************************************
+ * Function: resources_create
+ *
+ * Input
+ * res pointer to resources structure to be filled in
+ *
+ * Output
+ * res filled in with resources
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ *
+ * This function creates and allocates all necessary system resources. These
+ * are stored in res. A QP taken from a warm pool already has them, and only
+ * the TCP connection is established.
+ *****************************************************************************/
+int resources_create(struct resources *res)
+{
+	int rc = 0;
+
+	if (res->cm_id)
+		log_info("using connection resolved by the RDMA CM\n");
+	else if (res->sock >= 0)
+		log_info("using TCP connection accepted by listener\n");
+	else if (res->cfg.server_name)
+	{
+		res->sock = sock_connect(res->cfg.server_name, res->cfg.tcp_port);
+		if (res->sock < 0)
+		{
+			log_error("failed to establish TCP connection to server %s, port %d\n",
+					res->cfg.server_name, res->cfg.tcp_port);
+			rc = -1;
+			goto resources_create_exit;
+		}
+	}
+	else
+	{
+		log_info("waiting on port %d for TCP connection\n", res->cfg.tcp_port);
+		res->sock = sock_connect(NULL, res->cfg.tcp_port);
+		if (res->sock < 0)
+		{
+			log_error("failed to establish TCP connection with client on port %d\n",
+					res->cfg.tcp_port);
+			rc = -1;
+			goto resources_create_exit;
+		}
+		log_info("TCP connection was established\n");
+	}
+
+	if (res->qp)
+		log_info("using warm QP 0x%x\n", res->qp->qp_num);
+	else
+		rc = resources_build(res);
+resources_create_exit:
+	if (rc && res->sock >= 0)
+	{
+		if (close(res->sock))
+			log_error("failed to close socket\n");
+		res->sock = -1;
+	}
+	return rc;
+}
+/******************************************************************************
+ * Function: resources_build
+ *
+ * Input
+ * res pointer to resources structure to be filled in
+ *
+ * Output
+ * res filled in with the device, buffers, CQ and QP
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Create everything a connection needs besides the connection to the remote
+ * side itself. The QP is left in the RESET state.
+ ******************************************************************************/
+int resources_build(struct resources *res)
+{
+	struct ibv_qp_init_attr qp_init_attr;
+	uint32_t max_inline;
+	int cq_size = 0;
+	int rc = 0;
+
+	if (res->cq)
+		res->shared_cq = 1;
+	/* the device is supplied by a listener, fixed by a shared CQ or SRQ or looked up */
+	if (!res->dev && res->shared_cq)
+		res->dev = res->cq->dev;
+	if (!res->dev && res->srq)
+		res->dev = res->srq->dev;
+	if (res->dev)
+		device_hold(res->dev);
+	else
+		res->dev = device_get(res->cfg.dev_name, res->cfg.ib_port);
+	if (!res->dev)
+	{
+		rc = 1;
+		goto resources_build_exit;
+	}
+	res->ib_ctx = res->dev->ib_ctx;
+	res->pd = res->dev->pd;
+	res->port_attr = res->dev->port_attr;
+	res->device_attr = res->dev->device_attr;
+	if (res->srq)
+	{
+		if (res->srq->dev != res->dev)
+		{
+			log_error("shared receive queue belongs to another device\n");
+			rc = 1;
+			goto resources_build_exit;
+		}
+		res->cfg.msg_size = res->srq->msg_size;
+	}
+
+	if (res->timeout_msec <= 0)
+		res->timeout_msec = MAX_POLL_CQ_TIMEOUT;
+	if (!res->send_depth)
+		res->send_depth = MAX_SEND_WR;
+	if (res->send_depth < 2)
+		res->send_depth = 2;
+	if (res->send_depth > res->device_attr.max_qp_wr)
+	{
+		log_info("send queue depth %d exceeds device limit, using %d\n", res->send_depth,
+				res->device_attr.max_qp_wr);
+		res->send_depth = res->device_attr.max_qp_wr;
+	}
+
+	res->recv_depth = res->cfg.msg_depth + CTRL_RECV_DEPTH;
+	if (res->recv_depth > res->device_attr.max_qp_wr)
+	{
+		res->recv_depth = res->device_attr.max_qp_wr;
+		res->cfg.msg_depth = res->recv_depth - CTRL_RECV_DEPTH;
+		log_info("receive ring depth exceeds device limit, using %d\n", res->cfg.msg_depth);
+	}
+	/* the message slots are advertised to the peer as its send credits */
+	if (res->recv_depth <= CTRL_RECV_DEPTH)
+	{
+		log_error("device allows %d receives per QP, more than the %d control receives are needed\n",
+				res->device_attr.max_qp_wr, CTRL_RECV_DEPTH);
+		rc = 1;
+		goto resources_build_exit;
 	}
 
-	size = MSG_SIZE;
-	res->buf = (char *)malloc(size);
-	if (!res->buf)
+	res->async_post_ns = calloc(res->send_depth, sizeof(*res->async_post_ns));
+	if (!res->async_post_ns)
+	{
+		log_error("failed to allocate post time ring\n");
+		rc = 1;
+		goto resources_build_exit;
+	}
+	res->msg_queue = calloc(res->recv_depth, sizeof(*res->msg_queue));
+	if (!res->msg_queue)
 	{
-		fprintf(stderr, "failed to malloc %Zu bytes to memory buffer\n", size);
+		log_error("failed to allocate message queue\n");
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_build_exit;
+	}
+
+	if (!res->shared_cq)
+	{
+		cq_size = res->send_depth + res->recv_depth;
+		if (res->cq_depth > cq_size)
+			cq_size = res->cq_depth;
+		res->cq = comp_queue_create(res->ib_ctx, cq_size, res->blocking);
+		if (!res->cq)
+		{
+			rc = 1;
+			goto resources_build_exit;
+		}
 	}
 
-	memset(res->buf, 0, size);
+	/* the peer gets the rkey, so the buffer must not share its MR with others */
+	res->block = pool_get(res->dev->pool, res->cfg.buf_size, 1);
+	if (!res->block)
+	{
+		log_error("failed to get %zu bytes of registered memory\n", res->cfg.buf_size);
+		rc = 1;
+		goto resources_build_exit;
+	}
+	res->buf = res->block->addr;
+	res->mr = res->block->mr;
+	log_info("buffer at addr=%p, lkey=0x%x, rkey=0x%x\n", res->buf, res->mr->lkey, res->mr->rkey);
 
-	mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-	res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags);
-	if (!res->mr)
+	/* the receive slots and the send slot are only accessed locally */
+	res->msg_block = pool_get(res->dev->pool,
+							  (size_t)(res->srq ? 1 : res->recv_depth + 1) * res->cfg.msg_size, 0);
+	if (!res->msg_block)
 	{
-		fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+		log_error("failed to get registered memory for the receive ring\n");
 		rc = 1;
-		goto resources_create_exit;
-	}
-	fprintf(stdout, "MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n",
-			res->buf, res->mr->lkey, res->mr->rkey, mr_flags);
-
-	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-	qp_init_attr.qp_type = IBV_QPT_RC;
-	qp_init_attr.sq_sig_all = 1;
-	qp_init_attr.send_cq = res->cq;
-	qp_init_attr.recv_cq = res->cq;
-	qp_init_attr.cap.max_send_wr = 10;
-	qp_init_attr.cap.max_recv_wr = 10;
-	qp_init_attr.cap.max_send_sge = 10;
-	qp_init_attr.cap.max_recv_sge = 10;
-
-	res->qp = ibv_create_qp(res->pd, &qp_init_attr);
+		goto resources_build_exit;
+	}
+	res->send_slot = res->msg_block->addr + (res->srq ? 0 : (size_t)res->recv_depth * res->cfg.msg_size);
+
+	res->max_send_sge = res->device_attr.max_sge < MAX_SEND_SGE ? res->device_attr.max_sge : MAX_SEND_SGE;
+
+	/* devices reject inline sizes above their limit, which they do not report,
+	   so the request is halved until the QP can be created */
+	for (max_inline = MAX_INLINE_DATA;; max_inline /= 2)
+	{
+		memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+		qp_init_attr.qp_context = res; /* for the asynchronous events of the QP */
+		qp_init_attr.qp_type = IBV_QPT_RC;
+		qp_init_attr.sq_sig_all = 0; /* every work request but those of batches is signaled */
+		qp_init_attr.send_cq = res->cq->cq;
+		qp_init_attr.recv_cq = res->cq->cq;
+		qp_init_attr.cap.max_send_wr = res->send_depth;
+		qp_init_attr.cap.max_send_sge = res->max_send_sge;
+		qp_init_attr.cap.max_inline_data = max_inline;
+		if (res->srq)
+			qp_init_attr.srq = res->srq->srq;
+		else
+		{
+			qp_init_attr.cap.max_recv_wr = res->recv_depth;
+			qp_init_attr.cap.max_recv_sge = 10;
+		}
+
+		res->qp = ibv_create_qp(res->pd, &qp_init_attr);
+		if (res->qp || !max_inline)
+			break;
+	}
 	if (!res->qp)
 	{
-		fprintf(stderr, "failed to create QP\n");
+		log_error("failed to create QP\n");
 		rc = 1;
-		goto resources_create_exit;
+		goto resources_build_exit;
 	}
-	fprintf(stdout, "QP was created, QP number=0x%x\n", res->qp->qp_num);
-resources_create_exit:
+	res->max_inline = qp_init_attr.cap.max_inline_data;
+	res->max_send_sge = qp_init_attr.cap.max_send_sge;
+	res->max_read_sge = res->max_send_sge;
+	if (res->device_attr.max_sge_rd && res->device_attr.max_sge_rd < res->max_read_sge)
+		res->max_read_sge = res->device_attr.max_sge_rd;
+	log_info("QP was created, QP number=0x%x, inline data up to %u bytes\n", res->qp->qp_num,
+			res->max_inline);
+
+	if (comp_queue_attach(res->cq, res, res->send_depth + res->recv_depth))
+	{
+		rc = 1;
+		goto resources_build_exit;
+	}
+	if (!res->shared_cq)
+		comp_queue_put(res->cq); /* the attached connection keeps the queue alive */
+	if (res->srq)
+		shared_rq_hold(res->srq); /* the QP must be destroyed before the SRQ */
+resources_build_exit:
 	if (rc)
 	{
 		if (res->qp)
@@ -510,169 +2023,370 @@ resources_create_exit:
 			ibv_destroy_qp(res->qp);
 			res->qp = NULL;
 		}
-		if (res->mr)
+		if (res->msg_block)
 		{
-			ibv_dereg_mr(res->mr);
-			res->mr = NULL;
+			pool_put(res->dev->pool, res->msg_block);
+			res->msg_block = NULL;
+			res->send_slot = NULL;
 		}
-		if (res->buf)
+		if (res->block)
 		{
-			free(res->buf);
+			pool_put(res->dev->pool, res->block);
+			res->block = NULL;
+			res->mr = NULL;
 			res->buf = NULL;
 		}
 		if (res->cq)
 		{
-			ibv_destroy_cq(res->cq);
+			if (!res->shared_cq)
+				comp_queue_put(res->cq);
 			res->cq = NULL;
 		}
-		if (res->pd)
-		{
-			ibv_dealloc_pd(res->pd);
-			res->pd = NULL;
-		}
+		free(res->async_post_ns);
+		res->async_post_ns = NULL;
+		free(res->msg_queue);
+		res->msg_queue = NULL;
 		if (res->ib_ctx)
 		{
-			ibv_close_device(res->ib_ctx);
+			device_put(res->dev);
 			res->ib_ctx = NULL;
+			res->pd = NULL;
 		}
-		if (dev_list)
-		{
-			ibv_free_device_list(dev_list);
-			dev_list = NULL;
-		}
-		if (res->sock >= 0)
-		{
-			if (close(res->sock))
-				fprintf(stderr, "failed to close socket\n");
-			res->sock = -1;
-		}
+		res->dev = NULL;
+	}
+	return rc;
+}
+/******************************************************************************
+ * Function: modify_qp_to_init
+ *
+ * Input
+ * res connection whose QP is transitioned
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the RESET to INIT state
+ ******************************************************************************/
+int modify_qp_to_init(struct resources *res)
+{
+	struct ibv_qp_attr attr;
+	int flags;
+	int rc;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.qp_state = IBV_QPS_INIT;
+	attr.port_num = res->cfg.ib_port;
+	attr.pkey_index = 0;
+	attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	if (res->device_attr.atomic_cap != IBV_ATOMIC_NONE)
+		attr.qp_access_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+	flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+
+	rc = ibv_modify_qp(res->qp, &attr, flags);
+	if (rc)
+		log_error("failed to modify QP state to INIT\n");
+	return rc;
+}
+/******************************************************************************
+ * Function: modify_qp_to_rtr
+ *
+ * Input
+ * res connection whose QP is transitioned
+ * remote_qpn remote QP number
+ * dlid destination LID
+ * dgid destination GID (mandatory for RoCEE)
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the INIT to RTR state, using the specified QP number
+ ******************************************************************************/
+int modify_qp_to_rtr(struct resources *res, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid)
+{
+	struct ibv_qp_attr attr;
+	int flags;
+	int rc;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.qp_state = IBV_QPS_RTR;
+	attr.path_mtu = res->path_mtu;
+	attr.dest_qp_num = remote_qpn;
+	attr.rq_psn = 0;
+	attr.max_dest_rd_atomic = res->max_dest_rd_atomic;
+	attr.min_rnr_timer = res->cfg.min_rnr_timer;
+	attr.ah_attr.is_global = 0;
+	attr.ah_attr.dlid = dlid;
+	attr.ah_attr.sl = 0;
+	attr.ah_attr.src_path_bits = 0;
+	attr.ah_attr.port_num = res->cfg.ib_port;
+
+	if (res->cfg.gid_idx >= 0)
+	{
+		attr.ah_attr.is_global = 1;
+		memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
+		attr.ah_attr.grh.flow_label = 0;
+		attr.ah_attr.grh.hop_limit = 1;
+		attr.ah_attr.grh.sgid_index = res->cfg.gid_idx;
+		attr.ah_attr.grh.traffic_class = 0;
 	}
+
+	flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+
+	rc = ibv_modify_qp(res->qp, &attr, flags);
+	if (rc)
+		log_error("failed to modify QP state to RTR\n");
+	return rc;
+}
+/******************************************************************************
+ * Function: modify_qp_to_rts
+ *
+ * Input
+ * res connection whose QP is transitioned
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the RTR to RTS state
+ ******************************************************************************/
+int modify_qp_to_rts(struct resources *res)
+{
+	struct ibv_qp_attr attr;
+	int flags;
+	int rc;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.qp_state = IBV_QPS_RTS;
+	attr.timeout = res->cfg.timeout;
+	attr.retry_cnt = res->cfg.retry_cnt;
+	attr.rnr_retry = res->cfg.rnr_retry;
+	attr.sq_psn = 0;
+	attr.max_rd_atomic = res->max_rd_atomic;
+	flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+			IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+
+	rc = ibv_modify_qp(res->qp, &attr, flags);
+	if (rc)
+		log_error("failed to modify QP state to RTS\n");
 	return rc;
 }
 /******************************************************************************
- * Function: modify_qp_to_init
+ * Function: min_int
+ *
+ * Input
+ * a, b values to compare
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the smaller of a and b
+ ******************************************************************************/
+static int min_int(int a, int b)
+{
+	return a < b ? a : b;
+}
+/******************************************************************************
+ * Function: max_int
+ *
+ * Input
+ * a, b values to compare
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the larger of a and b
+ ******************************************************************************/
+static int max_int(int a, int b)
+{
+	return a > b ? a : b;
+}
+/******************************************************************************
+ * Function: qp_offer
  *
  * Input
- * qp QP to transition
+ * res pointer to resources structure
  *
  * Output
- * none
+ * con_data QP attributes the local side supports, to be exchanged
  *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * none
  *
  * Description
- * Transition a QP from the RESET to INIT state
+ * Derive the path MTU and the number of RDMA reads and atomics in flight the
+ * local side supports from the port and device attributes, lowered by the
+ * connection's overrides.
  ******************************************************************************/
-int modify_qp_to_init(struct ibv_qp *qp)
+static void qp_offer(struct resources *res, struct cm_con_data_t *con_data)
 {
-	struct ibv_qp_attr attr;
-	int flags;
-	int rc;
-	memset(&attr, 0, sizeof(attr));
-
-	attr.qp_state = IBV_QPS_INIT;
-	attr.port_num = config.ib_port;
-	attr.pkey_index = 0;
-	attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-	flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+	int mtu = res->port_attr.active_mtu;
+	int rd_atom = min_int(res->device_attr.max_qp_rd_atom, 255);
+	int init_rd_atom = min_int(res->device_attr.max_qp_init_rd_atom, 255);
 
-	rc = ibv_modify_qp(qp, &attr, flags);
-	if (rc)
-		fprintf(stderr, "failed to modify QP state to INIT\n");
-	return rc;
+	if (res->cfg.mtu)
+		mtu = min_int(mtu, res->cfg.mtu);
+	if (res->cfg.max_rd_atomic)
+	{
+		rd_atom = min_int(rd_atom, res->cfg.max_rd_atomic);
+		init_rd_atom = min_int(init_rd_atom, res->cfg.max_rd_atomic);
+	}
+	con_data->mtu = mtu;
+	con_data->rd_atom = rd_atom;
+	con_data->init_rd_atom = init_rd_atom;
 }
 /******************************************************************************
- * Function: modify_qp_to_rtr
+ * Function: con_data_local
  *
  * Input
- * qp QP to transition
- * remote_qpn remote QP number
- * dlid destination LID
- * dgid destination GID (mandatory for RoCEE)
+ * res pointer to resources structure
  *
  * Output
+ * con_data connection data of the local side in network byte order, without
+ * the GID
+ *
+ * Returns
  * none
  *
+ * Description
+ * Describe the connection buffer, the QP, the receive ring and the options
+ * of the local side for the remote side.
+ ******************************************************************************/
+void con_data_local(struct resources *res, struct cm_con_data_t *con_data)
+{
+	memset(con_data, 0, sizeof(*con_data));
+	con_data->addr = htonll((uintptr_t)res->buf);
+	con_data->rkey = htonl(res->mr->rkey);
+	con_data->qp_num = htonl(res->qp->qp_num);
+	con_data->lid = htons(res->port_attr.lid);
+	con_data->size = htonll(res->cfg.buf_size);
+	con_data->flags = (res->notify ? CM_FLAG_NOTIFY : 0) | (res->srq ? CM_FLAG_SRQ : 0) |
+					  (res->dev->pool->mr_flags & IBV_ACCESS_REMOTE_ATOMIC ? CM_FLAG_ATOMIC : 0);
+	qp_offer(res, con_data);
+	con_data->msg_size = htonl(res->cfg.msg_size);
+	con_data->msg_depth = htonl(res->cfg.msg_depth);
+}
+/******************************************************************************
+ * Function: con_data_remote
+ *
+ * Input
+ * res pointer to resources structure
+ * local connection data sent to the remote side
+ * wire connection data received from the remote side, in network byte order
+ *
+ * Output
+ * res->remote_props, the negotiated QP attributes and the credits
+ *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * 0 on success, 1 if the sides do not match
  *
  * Description
- * Transition a QP from the INIT to RTR state, using the specified QP number
+ * Take over the connection data of the remote side, check that both sides
+ * agree on the options they must share and negotiate the QP attributes.
  ******************************************************************************/
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid)
+int con_data_remote(struct resources *res, const struct cm_con_data_t *local, const struct cm_con_data_t *wire)
 {
-	struct ibv_qp_attr attr;
-	int flags;
-	int rc;
-	memset(&attr, 0, sizeof(attr));
+	struct cm_con_data_t remote_con_data;
 
-	attr.qp_state = IBV_QPS_RTR;
-	attr.path_mtu = IBV_MTU_256;
-	attr.dest_qp_num = remote_qpn;
-	attr.rq_psn = 0;
-	attr.max_dest_rd_atomic = 1;
-	attr.min_rnr_timer = 0x12;
-	attr.ah_attr.is_global = 0;
-	attr.ah_attr.dlid = dlid;
-	attr.ah_attr.sl = 0;
-	attr.ah_attr.src_path_bits = 0;
-	attr.ah_attr.port_num = config.ib_port;
+	remote_con_data.addr = ntohll(wire->addr);
+	remote_con_data.rkey = ntohl(wire->rkey);
+	remote_con_data.qp_num = ntohl(wire->qp_num);
+	remote_con_data.lid = ntohs(wire->lid);
+	memcpy(remote_con_data.gid, wire->gid, 16);
+	remote_con_data.size = ntohll(wire->size);
+	remote_con_data.flags = wire->flags;
+	remote_con_data.mtu = wire->mtu;
+	remote_con_data.rd_atom = wire->rd_atom;
+	remote_con_data.init_rd_atom = wire->init_rd_atom;
+	remote_con_data.msg_size = ntohl(wire->msg_size);
+	remote_con_data.msg_depth = ntohl(wire->msg_depth);
+	res->remote_props = remote_con_data;
+	log_info("Remote address = 0x%" PRIx64 "\n", remote_con_data.addr);
+	log_info("Remote rkey = 0x%x\n", remote_con_data.rkey);
+	log_info("Remote QP number = 0x%x\n", remote_con_data.qp_num);
+	log_info("Remote LID = 0x%x\n", remote_con_data.lid);
+	if ((remote_con_data.flags ^ local->flags) & CM_FLAG_NOTIFY)
+	{
+		log_error("connection flags mismatch, local 0x%x, remote 0x%x\n", local->flags,
+				remote_con_data.flags);
+		return 1;
+	}
+	if (remote_con_data.size != res->cfg.buf_size)
+	{
+		log_error("buffer size mismatch, local %zu, remote %" PRIu64 "\n", res->cfg.buf_size,
+				remote_con_data.size);
+		return 1;
+	}
+	if (remote_con_data.msg_size != res->cfg.msg_size)
+	{
+		log_error("message slot size mismatch, local %u, remote %u\n", res->cfg.msg_size,
+				remote_con_data.msg_size);
+		return 1;
+	}
 
-	if (config.gid_idx >= 0)
+	/* a shared receive queue may run dry for a moment, which must not break
+	   the connection unless the RNR retries were set explicitly */
+	if ((remote_con_data.flags & CM_FLAG_SRQ) && !res->cfg.rnr_retry)
 	{
-		attr.ah_attr.is_global = 1;
-		attr.ah_attr.port_num = 1;
-		memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
-		attr.ah_attr.grh.flow_label = 0;
-		attr.ah_attr.grh.hop_limit = 1;
-		attr.ah_attr.grh.sgid_index = config.gid_idx;
-		attr.ah_attr.grh.traffic_class = 0;
+		log_info("remote side receives from a shared queue, retrying RNR NAKs indefinitely\n");
+		res->cfg.rnr_retry = 7;
 	}
 
-	flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+	/* each side may only use what both support */
+	res->path_mtu = min_int(local->mtu, remote_con_data.mtu);
+	res->max_rd_atomic = max_int(min_int(local->init_rd_atom, remote_con_data.rd_atom), 1);
+	res->max_dest_rd_atomic = max_int(min_int(local->rd_atom, remote_con_data.init_rd_atom), 1);
+	log_info("path MTU %d, reads in flight %d as initiator, %d as responder\n",
+			128 << res->path_mtu, res->max_rd_atomic, res->max_dest_rd_atomic);
 
-	rc = ibv_modify_qp(qp, &attr, flags);
-	if (rc)
-		fprintf(stderr, "failed to modify QP state to RTR\n");
-	return rc;
+	res->credits = 1;
+	res->arrived = 0;
+	res->msg_credits = remote_con_data.msg_depth;
+	res->msg_owed = 0;
+	return 0;
 }
 /******************************************************************************
- * Function: modify_qp_to_rts
+ * Function: post_receives
  *
  * Input
- * qp QP to transition
+ * res pointer to resources structure
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * 0 on success, 1 on failure
  *
  * Description
- * Transition a QP from the RTR to RTS state
+ * Fill the receive ring of a QP in the INIT state. Connections on a shared
+ * receive queue have no ring of their own.
  ******************************************************************************/
-int modify_qp_to_rts(struct ibv_qp *qp)
+int post_receives(struct resources *res)
 {
-	struct ibv_qp_attr attr;
-	int flags;
-	int rc;
-	memset(&attr, 0, sizeof(attr));
-
-	attr.qp_state = IBV_QPS_RTS;
-	attr.timeout = 0x12;
-	attr.retry_cnt = 6;
-	attr.rnr_retry = 0;
-	attr.sq_psn = 0;
-	attr.max_rd_atomic = 1;
-	flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-			IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+	int i;
 
-	rc = ibv_modify_qp(qp, &attr, flags);
-	if (rc)
-		fprintf(stderr, "failed to modify QP state to RTS\n");
-	return rc;
+	for (i = 0; !res->srq && i < res->recv_depth; i++)
+	{
+		if (post_receive(res, i))
+		{
+			log_error("failed to post RR\n");
+			return 1;
+		}
+	}
+	return 0;
 }
 /******************************************************************************
  * Function: connect_qp
@@ -692,98 +2406,358 @@ int modify_qp_to_rts(struct ibv_qp *qp)
 int connect_qp(struct resources *res)
 {
 	struct cm_con_data_t local_con_data;
-	struct cm_con_data_t remote_con_data;
 	struct cm_con_data_t tmp_con_data;
 	int rc = 0;
 	char temp_char;
 	union ibv_gid my_gid;
 
-	if (config.gid_idx >= 0)
+	if (res->cfg.gid_idx >= 0)
 	{
-		rc = ibv_query_gid(res->ib_ctx, config.ib_port, config.gid_idx, &my_gid);
+		rc = ibv_query_gid(res->ib_ctx, res->cfg.ib_port, res->cfg.gid_idx, &my_gid);
 		if (rc)
 		{
-			fprintf(stderr, "could not get gid for port %d, index %d\n", config.ib_port, config.gid_idx);
+			log_error("could not get gid for port %d, index %d\n", res->cfg.ib_port, res->cfg.gid_idx);
 			return rc;
 		}
 	}
 	else
 	{
-		fprintf(stdout, "using InfiniBand subnet connection\n");
+		log_info("using InfiniBand subnet connection\n");
 		memset(&my_gid, 0, sizeof my_gid);
 	}
 
-	local_con_data.addr = htonll((uintptr_t)res->buf);
-	local_con_data.rkey = htonl(res->mr->rkey);
-	local_con_data.qp_num = htonl(res->qp->qp_num);
-	local_con_data.lid = htons(res->port_attr.lid);
+	con_data_local(res, &local_con_data);
 	memcpy(local_con_data.gid, &my_gid, 16);
-	fprintf(stdout, "\nLocal LID = 0x%x\n", res->port_attr.lid);
+	log_info("\nLocal LID = 0x%x\n", res->port_attr.lid);
 	if (sock_sync_data(res->sock, sizeof(struct cm_con_data_t), (char *)&local_con_data, (char *)&tmp_con_data) < 0)
 	{
-		fprintf(stderr, "failed to exchange connection data between sides\n");
+		log_error("failed to exchange connection data between sides\n");
 		rc = 1;
 		goto connect_qp_exit;
 	}
+	rc = con_data_remote(res, &local_con_data, &tmp_con_data);
+	if (rc)
+		goto connect_qp_exit;
 
-	remote_con_data.addr = ntohll(tmp_con_data.addr);
-	remote_con_data.rkey = ntohl(tmp_con_data.rkey);
-	remote_con_data.qp_num = ntohl(tmp_con_data.qp_num);
-	remote_con_data.lid = ntohs(tmp_con_data.lid);
-	memcpy(remote_con_data.gid, tmp_con_data.gid, 16);
-	res->remote_props = remote_con_data;
-	fprintf(stdout, "Remote address = 0x%" PRIx64 "\n", remote_con_data.addr);
-	fprintf(stdout, "Remote rkey = 0x%x\n", remote_con_data.rkey);
-	fprintf(stdout, "Remote QP number = 0x%x\n", remote_con_data.qp_num);
-	fprintf(stdout, "Remote LID = 0x%x\n", remote_con_data.lid);
-
-	if (config.gid_idx >= 0)
+	if (res->cfg.gid_idx >= 0)
 	{
-		uint8_t *p = remote_con_data.gid;
-		fprintf(stdout, "Remote GID =%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n", p[0],
+		uint8_t *p = res->remote_props.gid;
+		log_info("Remote GID =%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n", p[0],
 				p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
 	}
 
-	rc = modify_qp_to_init(res->qp);
+	/* a QP from a warm pool is in INIT already */
+	rc = res->warm ? 0 : qp_warm(res);
 	if (rc)
-	{
-		fprintf(stderr, "change QP state to INIT failed\n");
 		goto connect_qp_exit;
-	}
-
-	if (config.server_name)
-	{
-		rc = post_receive(res);
-		if (rc)
-		{
-			fprintf(stderr, "failed to post RR\n");
-			goto connect_qp_exit;
-		}
-	}
 
-	rc = modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid);
+	rc = modify_qp_to_rtr(res, res->remote_props.qp_num, res->remote_props.lid, res->remote_props.gid);
 	if (rc)
 	{
-		fprintf(stderr, "failed to modify QP state to RTR\n");
+		log_error("failed to modify QP state to RTR\n");
 		goto connect_qp_exit;
 	}
 
-	rc = modify_qp_to_rts(res->qp);
+	rc = modify_qp_to_rts(res);
 	if (rc)
 	{
-		fprintf(stderr, "failed to modify QP state to RTR\n");
+		log_error("failed to modify QP state to RTR\n");
 		goto connect_qp_exit;
 	}
-	fprintf(stdout, "QP state was change to RTS\n");
+	log_info("QP state was change to RTS\n");
+	res->warm = 0;
 
 	if (sock_sync_data(res->sock, 1, "Q", &temp_char)) /* just send a dummy char back and forth */
 	{
-		fprintf(stderr, "sync error after QPs are were moved to RTS\n");
+		log_error("sync error after QPs are were moved to RTS\n");
 		rc = 1;
 	}
 connect_qp_exit:
 	return rc;
 }
+/******************************************************************************
+ * Function: qp_warm
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Move a QP in the RESET state to INIT and fill its receive ring, the part of
+ * connecting that does not depend on the remote side, so that a connection
+ * taking the QP from a warm pool only needs to exchange its data and drive it
+ * to RTR and RTS.
+ ******************************************************************************/
+int qp_warm(struct resources *res)
+{
+	if (modify_qp_to_init(res))
+	{
+		log_error("change QP state to INIT failed\n");
+		return 1;
+	}
+	if (post_receives(res))
+		return 1;
+	res->warm = 1;
+	return 0;
+}
+/******************************************************************************
+ * Function: msg_queue_reclaim
+ *
+ * Input
+ * res pointer to resources structure, with the lock of res->cq held
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Give back the slots of the messages queued for msg_recv that nobody will
+ * consume. Slots of a shared receive queue are posted to it again, since the
+ * other connections keep receiving from it; slots of the connection's own
+ * ring go with the ring.
+ ******************************************************************************/
+static int msg_queue_reclaim(struct resources *res)
+{
+	uint64_t wr_id;
+	int rc = 0;
+
+	for (; res->msg_head != res->msg_tail; res->msg_head++)
+	{
+		wr_id = res->msg_queue[res->msg_head % res->recv_depth].wr_id;
+		if ((wr_id & SRQ_WR_FLAG) && recv_repost(res, wr_id))
+			rc = 1;
+	}
+	res->msg_ready = 0;
+	return rc;
+}
+/******************************************************************************
+ * Function: srq_reclaim
+ *
+ * Input
+ * res pointer to resources structure of a connection on a shared receive
+ * queue, about to be destroyed
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Return the shared receive queue slots the connection holds. The QP is
+ * moved to the error state so it takes no further receives from the queue,
+ * the completions already in the CQ are dispatched, and the slots of the
+ * messages never consumed are posted to the queue again.
+ ******************************************************************************/
+static int srq_reclaim(struct resources *res)
+{
+	struct ibv_qp_attr attr;
+	int rc = 0;
+	int n;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_ERR;
+	if (ibv_modify_qp(res->qp, &attr, IBV_QP_STATE))
+	{
+		log_error("failed to modify QP state to ERR\n");
+		rc = 1;
+	}
+	pthread_mutex_lock(&res->cq->lock);
+	do
+		n = comp_queue_drain(res->cq);
+	while (n > 0);
+	if (n < 0)
+		rc = 1;
+	if (msg_queue_reclaim(res))
+		rc = 1;
+	pthread_cond_broadcast(&res->cq->cond);
+	pthread_mutex_unlock(&res->cq->lock);
+	return rc;
+}
+/******************************************************************************
+ * Function: qp_drain
+ *
+ * Input
+ * res pointer to resources structure whose QP is in the error state and has a
+ * CQ of its own, with the lock of res->cq held
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Reap every completion of the QP. The device keeps flushing outstanding work
+ * requests after the QP entered the error state, so an empty CQ does not mean
+ * it is done. Each queue of the QP flushes in order, so a signaled marker is
+ * posted behind the outstanding sends and, without a shared receive queue,
+ * one behind the receives; once both completed nothing else is left. A QP on
+ * a shared receive queue cannot post receives of its own and waits for
+ * IBV_EVENT_QP_LAST_WQE_REACHED instead, after which it consumes no more of
+ * the queue, and only then posts the send marker to flush the completions of
+ * the receives it did consume. Receives holding slots of a shared queue post
+ * them to it again. Markers are retried while their queue is full, and the
+ * drain gives up after the completion timeout of the connection.
+ ******************************************************************************/
+static int qp_drain(struct resources *res)
+{
+	struct ibv_send_wr sr;
+	struct ibv_send_wr *bad_sr;
+	struct ibv_recv_wr rr;
+	struct ibv_recv_wr *bad_rr;
+	struct ibv_wc wc[POLL_BATCH];
+	int timeout_msec = res->timeout_msec > 0 ? res->timeout_msec : MAX_POLL_CQ_TIMEOUT;
+	uint64_t deadline = now_nsec() + (uint64_t)timeout_msec * 1000000;
+	int sq_posted = 0;
+	int sq_done = 0;
+	int rq_posted = res->srq != NULL;
+	int rq_done = 0;
+	int rc = 0;
+	int n;
+	int i;
+
+	memset(&sr, 0, sizeof(sr));
+	sr.wr_id = DRAIN_WR_ID;
+	sr.opcode = IBV_WR_SEND;
+	sr.send_flags = IBV_SEND_SIGNALED;
+	memset(&rr, 0, sizeof(rr));
+	rr.wr_id = RECV_WR_FLAG | DRAIN_WR_ID;
+
+	while (!sq_done || !rq_done)
+	{
+		if (res->srq)
+			rq_done = __atomic_load_n(&res->last_wqe, __ATOMIC_ACQUIRE);
+		if (!rq_posted)
+			rq_posted = !ibv_post_recv(res->qp, &rr, &bad_rr);
+		if (!sq_posted && (!res->srq || rq_done))
+			sq_posted = !ibv_post_send(res->qp, &sr, &bad_sr);
+
+		n = ibv_poll_cq(res->cq->cq, POLL_BATCH, wc);
+		if (n < 0)
+		{
+			log_error("poll CQ failed\n");
+			return 1;
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (wc[i].wr_id == DRAIN_WR_ID)
+				sq_done = 1;
+			else if (wc[i].wr_id == (RECV_WR_FLAG | DRAIN_WR_ID))
+				rq_done = 1;
+			else if ((wc[i].wr_id & SRQ_WR_FLAG) && recv_repost(res, wc[i].wr_id))
+				rc = 1;
+		}
+		if (n)
+			continue;
+		if (now_nsec() > deadline)
+		{
+			log_error("QP 0x%x was not drained within %d ms\n", res->qp->qp_num, timeout_msec);
+			return 1;
+		}
+		usleep(100);
+	}
+	return rc;
+}
+/******************************************************************************
+ * Function: resources_recycle
+ *
+ * Input
+ * res pointer to resources structure of a closed connection
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure, in which case res must be destroyed
+ *
+ * Description
+ * Make the resources of a closed connection ready for the next one instead
+ * of destroying them. The QP is drained of all its completions with
+ * qp_drain, reset and warmed again; the state of the connection and the
+ * contents of its buffer are cleared, while the configuration is left to the
+ * next connection to set. Receives that hold
+ * slots of a shared receive queue, completed or queued for msg_recv, post
+ * them to the queue again. Only QPs with a CQ of their own can be recycled,
+ * since the completions of a shared CQ may belong to other connections.
+ ******************************************************************************/
+int resources_recycle(struct resources *res)
+{
+	struct ibv_qp_attr attr;
+	int failed = 0;
+
+	if (res->shared_cq || res->cm_id)
+	{
+		log_error("QP 0x%x cannot be recycled\n", res->qp->qp_num);
+		return 1;
+	}
+	/* the QP takes no further receives in the error state, so the CQ can be
+	   drained before the reset discards the outstanding work requests */
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_ERR;
+	if (ibv_modify_qp(res->qp, &attr, IBV_QP_STATE))
+	{
+		log_error("failed to modify QP state to ERR\n");
+		return 1;
+	}
+	/* completions of the old connection must not reach the next one, but
+	   receives from a shared queue hand their slots back to it */
+	pthread_mutex_lock(&res->cq->lock);
+	if (qp_drain(res))
+		failed = 1;
+	if (msg_queue_reclaim(res))
+		failed = 1;
+	pthread_mutex_unlock(&res->cq->lock);
+	if (failed)
+		return 1;
+	attr.qp_state = IBV_QPS_RESET;
+	if (ibv_modify_qp(res->qp, &attr, IBV_QP_STATE))
+	{
+		log_error("failed to modify QP state to RESET\n");
+		return 1;
+	}
+	if (res->sock >= 0)
+	{
+		if (close(res->sock))
+			log_error("failed to close socket\n");
+		res->sock = -1;
+	}
+
+	memset(&res->remote_props, 0, sizeof(res->remote_props));
+	res->path_mtu = 0;
+	res->max_rd_atomic = 0;
+	res->max_dest_rd_atomic = 0;
+	res->send_seq = 0;
+	res->recv_seq = 0;
+	res->notify = 0;
+	res->credits = 0;
+	res->arrived = 0;
+	res->msg_credits = 0;
+	res->msg_owed = 0;
+	res->msg_ready = 0;
+	res->msg_head = 0;
+	res->msg_tail = 0;
+	memset(res->msg_queue, 0, res->recv_depth * sizeof(*res->msg_queue));
+	res->sync_done = 0;
+	res->async_posted = 0;
+	res->async_done = 0;
+	res->async_error = 0;
+	res->failed = 0;
+	res->last_wqe = 0;
+	res->sync_post_ns = 0;
+	memset(res->async_post_ns, 0, res->send_depth * sizeof(*res->async_post_ns));
+	memset(&res->stats, 0, sizeof(res->stats));
+	memset(res->buf, 0, res->cfg.buf_size);
+	log_info("QP 0x%x was recycled\n", res->qp->qp_num);
+	return qp_warm(res);
+}
 /******************************************************************************
  * Function: resources_destroy
  *
@@ -803,45 +2777,68 @@ int resources_destroy(struct resources *res)
 {
 	int rc = 0;
 	if (res->qp)
+	{
+		/* unconsumed receives would drain the shared queue for good */
+		if (res->srq && res->msg_queue && srq_reclaim(res))
+			rc = 1;
+		comp_queue_detach(res->cq, res, res->send_depth + res->recv_depth);
 		if (ibv_destroy_qp(res->qp))
 		{
-			fprintf(stderr, "failed to destroy QP\n");
+			log_error("failed to destroy QP\n");
 			rc = 1;
 		}
-	if (res->mr)
-		if (ibv_dereg_mr(res->mr))
-		{
-			fprintf(stderr, "failed to deregister MR\n");
+	}
+	if (res->srq)
+		if (shared_rq_put(res->srq))
 			rc = 1;
-		}
-	if (res->buf)
-		free(res->buf);
+	if (res->msg_block)
+		pool_put(res->dev->pool, res->msg_block);
+	if (res->block)
+		pool_put(res->dev->pool, res->block);
+	free(res->async_post_ns);
+	free(res->msg_queue);
 	if (res->cq)
-		if (ibv_destroy_cq(res->cq))
-		{
-			fprintf(stderr, "failed to destroy CQ\n");
-			rc = 1;
-		}
-	if (res->pd)
-		if (ibv_dealloc_pd(res->pd))
-		{
-			fprintf(stderr, "failed to deallocate PD\n");
+		if (comp_queue_put(res->cq))
 			rc = 1;
-		}
-	if (res->ib_ctx)
-		if (ibv_close_device(res->ib_ctx))
-		{
-			fprintf(stderr, "failed to close device context\n");
+	if (res->dev)
+		if (device_put(res->dev))
 			rc = 1;
-		}
 	if (res->sock >= 0)
 		if (close(res->sock))
 		{
-			fprintf(stderr, "failed to close socket\n");
+			log_error("failed to close socket\n");
 			rc = 1;
 		}
+#ifdef RDMA_CM
+	cm_destroy(res);
+#endif
 	return rc;
 }
+/******************************************************************************
+ * Function: stats_snapshot
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * out copy of the performance counters
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Copy the performance counters while other threads may be updating them.
+ * Every counter is read atomically, the copy as a whole is not.
+ ******************************************************************************/
+void stats_snapshot(struct resources *res, struct conn_stats *out)
+{
+	uint64_t *src = (uint64_t *)&res->stats;
+	uint64_t *dst = (uint64_t *)out;
+	size_t i;
+
+	for (i = 0; i < sizeof(*out) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
 /******************************************************************************
  * Function: print_config
  *
@@ -1,4 +1,7 @@
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +12,15 @@
 #include <byteswap.h>
 #include <getopt.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
 #include <sys/types.h>
@@ -16,8 +28,38 @@
 #include <netdb.h>
 
 #define MAX_POLL_CQ_TIMEOUT 20000
+#define POLL_CLOCK_INTERVAL 64
+#define POLL_BATCH 16
+#define LAT_BUCKETS 40
+#define WC_STATUS_SLOTS 32
 #define MSG "1234567890"
 #define MSG_SIZE (10485760)
+#define MSG_HDR_SIZE (sizeof(struct msg_hdr))
+#define MSG_MAX_PAYLOAD(res) ((res)->cfg.buf_size - MSG_HDR_SIZE)
+#define MAX_SEND_WR 10
+#define MAX_SEND_SGE 16
+#define MAX_BATCH 64
+#define CTRL_RECV_DEPTH 8
+#define MSG_SLOT_SIZE 4096
+#define MSG_RECV_DEPTH 64
+#define MAX_INLINE_DATA 512
+#define RECV_WR_FLAG (1ULL << 63)
+#define SRQ_WR_FLAG (1ULL << 62)
+#define DRAIN_WR_ID (1ULL << 61)
+#define MSG_IMM_DATA 0x80000000u
+#define MSG_IMM_CREDITS 0x7fffffffu
+#define NOTIFY_RX_OFFSET(res) ((res)->cfg.buf_size / 2)
+#define NOTIFY_MAX_PAYLOAD(res) (NOTIFY_RX_OFFSET(res) - MSG_HDR_SIZE)
+#define CM_FLAG_NOTIFY 0x1
+#define CM_FLAG_SRQ 0x2
+#define CM_FLAG_ATOMIC 0x4
+#define MAX_REGIONS 64
+#define REGION_NAME_LEN 32
+#define REGION_READ 0x1
+#define REGION_WRITE 0x2
+#define REGION_ATOMIC 0x4
+#define POOL_CLASSES 4
+#define POOL_SLAB_SIZE (4 * 1024 * 1024)
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
 static inline uint64_t htonll(uint64_t x) { return bswap_64(x); }
@@ -29,6 +71,42 @@ static inline uint64_t ntohll(uint64_t x) { return x; }
 #error __BYTE_ORDER is neither __LITTLE_ENDIAN nor __BIG_ENDIAN
 #endif
 
+/* logging verbosity, errors are printed unless the level is LOG_LEVEL_NONE */
+enum log_levels
+{
+    LOG_LEVEL_NONE,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+extern int log_level;
+
+#define log_error(...) do { if (log_level >= LOG_LEVEL_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_level >= LOG_LEVEL_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (log_level >= LOG_LEVEL_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+/* operation classes counted in struct conn_stats */
+enum stat_ops
+{
+    STAT_WRITE,
+    STAT_READ,
+    STAT_SEND,
+    STAT_ATOMIC,
+    STAT_RECV,
+    STAT_OPS
+};
+
+/* per-connection performance counters, updated with relaxed atomics */
+struct conn_stats
+{
+    uint64_t ops[STAT_OPS];               /* work requests posted, receives completed */
+    uint64_t bytes[STAT_OPS];             /* bytes posted, bytes received */
+    uint64_t errors[WC_STATUS_SLOTS];     /* failed completions by ibv_wc_status */
+    uint64_t timeouts;                    /* waits that gave up */
+    uint64_t latency[LAT_BUCKETS];        /* post to completion, bucket i counts [2^i, 2^(i+1)) ns */
+};
+
 /* structure of test parameters */
 struct config_t
 {
@@ -37,6 +115,15 @@ struct config_t
     u_int32_t tcp_port;           /* server TCP port */
     int ib_port;                  /* local IB port to work with */
     int gid_idx;                  /* gid index to use. RoCE requires GID, InfiniBand not required if in one subnet */
+    size_t buf_size;              /* size of the registered buffer */
+    int mtu;                      /* highest path MTU as enum ibv_mtu, 0 for the port's active MTU */
+    int max_rd_atomic;            /* most RDMA reads and atomics in flight, 0 for the device limit */
+    int min_rnr_timer;            /* RNR NAK timer of the QP */
+    int timeout;                  /* local ACK timeout of the QP */
+    int retry_cnt;                /* transport retries of the QP */
+    int rnr_retry;                /* RNR retries of the QP */
+    uint32_t msg_size;            /* size of a message slot, the largest message sent or received */
+    int msg_depth;                /* message slots in the receive ring */
 };
 
 /* structure to exchange data which is needed to connect the QPs */
@@ -47,37 +134,336 @@ struct cm_con_data_t
     uint32_t qp_num;              /* QP number */
     uint16_t lid;                 /* LID of the IB port */
     uint8_t gid[16];              /* gid */
+    uint64_t size;                /* Buffer size */
+    uint8_t flags;                /* CM_FLAG_* options both sides must agree on */
+    uint8_t mtu;                  /* highest path MTU supported, enum ibv_mtu */
+    uint8_t rd_atom;              /* RDMA reads and atomics accepted in flight as responder */
+    uint8_t init_rd_atom;         /* RDMA reads and atomics kept in flight as initiator */
+    uint32_t msg_size;            /* message slot size */
+    uint32_t msg_depth;           /* message slots in the receive ring */
+} __attribute__ ((packed));
+
+/* operation of a batch posted with post_batch */
+struct batch_op
+{
+    int opcode;                   /* IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ or an atomic opcode */
+    struct ibv_sge sge;           /* local memory, the 8-byte result of an atomic */
+    uint64_t remote_addr;         /* remote address of the operation */
+    uint32_t rkey;                /* rkey of the remote memory */
+    uint64_t compare_add;         /* value to add, or value to compare with */
+    uint64_t swap;                /* value to store if the comparison succeeds */
+};
+
+/* message waiting in a receive slot */
+struct msg_entry
+{
+    uint64_t wr_id;               /* wr_id of the receive holding the message */
+    uint32_t len;                 /* message length in bytes */
+};
+
+/* header placed in front of every message framed in the registered buffer */
+struct msg_hdr
+{
+    uint32_t len;                 /* payload length in bytes, network order */
+    uint32_t seq;                 /* sender sequence number, network order */
 } __attribute__ ((packed));
 
+struct resources;
+
+/* entry of the completion dispatch table */
+struct cq_entry
+{
+    uint32_t qp_num;              /* QP number */
+    struct resources *res;        /* connection owning the QP, NULL for a free slot */
+};
+
+/* completion queue, private to a connection or shared by connections on one device */
+struct comp_queue
+{
+    struct ibv_context *ib_ctx;           /* device the CQ belongs to */
+    struct ibv_cq *cq;                    /* CQ handle */
+    struct ibv_comp_channel *channel;     /* completion channel of cq, NULL when only polling */
+    struct rdma_device *dev;              /* device reference held by the queue, NULL if ib_ctx is the creator's */
+    int cqe;                              /* current CQ size */
+    int max_cqe;                          /* device limit on the CQ size */
+    int reserved;                         /* CQ entries reserved by attached connections */
+    int refcnt;                           /* references held by the creator and attached connections */
+    int polling;                          /* a thread is driving the CQ */
+    pthread_mutex_t lock;                 /* protects the queue and the counters of attached connections */
+    pthread_cond_t cond;                  /* broadcast when completions were dispatched */
+    struct cq_entry *table;               /* attached connections, open addressed by QP number */
+    uint32_t table_size;                  /* slots in table, a power of two */
+    uint32_t table_used;                  /* attached connections */
+};
+
+struct pool_slab;
+
+/* registered memory block borrowed from a memory pool */
+struct pool_block
+{
+    char *addr;                           /* start of the block */
+    size_t size;                          /* block size, at least the size requested */
+    struct ibv_mr *mr;                    /* memory region covering the block */
+    struct pool_slab *slab;               /* slab the block was carved from */
+    struct pool_block *next;              /* next free block of the class */
+    int cls;                              /* size class, POOL_CLASSES for an oversized block */
+};
+
+/* registered memory carved into blocks of one size class */
+struct pool_slab
+{
+    char *mem;                            /* memory of the slab, mapped anonymously */
+    size_t size;                          /* bytes mapped and registered */
+    struct ibv_mr *mr;                    /* memory region covering mem */
+    int nblocks;                          /* blocks in the slab */
+    int used;                             /* blocks borrowed */
+    int exclusive;                        /* the slab holds a single block whose rkey peers get */
+    struct pool_block *blocks;            /* the blocks */
+    struct pool_slab *next;               /* next slab of the class */
+};
+
+/* occupancy of a size class */
+struct pool_class_stats
+{
+    uint64_t block_size;                  /* block size, 0 for oversized blocks */
+    uint64_t in_use;                      /* blocks borrowed */
+    uint64_t free;                        /* blocks ready to be borrowed */
+    uint64_t slabs;                       /* slabs allocated */
+    uint64_t registered_bytes;            /* bytes pinned by the slabs */
+    uint64_t gets;                        /* blocks requested */
+    uint64_t misses;                      /* requests that had to register a new slab */
+};
+
+struct pool_class
+{
+    size_t size;                          /* block size */
+    struct pool_block *free[2];           /* free blocks of packed and exclusive slabs */
+    struct pool_slab *slabs;              /* slabs of the class */
+    struct pool_class_stats stats;        /* occupancy */
+};
+
+/* how registered memory is placed, set before devices are opened */
+struct mem_placement
+{
+    size_t page_size;                     /* hugepage size backing slabs, 0 for regular pages */
+    int numa_local;                       /* prefer the NUMA node of the device for slabs */
+};
+
+/* registered memory shared by the connections and operations on a PD */
+struct mem_pool
+{
+    struct ibv_pd *pd;                    /* PD the slabs are registered with */
+    int numa_node;                        /* NUMA node of the device, -1 if unknown */
+    int mr_flags;                         /* access flags slabs are registered with */
+    pthread_mutex_t lock;                 /* protects the classes */
+    struct pool_class classes[POOL_CLASSES + 1]; /* size classes, the last one for oversized blocks */
+};
+
+/* receive slot of a shared receive queue */
+struct srq_slot
+{
+    char *addr;                           /* start of the slot */
+    uint32_t lkey;                        /* local key of the memory region covering it */
+};
+
+/* slots added to a shared receive queue at once */
+struct srq_chunk
+{
+    struct pool_block *block;             /* registered memory of the slots */
+    struct srq_slot *slots;               /* the slots */
+    struct srq_chunk *next;               /* previously added chunk */
+};
+
+/* receive queue shared by the QPs of connections on one PD */
+struct shared_rq
+{
+    struct rdma_device *dev;              /* device reference held by the queue */
+    struct ibv_srq *srq;                  /* SRQ handle */
+    uint32_t msg_size;                    /* size of a receive slot */
+    int chunk;                            /* slots added on every refill */
+    int slots;                            /* slots allocated and posted */
+    int max_slots;                        /* most slots the queue grows to */
+    int limit;                            /* low watermark that triggers a refill */
+    int refills;                          /* refills done on reaching the watermark */
+    int refcnt;                           /* references held by the creator and connections */
+    pthread_mutex_t lock;                 /* protects the chunks and counters */
+    struct srq_chunk *chunks;             /* slot memory, newest first */
+};
+
+/* memory region advertised to the remote side, in host order */
+struct region_desc
+{
+    char name[REGION_NAME_LEN];           /* NUL-terminated name */
+    uint64_t addr;                        /* start of the region */
+    uint64_t length;                      /* size of the region in bytes */
+    uint32_t rkey;                        /* remote key of the region */
+    uint32_t access;                      /* REGION_* operations the remote side may perform */
+};
+
+/* registered memory of a region created on the local side */
+struct mem_region
+{
+    struct rdma_device *dev;              /* device reference held by the region */
+    char *addr;                           /* memory of the region, mapped through the pool */
+    size_t mapped;                        /* bytes mapped */
+    struct ibv_mr *mr;                    /* MR with the access flags of the region */
+    struct region_desc desc;              /* description advertised to the remote side */
+};
+
+/* opened device context and a PD on it, cached by device name and IB port */
+struct rdma_device
+{
+    char name[IBV_SYSFS_NAME_MAX];        /* device name */
+    int ib_port;                          /* IB port port_attr was queried for */
+    int any_name;                         /* opened for lookups that do not name a device */
+    struct ibv_context *ib_ctx;           /* device handle */
+    struct ibv_pd *pd;                    /* PD handle */
+    struct mem_pool *pool;                /* registered memory on pd */
+    struct ibv_device_attr device_attr;   /* Device attributes */
+    struct ibv_port_attr port_attr;       /* IB port attributes */
+    int numa_node;                        /* NUMA node the device is attached to, -1 if unknown */
+    cpu_set_t local_cpus;                 /* CPUs on that node, empty if unknown */
+    pthread_t events;                     /* thread handling asynchronous events */
+    int watching;                         /* events was started */
+    int stop;                             /* tells events to exit */
+    int refcnt;                           /* references held by connections and queues */
+    struct rdma_device *next;             /* next cached device */
+};
+
 /* structure of system resources */
 struct resources
 {
     struct ibv_device_attr device_attr;   /* Device attributes */
     struct ibv_port_attr port_attr;       /* IB port attributes */
+    struct config_t cfg;                  /* connection parameters, defaults copied from config */
     struct cm_con_data_t remote_props;    /* values to connect to remote side */
+    int path_mtu;                         /* negotiated path MTU, enum ibv_mtu */
+    int max_rd_atomic;                    /* negotiated reads and atomics in flight as initiator */
+    int max_dest_rd_atomic;               /* negotiated reads and atomics in flight as responder */
     struct ibv_context *ib_ctx;           /* device handle */
     struct ibv_pd *pd;                    /* PD handle */
-    struct ibv_cq *cq;                    /* CQ handle */
+    struct rdma_device *dev;              /* cached device providing ib_ctx and pd */
+    struct comp_queue *cq;                /* completion queue, shared if set before resources_create */
+    int shared_cq;                        /* cq was supplied by the caller */
+    struct shared_rq *srq;                /* shared receive queue replacing the receive ring if set */
     struct ibv_qp *qp;                    /* QP handle */
+    int warm;                             /* qp is in INIT with its receive ring posted, see qp_warm */
     struct ibv_mr *mr;                    /* MR handle for buf */
     char *buf;                            /* memory buffer pointer, used for RDMA and send ops */
-    int sock;                             /* TCP socket file descriptor */
+    struct pool_block *block;             /* pool block providing buf and mr */
+    int sock;                             /* TCP socket file descriptor, already connected if set before resources_create */
+    struct rdma_event_channel *cm_events; /* RDMA CM event channel of cm_id */
+    struct rdma_cm_id *cm_id;             /* RDMA CM connection, resolved before resources_create */
+    struct cm_con_data_t cm_request;      /* connection data of a client received with its CM connect request */
+    uint32_t send_seq;                    /* sequence number of the last staged frame */
+    uint32_t recv_seq;                    /* sequence number of the last frame read */
+    int notify;                           /* signal frames over the QP instead of the TCP socket */
+    uint32_t credits;                     /* free frame slots in the remote receive area */
+    uint32_t arrived;                     /* frames landed in the local receive area */
+    int send_depth;                       /* send queue depth, MAX_SEND_WR if 0 */
+    int recv_depth;                       /* receives outstanding at once, cfg.msg_depth + CTRL_RECV_DEPTH */
+    int cq_depth;                         /* CQ depth, at least send_depth + recv_depth */
+    uint32_t max_inline;                  /* largest payload the QP sends inline */
+    int max_send_sge;                     /* SGEs per send work request */
+    int max_read_sge;                     /* SGEs per RDMA read work request */
+    struct pool_block *msg_block;         /* recv_depth receive slots, unless srq is set, and one send slot */
+    char *send_slot;                      /* slot long messages are staged in */
+    uint32_t msg_credits;                 /* free message slots in the remote receive ring */
+    uint32_t msg_owed;                    /* message slots reposted but not yet returned to the remote side */
+    uint32_t msg_ready;                   /* messages waiting in msg_queue */
+    uint32_t msg_head;                    /* next message to hand out */
+    uint32_t msg_tail;                    /* next free entry of msg_queue */
+    struct msg_entry *msg_queue;          /* received messages in arrival order, recv_depth entries */
+    uint32_t sync_done;                   /* completed synchronous send requests */
+    uint64_t async_posted;                /* wr_id of the last posted asynchronous operation */
+    uint64_t async_done;                  /* wr_id of the last completed asynchronous operation */
+    uint64_t async_error;                 /* wr_id of the first failed asynchronous operation */
+    int failed;                           /* a work request of the connection completed in error */
+    int last_wqe;                         /* the QP consumes no more receives of srq, set by the device's event thread */
+    int blocking;                         /* give a private CQ a completion channel to sleep on */
+    int spin_usec;                        /* how long to poll before sleeping */
+    int timeout_msec;                     /* completion timeout, MAX_POLL_CQ_TIMEOUT if 0 */
+    uint64_t sync_post_ns;                /* post time of the synchronous send request in progress */
+    uint64_t *async_post_ns;              /* post times of asynchronous operations by wr_id % send_depth */
+    struct conn_stats stats;              /* performance counters */
 };
 
 extern struct config_t config;
+extern struct mem_placement mem_placement;
 
 int sock_connect(const char *servername, int port);
+int sock_listen(int port);
+int sock_accept(int listenfd);
+void sock_shutdown(int sock);
 int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data);
+struct rdma_device *device_get(const char *dev_name, int ib_port);
+void device_hold(struct rdma_device *dev);
+int device_put(struct rdma_device *dev);
+int device_pin_thread(struct rdma_device *dev);
+int device_watch(struct rdma_device *dev);
+struct shared_rq *shared_rq_open(const char *dev_name, int ib_port, int slots, int max_slots, uint32_t msg_size);
+void shared_rq_hold(struct shared_rq *q);
+int shared_rq_put(struct shared_rq *q);
+int shared_rq_post(struct shared_rq *q, struct srq_slot *slot);
+void shared_rq_limit_reached(struct shared_rq *q);
+int shared_rq_slots(struct shared_rq *q, int *refills);
+struct mem_region *region_create(struct rdma_device *dev, const char *name, size_t size, uint32_t access);
+int region_destroy(struct mem_region *r);
+int region_sync(int sock, struct region_desc *local, int n_local, struct region_desc *remote, int *n_remote);
+struct mem_pool *mem_pool_create(struct ibv_pd *pd, int numa_node, int mr_flags);
+int mem_pool_destroy(struct mem_pool *pool);
+char *pool_map(struct mem_pool *pool, size_t size, size_t *mapped);
+struct pool_block *pool_get(struct mem_pool *pool, size_t size, int exclusive);
+void pool_put(struct mem_pool *pool, struct pool_block *blk);
+size_t pool_trim(struct mem_pool *pool);
+void pool_stats(struct mem_pool *pool, struct pool_class_stats *out);
+struct comp_queue *comp_queue_create(struct ibv_context *ib_ctx, int cqe, int blocking);
+struct comp_queue *comp_queue_open(const char *dev_name, int ib_port, int cqe, int blocking);
+void comp_queue_hold(struct comp_queue *q);
+int comp_queue_put(struct comp_queue *q);
+int comp_queue_attach(struct comp_queue *q, struct resources *res, int cqe);
+void comp_queue_detach(struct comp_queue *q, struct resources *res, int cqe);
+int comp_queue_drain(struct comp_queue *q);
+int comp_queue_poll(struct comp_queue *q);
+int process_wc(struct resources *res, struct ibv_wc *wc);
 int poll_completion(struct resources *res);
-int post_send(struct resources *res, int opcode);
-int post_receive(struct resources *res);
+int post_send(struct resources *res, int opcode, size_t offset, size_t length);
+void frame_stage(struct resources *res, uint32_t len);
+int frame_read(struct resources *res, uint32_t *len);
+int frame_push(struct resources *res, uint32_t len);
+int frame_pop(struct resources *res, uint32_t *len);
+int frame_release(struct resources *res);
+int post_receive(struct resources *res, uint32_t slot);
+int msg_send(struct resources *res, const void *data, uint32_t len);
+int msg_post(struct resources *res, const void *data, uint32_t len, uint64_t *wr_id);
+int msg_recv(struct resources *res, char **data, uint32_t *len, uint64_t *slot);
+int msg_wait(struct resources *res, char **data, uint32_t *len, uint64_t *slot);
+int msg_release(struct resources *res, uint64_t slot);
+int post_async(struct resources *res, int opcode, size_t offset, size_t length, uint64_t *wr_id);
+int post_async_sge(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+                   size_t remote_offset, uint64_t *wr_id);
+int post_async_region(struct resources *res, int opcode, struct ibv_sge *sg_list, int num_sge,
+                      const struct region_desc *region, size_t remote_offset, uint64_t *wr_id);
+int post_batch(struct resources *res, struct batch_op *ops, int n, int signal_every, uint64_t *wr_id);
+int poll_async(struct resources *res, uint64_t wr_id, int timeout_msec);
+int test_async(struct resources *res, uint64_t wr_id);
 void resources_init(struct resources *res);
 int resources_create(struct resources *res);
-int modify_qp_to_init(struct ibv_qp *qp);
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid);
-int modify_qp_to_rts(struct ibv_qp *qp);
+int resources_build(struct resources *res);
+int modify_qp_to_init(struct resources *res);
+int modify_qp_to_rtr(struct resources *res, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid);
+int modify_qp_to_rts(struct resources *res);
+void con_data_local(struct resources *res, struct cm_con_data_t *con_data);
+int con_data_remote(struct resources *res, const struct cm_con_data_t *local, const struct cm_con_data_t *wire);
+int post_receives(struct resources *res);
+int qp_warm(struct resources *res);
 int connect_qp(struct resources *res);
+int resources_recycle(struct resources *res);
+int cm_resolve(struct resources *res);
+int cm_connect_qp(struct resources *res);
+void cm_destroy(struct resources *res);
 int resources_destroy(struct resources *res);
+void stats_snapshot(struct resources *res, struct conn_stats *out);
 void print_config(void);
 void usage(const char *argv0);
 int receive_message(struct resources *res, const char *entity);
@@ -0,0 +1,200 @@
+#include <rdma_operations.h>
+
+/******************************************************************************
+Memory region operations
+Besides its connection buffer, each side of a connection can create named
+regions of registered memory and advertise them to the remote side, which
+then reads and writes them at any offset with one-sided operations. Every
+region has a memory region of its own, registered with only the access
+flags the region grants, so its rkey reaches nothing beyond it.
+******************************************************************************/
+/******************************************************************************
+ * Function: region_create
+ *
+ * Input
+ * dev device to register the memory on
+ * name name the region is advertised under
+ * size size of the region in bytes
+ * access REGION_* operations the remote side may perform
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new region, NULL on failure
+ *
+ * Description
+ * Map memory placed like the pool's slabs and register it once, with only the
+ * access flags of the region. Pool blocks are not used since their slabs are
+ * already registered with the pool's broader flags. The region holds a
+ * reference to the device.
+ ******************************************************************************/
+struct mem_region *region_create(struct rdma_device *dev, const char *name, size_t size, uint32_t access)
+{
+	struct mem_region *r;
+	int mr_flags = IBV_ACCESS_LOCAL_WRITE;
+
+	if (access & REGION_READ)
+		mr_flags |= IBV_ACCESS_REMOTE_READ;
+	if (access & REGION_WRITE)
+		mr_flags |= IBV_ACCESS_REMOTE_WRITE;
+	if (access & REGION_ATOMIC)
+	{
+		if (dev->device_attr.atomic_cap == IBV_ATOMIC_NONE)
+		{
+			log_error("device %s does not support atomic operations\n", dev->name);
+			return NULL;
+		}
+		mr_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+	{
+		log_error("failed to allocate region\n");
+		return NULL;
+	}
+	device_hold(dev);
+	r->dev = dev;
+	r->addr = pool_map(dev->pool, size, &r->mapped);
+	if (!r->addr)
+	{
+		log_error("failed to map %zu bytes of memory for region %s\n", size, name);
+		goto region_create_exit;
+	}
+	r->mr = ibv_reg_mr(dev->pd, r->addr, size, mr_flags);
+	if (!r->mr)
+	{
+		log_error("ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+		goto region_create_exit;
+	}
+	strncpy(r->desc.name, name, REGION_NAME_LEN - 1);
+	r->desc.addr = (uintptr_t)r->addr;
+	r->desc.length = size;
+	r->desc.rkey = r->mr->rkey;
+	r->desc.access = access;
+	log_info("region %s was registered with addr=%p, size=%zu, rkey=0x%x, flags=0x%x\n", r->desc.name,
+			 r->addr, size, r->mr->rkey, mr_flags);
+	return r;
+
+region_create_exit:
+	region_destroy(r);
+	return NULL;
+}
+/******************************************************************************
+ * Function: region_destroy
+ *
+ * Input
+ * r region
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Deregister the region and unmap its memory. The remote side must no longer
+ * access it.
+ ******************************************************************************/
+int region_destroy(struct mem_region *r)
+{
+	int rc = 0;
+
+	if (r->mr && ibv_dereg_mr(r->mr))
+	{
+		log_error("failed to deregister MR of region %s\n", r->desc.name);
+		rc = 1;
+	}
+	if (r->addr)
+		munmap(r->addr, r->mapped);
+	if (device_put(r->dev))
+		rc = 1;
+	free(r);
+	return rc;
+}
+/******************************************************************************
+ * Function: region_sync
+ *
+ * Input
+ * sock socket connected to the remote side
+ * local regions to advertise
+ * n_local number of entries in local
+ *
+ * Output
+ * remote regions advertised by the remote side, room for MAX_REGIONS entries
+ * n_remote number of entries in remote
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Exchange region tables with the remote side, which must call region_sync
+ * at the same point. Like sock_sync_data, both sides write before reading;
+ * MAX_REGIONS keeps a table within what the socket buffers.
+ ******************************************************************************/
+int region_sync(int sock, struct region_desc *local, int n_local, struct region_desc *remote, int *n_remote)
+{
+	struct region_desc wire[MAX_REGIONS];
+	uint32_t local_count = htonl(n_local);
+	uint32_t remote_count;
+	size_t size;
+	size_t total = 0;
+	ssize_t n;
+	int i;
+
+	if (n_local > MAX_REGIONS)
+	{
+		log_error("%d regions exceed the maximum of %d\n", n_local, MAX_REGIONS);
+		return 1;
+	}
+	if (sock_sync_data(sock, sizeof(local_count), (char *)&local_count, (char *)&remote_count) < 0)
+	{
+		log_error("failed to exchange region count\n");
+		return 1;
+	}
+	remote_count = ntohl(remote_count);
+	if (remote_count > MAX_REGIONS)
+	{
+		log_error("remote side advertises %u regions, more than the maximum of %d\n", remote_count, MAX_REGIONS);
+		return 1;
+	}
+
+	for (i = 0; i < n_local; i++)
+	{
+		wire[i] = local[i];
+		wire[i].name[REGION_NAME_LEN - 1] = '\0';
+		wire[i].addr = htonll(local[i].addr);
+		wire[i].length = htonll(local[i].length);
+		wire[i].rkey = htonl(local[i].rkey);
+		wire[i].access = htonl(local[i].access);
+	}
+	size = n_local * sizeof(*wire);
+	if (size && write(sock, wire, size) < (ssize_t)size)
+	{
+		log_error("failed writing region table\n");
+		return 1;
+	}
+
+	size = remote_count * sizeof(*remote);
+	while (total < size)
+	{
+		n = read(sock, (char *)remote + total, size - total);
+		if (n <= 0)
+		{
+			log_error("failed reading region table\n");
+			return 1;
+		}
+		total += n;
+	}
+	for (i = 0; i < (int)remote_count; i++)
+	{
+		remote[i].name[REGION_NAME_LEN - 1] = '\0';
+		remote[i].addr = ntohll(remote[i].addr);
+		remote[i].length = ntohll(remote[i].length);
+		remote[i].rkey = ntohl(remote[i].rkey);
+		remote[i].access = ntohl(remote[i].access);
+	}
+	*n_remote = remote_count;
+	return 0;
+}
@@ -0,0 +1,296 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// RegionAccess is a set of operations the remote peer may perform on a Region.
+type RegionAccess int
+
+const (
+	RegionRead   RegionAccess = C.REGION_READ
+	RegionWrite  RegionAccess = C.REGION_WRITE
+	RegionAtomic RegionAccess = C.REGION_ATOMIC
+)
+
+// Region is a named range of registered memory that the remote peer of a connection can
+// read and write at any offset, without involving this side.
+//
+// Each region is registered on its own with just the access it grants, so the key the
+// peer receives for it reaches no other memory. Regions are advertised to the peer with
+// ExchangeRegions and stay registered until the connection is destroyed.
+type Region struct {
+	Name   string
+	Access RegionAccess
+	r      *C.struct_mem_region
+	size   int
+}
+
+// RemoteRegion describes a region advertised by the remote peer.
+type RemoteRegion struct {
+	Name   string
+	Length int
+	Access RegionAccess
+}
+
+// RegisterRegion creates a zeroed region of `size` bytes of registered memory named
+// `name`, which the remote peer may access as `access` allows once it was advertised
+// with ExchangeRegions. Names are unique per connection and at most 31 bytes long.
+//
+// On success, it returns the region and nil error. On failure, it returns nil and the
+// error encountered.
+//
+// Example:
+//
+//	counters, err := res.RegisterRegion("counters", 4096, rdmahandler.RegionRead|rdmahandler.RegionWrite)
+//	if err != nil {
+//	    log.Fatalf("Failed to register region: %v", err)
+//	}
+//	if err := h.ExchangeRegions(res, "server"); err != nil {
+//	    log.Fatalf("Failed to advertise regions: %v", err)
+//	}
+func (res *RDMAResources) RegisterRegion(name string, size int, access RegionAccess) (*Region, error) {
+	if name == "" || len(name) >= C.REGION_NAME_LEN {
+		return nil, fmt.Errorf("invalid region name %q", name)
+	}
+	if size <= 0 {
+		return nil, fmt.Errorf("invalid region size %d", size)
+	}
+	if access&^(RegionRead|RegionWrite|RegionAtomic) != 0 {
+		return nil, fmt.Errorf("invalid region access %#x", int(access))
+	}
+	if len(res.regions) >= C.MAX_REGIONS {
+		return nil, fmt.Errorf("connection already has %d regions", len(res.regions))
+	}
+	for _, r := range res.regions {
+		if r.Name == name {
+			return nil, fmt.Errorf("region %q already exists", name)
+		}
+	}
+
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	r := C.region_create(res.res.dev, cname, C.size_t(size), C.uint32_t(access))
+	if r == nil {
+		return nil, fmt.Errorf("failed to register region %q of %d bytes", name, size)
+	}
+	region := &Region{Name: name, Access: access, r: r, size: size}
+	res.regions = append(res.regions, region)
+	return region, nil
+}
+
+// Bytes returns the memory of the region. The peer may change it at any time as the
+// region's access allows, so the caller coordinates with the peer before relying on it.
+func (r *Region) Bytes() []byte {
+	return unsafe.Slice((*byte)(unsafe.Pointer(r.r.addr)), r.size)
+}
+
+// ExchangeRegions advertises the regions registered on the connection to the remote peer
+// and learns about the peer's, replacing what an earlier exchange advertised. Both peers
+// must call it at the same point, typically once right after connecting and again after
+// registering further regions.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+func (h *RDMAHandler) ExchangeRegions(res *RDMAResources, character string) error {
+	var local, remote [C.MAX_REGIONS]C.struct_region_desc
+	var n C.int
+
+	if res.res.sock < 0 {
+		return fmt.Errorf("%s: no TCP socket to exchange regions over", character)
+	}
+	for i, r := range res.regions {
+		local[i] = r.r.desc
+	}
+	if C.region_sync(res.res.sock, &local[0], C.int(len(res.regions)), &remote[0], &n) != 0 {
+		return fmt.Errorf("%s: failed to exchange regions", character)
+	}
+	res.remote = append([]C.struct_region_desc(nil), remote[:n]...)
+	return nil
+}
+
+// RemoteRegions returns the regions the remote peer advertised in the last exchange.
+func (res *RDMAResources) RemoteRegions() []RemoteRegion {
+	regions := make([]RemoteRegion, len(res.remote))
+	for i := range res.remote {
+		d := &res.remote[i]
+		regions[i] = RemoteRegion{Name: C.GoString(&d.name[0]), Length: int(d.length), Access: RegionAccess(d.access)}
+	}
+	return regions
+}
+
+// ReadAt reads len(dst) bytes at `offset` in the remote peer's connection buffer into
+// `dst`, transferring only those bytes.
+//
+// Unlike Read, no framing or synchronization with the peer takes place, so the remote
+// memory serves as addressable storage; the range is checked before anything is posted,
+// since an access beyond the peer's memory would break the connection. The data passes
+// through a block borrowed from the memory pool, leaving the connection buffer alone.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+//
+// Example:
+//
+//	var hdr [16]byte
+//	if err := h.ReadAt(clientRes, hdr[:], 4096, "client"); err != nil {
+//	    log.Fatalf("RDMA read failed: %v", err)
+//	}
+func (h *RDMAHandler) ReadAt(res *RDMAResources, dst []byte, offset int, character string) error {
+	return h.ReadRegionAt(res, "", dst, offset, character)
+}
+
+// WriteAt writes `src` to `offset` in the remote peer's connection buffer, transferring
+// only those bytes. See ReadAt.
+func (h *RDMAHandler) WriteAt(res *RDMAResources, src []byte, offset int, character string) error {
+	return h.WriteRegionAt(res, "", src, offset, character)
+}
+
+// ReadRegionAt reads len(dst) bytes at `offset` in the region named `region` advertised
+// by the remote peer into `dst`. The empty name refers to the peer's connection buffer.
+// It is otherwise like ReadAt.
+func (h *RDMAHandler) ReadRegionAt(res *RDMAResources, region string, dst []byte, offset int, character string) error {
+	return regionIO(res, C.IBV_WR_RDMA_READ, region, dst, offset, character)
+}
+
+// WriteRegionAt writes `src` to `offset` in the region named `region` advertised by the
+// remote peer. The empty name refers to the peer's connection buffer. It is otherwise
+// like WriteAt.
+func (h *RDMAHandler) WriteRegionAt(res *RDMAResources, region string, src []byte, offset int, character string) error {
+	return regionIO(res, C.IBV_WR_RDMA_WRITE, region, src, offset, character)
+}
+
+// ReadRegionAsync starts an RDMA read of consecutive bytes at `offset` in the remote
+// region named `region` into `segs`, without staging them. It is otherwise like
+// ReadVAsync.
+func (h *RDMAHandler) ReadRegionAsync(res *RDMAResources, region string, offset int, segs []Segment, character string) (*Completion, error) {
+	return postRegionSegments(res, C.IBV_WR_RDMA_READ, region, segs, offset, character)
+}
+
+// WriteRegionAsync starts an RDMA write of `segs` to consecutive bytes at `offset` in the
+// remote region named `region`, without staging them. It is otherwise like WriteVAsync.
+func (h *RDMAHandler) WriteRegionAsync(res *RDMAResources, region string, offset int, segs []Segment, character string) (*Completion, error) {
+	return postRegionSegments(res, C.IBV_WR_RDMA_WRITE, region, segs, offset, character)
+}
+
+// regionIO transfers `p` to or from `offset` in a remote region through a pool block.
+func regionIO(res *RDMAResources, opcode C.int, region string, p []byte, offset int, character string) error {
+	if len(p) == 0 {
+		_, err := res.remoteRegion(opcode, region, offset, 0)
+		if err != nil {
+			return fmt.Errorf("%s: %v", character, err)
+		}
+		return nil
+	}
+	buf, err := res.Borrow(len(p))
+	if err != nil {
+		return fmt.Errorf("%s: %v", character, err)
+	}
+	defer buf.Release()
+	if opcode == C.IBV_WR_RDMA_WRITE {
+		copy(buf.Bytes(), p)
+	}
+	c, err := postRegionSegments(res, opcode, region, []Segment{{Buf: buf, Length: len(p)}}, offset, character)
+	if err != nil {
+		return err
+	}
+	if err := c.Wait(); err != nil {
+		return err
+	}
+	if opcode == C.IBV_WR_RDMA_READ {
+		copy(p, buf.Bytes())
+	}
+	return nil
+}
+
+// postRegionSegments posts an asynchronous operation between `segs` and consecutive bytes
+// at `offset` in a remote region.
+func postRegionSegments(res *RDMAResources, opcode C.int, region string, segs []Segment, offset int, character string) (*Completion, error) {
+	length := 0
+	for _, s := range segs {
+		length += s.Length
+	}
+	desc, err := res.remoteRegion(opcode, region, offset, length)
+	if err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	return postAsyncSegments(res, opcode, segs, desc, offset, character)
+}
+
+// remoteRegion looks up the remote region named `name`, nil for the connection buffer,
+// and verifies that `opcode` may access `length` bytes at `offset` in it.
+func (res *RDMAResources) remoteRegion(opcode C.int, name string, offset int, length int) (*C.struct_region_desc, error) {
+	if name == "" {
+		return nil, res.checkRange(offset, length)
+	}
+	for i := range res.remote {
+		d := &res.remote[i]
+		if C.GoString(&d.name[0]) != name {
+			continue
+		}
+		r := RemoteRegion{Name: name, Length: int(d.length), Access: RegionAccess(d.access)}
+		if err := r.check(opcodeAccess(opcode), offset, length); err != nil {
+			return nil, err
+		}
+		return d, nil
+	}
+	return nil, fmt.Errorf("remote peer advertised no region %q", name)
+}
+
+// opcodeAccess returns the access to a region that an operation with `opcode` needs.
+func opcodeAccess(opcode C.int) RegionAccess {
+	switch opcode {
+	case C.IBV_WR_RDMA_READ:
+		return RegionRead
+	case C.IBV_WR_ATOMIC_FETCH_AND_ADD, C.IBV_WR_ATOMIC_CMP_AND_SWP:
+		return RegionAtomic
+	}
+	return RegionWrite
+}
+
+// check verifies that the region grants `need` and holds `length` bytes at `offset`.
+func (r RemoteRegion) check(need RegionAccess, offset int, length int) error {
+	if r.Access&need == 0 {
+		return fmt.Errorf("region %q does not grant the access", r.Name)
+	}
+	if offset < 0 || length < 0 || offset+length > r.Length {
+		return fmt.Errorf("range [%d, %d) exceeds region %q of %d bytes", offset, offset+length, r.Name, r.Length)
+	}
+	return nil
+}
+
+// dropRegion deregisters a region that was never handed to the caller and forgets it,
+// so that its name can be registered again. Failures are logged by region_destroy.
+func (res *RDMAResources) dropRegion(region *Region) {
+	for i, r := range res.regions {
+		if r == region {
+			res.regions = append(res.regions[:i], res.regions[i+1:]...)
+			break
+		}
+	}
+	C.region_destroy(region.r)
+	region.r = nil
+}
+
+// destroyRegions deregisters the regions of a connection whose QP is gone.
+func (res *RDMAResources) destroyRegions() error {
+	var err error
+	for _, r := range res.regions {
+		if C.region_destroy(r.r) != 0 {
+			err = fmt.Errorf("failed to destroy region %q", r.Name)
+		}
+		r.r = nil
+	}
+	res.regions = nil
+	res.remote = nil
+	return err
+}
@@ -0,0 +1,63 @@
+package rdmahandler
+
+import "testing"
+
+func TestRemoteRegionCheck(t *testing.T) {
+	rw := RemoteRegion{Name: "data", Length: 4096, Access: RegionRead | RegionWrite}
+	atomic := RemoteRegion{Name: "counters", Length: 64, Access: RegionAtomic}
+	tests := []struct {
+		name    string
+		region  RemoteRegion
+		need    RegionAccess
+		offset  int
+		length  int
+		wantErr bool
+	}{
+		{"read", rw, RegionRead, 0, 4096, false},
+		{"write at the end", rw, RegionWrite, 4000, 96, false},
+		{"empty at the end", rw, RegionWrite, 4096, 0, false},
+		{"past the end", rw, RegionRead, 4000, 97, true},
+		{"beyond the end", rw, RegionRead, 4097, 0, true},
+		{"negative offset", rw, RegionRead, -8, 8, true},
+		{"negative length", rw, RegionWrite, 8, -1, true},
+		{"atomic without access", rw, RegionAtomic, 0, 8, true},
+		{"atomic", atomic, RegionAtomic, 56, 8, false},
+		{"read without access", atomic, RegionRead, 0, 8, true},
+		{"write without access", atomic, RegionWrite, 0, 8, true},
+	}
+	for _, tt := range tests {
+		if err := tt.region.check(tt.need, tt.offset, tt.length); (err != nil) != tt.wantErr {
+			t.Errorf("%s: check(%d, %d, %d) = %v, want error %v", tt.name, tt.need, tt.offset, tt.length, err, tt.wantErr)
+		}
+	}
+}
+
+func TestRemoteRegionConnectionBuffer(t *testing.T) {
+	res, err := newResources(&RDMAHandler{}, Options{BufferSize: 8192})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer freeResources(res)
+
+	tests := []struct {
+		name    string
+		region  string
+		offset  int
+		length  int
+		wantErr bool
+	}{
+		{"whole buffer", "", 0, 8192, false},
+		{"tail", "", 8000, 192, false},
+		{"past the end", "", 8000, 193, true},
+		{"negative offset", "", -1, 1, true},
+		{"negative length", "", 0, -1, true},
+		{"unknown region", "data", 0, 8, true},
+	}
+	for _, tt := range tests {
+		desc, err := res.remoteRegion(0, tt.region, tt.offset, tt.length)
+		if (err != nil) != tt.wantErr || desc != nil {
+			t.Errorf("%s: remoteRegion(%q, %d, %d) = %v, %v, want error %v", tt.name, tt.region, tt.offset, tt.length,
+				desc, err, tt.wantErr)
+		}
+	}
+}
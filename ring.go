@@ -0,0 +1,334 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"runtime"
+	"sync/atomic"
+	"time"
+	"unsafe"
+)
+
+// Records of a ring start with a header of the payload length and the sequence number,
+// in one 64-bit word, and the sender's read position of the reverse ring. The payload,
+// padded to 8 bytes, is followed by a trailer repeating the sequence number, and records
+// are padded to 16 bytes, so a wrap marker always fits before the end of the ring.
+const (
+	ringHdrSize     = 16
+	ringTrailerSize = 8
+	ringMinSize     = 256
+	ringWrap        = 0xffffffff // length of the marker sending the reader back to the start
+	ringSpinYield   = 1024       // polls between checks of the deadline
+)
+
+// Ring is a one-to-one message channel over RDMA writes into a ring of the peer's memory,
+// opened with OpenRing. Neither side involves a completion queue or the TCP socket on
+// the receive path: the receiver finds new records by polling its own memory.
+//
+// A ring is not safe for concurrent use; Send and Recv must not run at the same time.
+type Ring struct {
+	res       *RDMAResources
+	character string
+	size      int
+	rx        *Region               // ring the peer writes into, followed by the peer's read position
+	remote    *C.struct_region_desc // the peer's ring
+	tx        *PoolBuffer           // records are staged at their position in the peer's ring
+	ctl       *PoolBuffer           // read position written to the peer
+	txTail    uint64                // bytes written to the peer's ring
+	txSeq     uint32                // sequence number of the last record written
+	peerHead  uint64                // bytes of the peer's ring it is known to have read
+	rxHead    uint64                // bytes read from the local ring
+	rxSeq     uint32                // sequence number of the last record read
+	reported  uint64                // rxHead as last told to the peer
+	last      *Completion           // last record written
+	credit    *Completion           // last read position written
+}
+
+// OpenRing sets up a ring channel named `name` with `size` bytes of ring in each direction.
+// Both peers must call it at the same point with the same name and size. The ring memory
+// is registered as a region and advertised with ExchangeRegions, which OpenRing calls.
+//
+// Send writes every message as a record into the peer's ring with a single RDMA write and
+// returns without waiting for it. The peer's Recv polls the sequence number of the next
+// record in its own memory, so a message is delivered as soon as it lands, with no
+// completion, interrupt or doorbell on the receiving side. Space the receiver has read
+// goes back to the sender as credit: piggybacked on the records it sends the other way,
+// or, when it does not send, with a small RDMA write of its read position once a quarter
+// of the ring was read. Messages may be up to a quarter of the ring long.
+//
+// The payload is in native byte order, so both peers must share it. Rings stay open until
+// the connection is destroyed.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns the ring and nil error. On failure, it returns nil and the error
+// encountered.
+//
+// Example:
+//
+//	ring, err := h.OpenRing(res, "quotes", 1<<20, "client")
+//	if err != nil {
+//	    log.Fatalf("Failed to open ring: %v", err)
+//	}
+//	for q := range quotes {
+//	    if err := ring.Send(q); err != nil {
+//	        log.Fatalf("Ring send failed: %v", err)
+//	    }
+//	}
+func (h *RDMAHandler) OpenRing(res *RDMAResources, name string, size int, character string) (*Ring, error) {
+	if size < ringMinSize || size%16 != 0 {
+		return nil, fmt.Errorf("%s: invalid ring size %d", character, size)
+	}
+	rx, err := res.RegisterRegion(name, size+8, RegionWrite)
+	if err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	r, err := h.openRing(res, name, size, rx, character)
+	if err != nil {
+		res.dropRegion(rx)
+		return nil, err
+	}
+	return r, nil
+}
+
+// openRing finds the peer's side of the ring whose receiving region is `rx` and sets up
+// the buffers of the sending side.
+func (h *RDMAHandler) openRing(res *RDMAResources, name string, size int, rx *Region, character string) (*Ring, error) {
+	if err := h.ExchangeRegions(res, character); err != nil {
+		return nil, err
+	}
+	remote, err := res.remoteRegion(C.IBV_WR_RDMA_WRITE, name, 0, size+8)
+	if err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	if int(remote.length) != size+8 {
+		return nil, fmt.Errorf("%s: ring %q has %d bytes on the remote side", character, name, int(remote.length)-8)
+	}
+
+	r := &Ring{res: res, character: character, size: size, rx: rx, remote: remote}
+	if r.tx, err = res.Borrow(size); err != nil {
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	if r.ctl, err = res.Borrow(8); err != nil {
+		r.tx.Release()
+		return nil, fmt.Errorf("%s: %v", character, err)
+	}
+	return r, nil
+}
+
+// MaxMessage returns the largest message the ring carries.
+func (r *Ring) MaxMessage() int {
+	return (r.size/4 - ringHdrSize - ringTrailerSize) &^ 15
+}
+
+// recordSize returns the size of the record of a `length` byte message.
+func recordSize(length int) int {
+	return (ringHdrSize + (length+7)&^7 + ringTrailerSize + 15) &^ 15
+}
+
+// Send writes `msg` into the peer's ring. It waits for the peer to free space if the ring
+// is full, up to the connection's timeout, but not for the write to complete: a failed
+// write is reported by a later Send. `msg` may be reused as soon as Send returns.
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+func (r *Ring) Send(msg []byte) error {
+	if len(msg) > r.MaxMessage() {
+		return fmt.Errorf("%s: message of %d bytes exceeds ring limit of %d bytes", r.character, len(msg), r.MaxMessage())
+	}
+	if r.last != nil {
+		if done, err := r.last.Test(); done && err != nil {
+			return err
+		}
+	}
+
+	rec := recordSize(len(msg))
+	pos := int(r.txTail % uint64(r.size))
+	if pos+rec > r.size {
+		// not enough room before the end, send the reader back to the start
+		if err := r.waitSpace(r.size - pos); err != nil {
+			return err
+		}
+		r.stage(pos, ringWrap, nil)
+		if err := r.post(pos, ringHdrSize); err != nil {
+			return err
+		}
+		r.txTail += uint64(r.size - pos)
+		pos = 0
+	}
+	if err := r.waitSpace(rec); err != nil {
+		return err
+	}
+	r.stage(pos, uint32(len(msg)), msg)
+	if err := r.post(pos, rec); err != nil {
+		return err
+	}
+	r.txTail += uint64(rec)
+	r.reported = r.rxHead
+	return nil
+}
+
+// Recv waits for the next message in the local ring, up to the connection's timeout, and
+// returns a copy of it.
+//
+// On success, it returns the message and nil error. On failure, it returns nil and the
+// error encountered.
+func (r *Ring) Recv() ([]byte, error) {
+	ring := r.rx.Bytes()
+	timeout := time.Duration(r.res.res.timeout_msec) * time.Millisecond
+	for {
+		seq := nextSeq(r.rxSeq)
+		pos := int(r.rxHead % uint64(r.size))
+		hdr, err := spinFor(word(ring, pos), func(v uint64) bool { return uint32(v>>32) == seq }, timeout)
+		if err != nil {
+			return nil, fmt.Errorf("%s: ring receive %v", r.character, err)
+		}
+		length := uint32(hdr)
+		r.rxSeq = seq
+		if length == ringWrap {
+			clear(ring[pos : pos+ringHdrSize])
+			r.rxHead += uint64(r.size - pos)
+			continue
+		}
+		if int(length) > r.MaxMessage() {
+			return nil, fmt.Errorf("%s: corrupt ring record of %d bytes", r.character, length)
+		}
+		trailer := word(ring, pos+ringHdrSize+(int(length)+7)&^7)
+		if _, err := spinFor(trailer, func(v uint64) bool { return v == uint64(seq) }, timeout); err != nil {
+			return nil, fmt.Errorf("%s: ring receive %v", r.character, err)
+		}
+		if ack := atomic.LoadUint64(word(ring, pos+8)); ack > r.peerHead {
+			r.peerHead = ack
+		}
+		msg := make([]byte, length)
+		copy(msg, ring[pos+ringHdrSize:])
+		// cleared memory cannot be mistaken for a record on the next lap
+		rec := recordSize(int(length))
+		clear(ring[pos : pos+rec])
+		r.rxHead += uint64(rec)
+		if err := r.returnCredit(); err != nil {
+			return nil, err
+		}
+		return msg, nil
+	}
+}
+
+// Close returns the staging memory of the ring to the pool. The ring's region stays
+// registered until the connection is destroyed.
+func (r *Ring) Close() error {
+	var err error
+	if r.last != nil {
+		err = r.last.Wait()
+	}
+	if r.credit != nil {
+		if cerr := r.credit.Wait(); err == nil {
+			err = cerr
+		}
+	}
+	r.tx.Release()
+	r.ctl.Release()
+	return err
+}
+
+// stage builds a record at `pos` in the staging buffer.
+func (r *Ring) stage(pos int, length uint32, msg []byte) {
+	r.txSeq = nextSeq(r.txSeq)
+	buf := r.tx.Bytes()
+	*word(buf, pos) = uint64(r.txSeq)<<32 | uint64(length)
+	*word(buf, pos+8) = r.rxHead
+	if length == ringWrap {
+		return
+	}
+	copy(buf[pos+ringHdrSize:], msg)
+	*word(buf, pos+ringHdrSize+(len(msg)+7)&^7) = uint64(r.txSeq)
+}
+
+// post writes `length` bytes at `pos` of the staging buffer to the same position in the
+// peer's ring.
+func (r *Ring) post(pos int, length int) error {
+	c, err := postAsyncSegments(r.res, C.IBV_WR_RDMA_WRITE, []Segment{{Buf: r.tx, Offset: pos, Length: length}}, r.remote, pos, r.character)
+	if err != nil {
+		return err
+	}
+	r.last = c
+	return nil
+}
+
+// waitSpace waits until the peer's ring has `need` bytes free behind the last record.
+func (r *Ring) waitSpace(need int) error {
+	head := word(r.rx.Bytes(), r.size)
+	if r.txTail+uint64(need)-r.peerHead <= uint64(r.size) {
+		return nil
+	}
+	_, err := spinFor(head, func(v uint64) bool {
+		if v > r.peerHead {
+			r.peerHead = v
+		}
+		return r.txTail+uint64(need)-r.peerHead <= uint64(r.size)
+	}, time.Duration(r.res.res.timeout_msec)*time.Millisecond)
+	if err != nil {
+		return fmt.Errorf("%s: ring full, remote side does not read", r.character)
+	}
+	return nil
+}
+
+// returnCredit writes the read position to the peer once a quarter of the ring was read
+// without telling it with a record.
+func (r *Ring) returnCredit() error {
+	if r.rxHead-r.reported < uint64(r.size/4) {
+		return nil
+	}
+	// the previous position may still be in flight from the same memory
+	if r.credit != nil {
+		if err := r.credit.Wait(); err != nil {
+			return err
+		}
+	}
+	*word(r.ctl.Bytes(), 0) = r.rxHead
+	c, err := postAsyncSegments(r.res, C.IBV_WR_RDMA_WRITE, []Segment{{Buf: r.ctl, Length: 8}}, r.remote, r.size, r.character)
+	if err != nil {
+		return err
+	}
+	r.credit = c
+	r.reported = r.rxHead
+	return nil
+}
+
+// spinFor polls the word `w`, which the peer writes, until `match` accepts its value, and
+// returns the value. The clock is only read once polling took a while, so a word that is
+// already there costs a single load.
+func spinFor(w *uint64, match func(v uint64) bool, timeout time.Duration) (uint64, error) {
+	var deadline time.Time
+	for i := 1; ; i++ {
+		v := atomic.LoadUint64(w)
+		if match(v) {
+			return v, nil
+		}
+		if i%ringSpinYield == 0 {
+			if deadline.IsZero() {
+				deadline = time.Now().Add(timeout)
+			} else if time.Now().After(deadline) {
+				return 0, fmt.Errorf("timed out")
+			}
+			runtime.Gosched()
+		}
+	}
+}
+
+// nextSeq returns the sequence number following `seq`, skipping 0, which fresh memory
+// holds.
+func nextSeq(seq uint32) uint32 {
+	seq++
+	if seq == 0 {
+		seq++
+	}
+	return seq
+}
+
+// word returns the 64-bit word at `off` in `b`.
+func word(b []byte, off int) *uint64 {
+	return (*uint64)(unsafe.Pointer(&b[off]))
+}
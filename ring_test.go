@@ -0,0 +1,55 @@
+package rdmahandler
+
+import "testing"
+
+func TestRecordSize(t *testing.T) {
+	tests := []struct {
+		length int
+		want   int
+	}{
+		{0, 32},
+		{1, 32},
+		{8, 32},
+		{9, 48},
+		{24, 48},
+		{25, 64},
+		{1000, 1024},
+	}
+	for _, tt := range tests {
+		if got := recordSize(tt.length); got != tt.want {
+			t.Errorf("recordSize(%d) = %d, want %d", tt.length, got, tt.want)
+		}
+	}
+}
+
+func TestRingMaxMessage(t *testing.T) {
+	for _, size := range []int{256, 4096, 1 << 16, 1 << 20, 3<<20 + 16} {
+		r := &Ring{size: size}
+		max := r.MaxMessage()
+		if max <= 0 || max%16 != 0 {
+			t.Errorf("size %d: MaxMessage() = %d, want a positive multiple of 16", size, max)
+		}
+		// a quarter of the ring holds a record of the largest message
+		if rec := recordSize(max); rec > size/4 {
+			t.Errorf("size %d: record of %d bytes exceeds a quarter of the ring", size, rec)
+		}
+	}
+}
+
+func TestNextSeq(t *testing.T) {
+	tests := []struct {
+		seq  uint32
+		want uint32
+	}{
+		{0, 1},
+		{1, 2},
+		{1<<31 - 1, 1 << 31},
+		{1<<32 - 2, 1<<32 - 1},
+		{1<<32 - 1, 1},
+	}
+	for _, tt := range tests {
+		if got := nextSeq(tt.seq); got != tt.want {
+			t.Errorf("nextSeq(%d) = %d, want %d", tt.seq, got, tt.want)
+		}
+	}
+}
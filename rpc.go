@@ -0,0 +1,381 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"encoding/binary"
+	"fmt"
+	"sync"
+	"unsafe"
+)
+
+// Kinds of RPC messages.
+const (
+	rpcRequest  uint8 = iota + 1 // a call of a method
+	rpcResponse                  // the result of a call
+	rpcError                     // the error a call failed with, as text
+	rpcRelease                   // the payload in the slots of the receiver was fetched
+	rpcClose                     // the sender stops serving and calling
+)
+
+const (
+	rpcRemote  = 0x1 // the payload waits in the sender's buffer instead of following the header
+	rpcHdrSize = 20
+	rpcSlots   = 16 // slots the connection buffer is split into for remote payloads
+)
+
+// rpcHeader starts every RPC message. Slot and Length locate a remote payload, or the
+// slots a release returns.
+type rpcHeader struct {
+	Kind   uint8
+	Flags  uint8
+	Method uint16
+	Slot   uint32
+	ID     uint64
+	Length uint32
+}
+
+// RPCHandler serves the calls of one method. It returns the response, or an error that
+// makes the call fail on the calling side with the error's text.
+type RPCHandler func(req []byte) ([]byte, error)
+
+// RPC multiplexes remote procedure calls in both directions over one connection.
+//
+// Any number of goroutines can Call methods of the remote peer at once; every request
+// carries an ID, and the responses, in whatever order the peer completes them, are
+// handed back to the waiting callers. The methods registered with Handle serve the
+// peer's calls, each call in a goroutine of its own. Neither side has to take turns as
+// with Write and Read.
+//
+// Requests and responses travel as Send/Recv messages. Payloads that fit a message
+// together with the header go inline, the small ones inside the work request itself.
+// Larger payloads are copied to slots of the sender's registered buffer, and only their
+// location is sent; the receiver fetches them with an RDMA read and releases the slots.
+//
+// The RPC layer owns the connection: while it runs, no other operation may be used on
+// it. Both peers must create one.
+type RPC struct {
+	h         *RDMAHandler
+	res       *RDMAResources
+	character string
+	slotSize  int
+
+	sendMu sync.Mutex // serializes posting on the connection
+
+	mu       sync.Mutex
+	slotFree *sync.Cond
+	slots    [rpcSlots]bool
+	handlers map[uint16]RPCHandler
+	pending  map[uint64]chan rpcReply
+	nextID   uint64
+	closing  bool
+	err      error
+	done     chan struct{}
+}
+
+// rpcReply is the outcome of a call.
+type rpcReply struct {
+	data []byte
+	err  error
+}
+
+// NewRPC starts the RPC layer on a connection. Its receiver runs until Close or until the
+// connection fails.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// Example:
+//
+//	rpc := h.NewRPC(res, "server")
+//	rpc.Handle(1, func(req []byte) ([]byte, error) {
+//	    return lookup(req)
+//	})
+//	...
+//	value, err := peerRPC.Call(1, key)
+func (h *RDMAHandler) NewRPC(res *RDMAResources, character string) *RPC {
+	r := &RPC{
+		h:         h,
+		res:       res,
+		character: character,
+		slotSize:  res.bufSize() / rpcSlots,
+		handlers:  make(map[uint16]RPCHandler),
+		pending:   make(map[uint64]chan rpcReply),
+		done:      make(chan struct{}),
+	}
+	r.slotFree = sync.NewCond(&r.mu)
+	go r.receive()
+	return r
+}
+
+// Handle registers `fn` to serve the calls of `method`, replacing any handler registered
+// before.
+func (r *RPC) Handle(method uint16, fn RPCHandler) {
+	r.mu.Lock()
+	r.handlers[method] = fn
+	r.mu.Unlock()
+}
+
+// Call invokes `method` on the remote peer with `req` and waits for its response. It is
+// safe to call from many goroutines at once.
+//
+// On success, it returns the response and nil error. On failure, including an error
+// returned by the remote handler, it returns nil and the error.
+func (r *RPC) Call(method uint16, req []byte) ([]byte, error) {
+	ch := make(chan rpcReply, 1)
+	r.mu.Lock()
+	if r.err != nil || r.closing {
+		r.mu.Unlock()
+		return nil, fmt.Errorf("%s: RPC is closed", r.character)
+	}
+	r.nextID++
+	id := r.nextID
+	r.pending[id] = ch
+	r.mu.Unlock()
+
+	if err := r.send(rpcHeader{Kind: rpcRequest, Method: method, ID: id}, req); err != nil {
+		r.mu.Lock()
+		delete(r.pending, id)
+		r.mu.Unlock()
+		return nil, err
+	}
+	reply := <-ch
+	return reply.data, reply.err
+}
+
+// Close stops the RPC layer on both sides. Calls still waiting fail.
+func (r *RPC) Close() error {
+	r.mu.Lock()
+	closing := r.closing
+	r.closing = true
+	r.mu.Unlock()
+	if !closing {
+		if err := r.send(rpcHeader{Kind: rpcClose}, nil); err != nil {
+			return err
+		}
+	}
+	<-r.done
+	return nil
+}
+
+// Done returns a channel that is closed once the RPC layer stopped, because either side
+// closed it or the connection failed.
+func (r *RPC) Done() <-chan struct{} {
+	return r.done
+}
+
+// receive dispatches the messages of the peer until the RPC layer is closed or the
+// connection fails.
+func (r *RPC) receive() {
+	var err error
+	for {
+		var msg []byte
+		msg, err = recvIdle(r.res, r.character)
+		if err == errIdle {
+			r.mu.Lock()
+			closing := r.closing
+			r.mu.Unlock()
+			// an idle connection keeps waiting, a closed one whose peer is gone gives up
+			if closing || r.res.res.failed != 0 {
+				err = fmt.Errorf("%s: RPC is closed", r.character)
+				break
+			}
+			continue
+		}
+		if err != nil {
+			break
+		}
+		if len(msg) < rpcHdrSize {
+			err = fmt.Errorf("%s: short RPC message of %d bytes", r.character, len(msg))
+			break
+		}
+		hdr := decodeRPCHeader(msg)
+		if hdr.Kind == rpcClose {
+			r.mu.Lock()
+			closing := r.closing
+			r.closing = true
+			r.mu.Unlock()
+			if !closing {
+				r.send(hdr, nil)
+			}
+			err = fmt.Errorf("%s: RPC is closed", r.character)
+			break
+		}
+		switch hdr.Kind {
+		case rpcRelease:
+			if int(hdr.Slot)+r.slotCount(int(hdr.Length)) > rpcSlots {
+				continue
+			}
+			r.mu.Lock()
+			for i := 0; i < r.slotCount(int(hdr.Length)); i++ {
+				r.slots[int(hdr.Slot)+i] = false
+			}
+			r.slotFree.Broadcast()
+			r.mu.Unlock()
+		case rpcRequest:
+			go r.serve(hdr, msg[rpcHdrSize:])
+		case rpcResponse, rpcError:
+			if hdr.Flags&rpcRemote != 0 {
+				go r.reply(hdr, msg[rpcHdrSize:])
+			} else {
+				r.reply(hdr, msg[rpcHdrSize:])
+			}
+		}
+	}
+
+	r.mu.Lock()
+	r.err = err
+	pending := r.pending
+	r.pending = make(map[uint64]chan rpcReply)
+	r.slotFree.Broadcast()
+	r.mu.Unlock()
+	for _, ch := range pending {
+		ch <- rpcReply{err: err}
+	}
+	close(r.done)
+}
+
+// serve runs the handler of a request and sends its outcome back.
+func (r *RPC) serve(hdr rpcHeader, body []byte) {
+	var resp []byte
+	req, err := r.payload(hdr, body)
+	if err == nil {
+		r.mu.Lock()
+		fn := r.handlers[hdr.Method]
+		r.mu.Unlock()
+		if fn == nil {
+			err = fmt.Errorf("no handler for method %d", hdr.Method)
+		} else {
+			resp, err = fn(req)
+		}
+	}
+	if err != nil {
+		r.send(rpcHeader{Kind: rpcError, Method: hdr.Method, ID: hdr.ID}, []byte(err.Error()))
+		return
+	}
+	r.send(rpcHeader{Kind: rpcResponse, Method: hdr.Method, ID: hdr.ID}, resp)
+}
+
+// reply hands a response to the waiting caller.
+func (r *RPC) reply(hdr rpcHeader, body []byte) {
+	data, err := r.payload(hdr, body)
+	if err == nil && hdr.Kind == rpcError {
+		data, err = nil, fmt.Errorf("%s: remote: %s", r.character, data)
+	}
+	r.mu.Lock()
+	ch := r.pending[hdr.ID]
+	delete(r.pending, hdr.ID)
+	r.mu.Unlock()
+	if ch != nil {
+		ch <- rpcReply{data: data, err: err}
+	}
+}
+
+// payload returns the payload of a message, fetching it from the peer's buffer and
+// releasing its slots if it was not sent inline.
+func (r *RPC) payload(hdr rpcHeader, body []byte) ([]byte, error) {
+	if hdr.Flags&rpcRemote == 0 {
+		return body, nil
+	}
+	length := int(hdr.Length)
+	buf, err := r.res.Borrow(length)
+	if err != nil {
+		return nil, fmt.Errorf("%s: %v", r.character, err)
+	}
+	defer buf.Release()
+
+	r.sendMu.Lock()
+	c, err := postRegionSegments(r.res, C.IBV_WR_RDMA_READ, "", []Segment{{Buf: buf, Length: length}}, int(hdr.Slot)*r.slotSize, r.character)
+	r.sendMu.Unlock()
+	if err != nil {
+		return nil, err
+	}
+	if err := c.Wait(); err != nil {
+		return nil, err
+	}
+	data := append([]byte(nil), buf.Bytes()...)
+	if err := r.send(rpcHeader{Kind: rpcRelease, Slot: hdr.Slot, Length: hdr.Length}, nil); err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// send sends a message with `payload`, inline if it fits a message and through slots of
+// the connection buffer otherwise.
+func (r *RPC) send(hdr rpcHeader, payload []byte) error {
+	if rpcHdrSize+len(payload) > r.res.maxMessage() {
+		slot, err := r.allocSlots(len(payload))
+		if err != nil {
+			return err
+		}
+		copy(unsafe.Slice((*byte)(unsafe.Add(unsafe.Pointer(r.res.res.buf), slot*r.slotSize)), len(payload)), payload)
+		hdr.Flags |= rpcRemote
+		hdr.Slot = uint32(slot)
+		hdr.Length = uint32(len(payload))
+		payload = nil
+	}
+	msg := make([]byte, rpcHdrSize+len(payload))
+	hdr.encode(msg)
+	copy(msg[rpcHdrSize:], payload)
+
+	r.sendMu.Lock()
+	defer r.sendMu.Unlock()
+	_, err := postMessage(r.res, msg, r.character)
+	return err
+}
+
+// allocSlots reserves consecutive slots of the connection buffer for a payload of
+// `length` bytes, waiting for the peer to release slots if there are not enough free.
+func (r *RPC) allocSlots(length int) (int, error) {
+	n := r.slotCount(length)
+	if n > rpcSlots {
+		return 0, fmt.Errorf("%s: payload of %d bytes exceeds buffer capacity of %d bytes", r.character, length, rpcSlots*r.slotSize)
+	}
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	for r.err == nil {
+		for first := 0; first+n <= rpcSlots; first++ {
+			free := true
+			for i := first; i < first+n && free; i++ {
+				free = !r.slots[i]
+			}
+			if free {
+				for i := first; i < first+n; i++ {
+					r.slots[i] = true
+				}
+				return first, nil
+			}
+		}
+		r.slotFree.Wait()
+	}
+	return 0, r.err
+}
+
+// slotCount returns the number of slots a payload of `length` bytes takes.
+func (r *RPC) slotCount(length int) int {
+	return (length + r.slotSize - 1) / r.slotSize
+}
+
+// encode writes the wire format of the header to the start of `b`.
+func (hdr rpcHeader) encode(b []byte) {
+	b[0] = hdr.Kind
+	b[1] = hdr.Flags
+	binary.BigEndian.PutUint16(b[2:], hdr.Method)
+	binary.BigEndian.PutUint32(b[4:], hdr.Slot)
+	binary.BigEndian.PutUint64(b[8:], hdr.ID)
+	binary.BigEndian.PutUint32(b[16:], hdr.Length)
+}
+
+// decodeRPCHeader reads the header at the start of `b`.
+func decodeRPCHeader(b []byte) rpcHeader {
+	return rpcHeader{
+		Kind:   b[0],
+		Flags:  b[1],
+		Method: binary.BigEndian.Uint16(b[2:]),
+		Slot:   binary.BigEndian.Uint32(b[4:]),
+		ID:     binary.BigEndian.Uint64(b[8:]),
+		Length: binary.BigEndian.Uint32(b[16:]),
+	}
+}
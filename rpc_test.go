@@ -0,0 +1,33 @@
+package rdmahandler
+
+import "testing"
+
+func TestRPCHeaderRoundTrip(t *testing.T) {
+	tests := []rpcHeader{
+		{},
+		{Kind: 1, Flags: 2, Method: 3, Slot: 4, ID: 5, Length: 6},
+		{Kind: 0xff, Flags: 0xff, Method: 0xffff, Slot: 0xffffffff, ID: 1<<64 - 1, Length: 0xffffffff},
+		{Kind: 2, Method: 0x1234, Slot: 0x01020304, ID: 0x0102030405060708, Length: 1 << 20},
+	}
+	for _, hdr := range tests {
+		b := make([]byte, rpcHdrSize+1)
+		b[rpcHdrSize] = 0xaa
+		hdr.encode(b)
+		if b[rpcHdrSize] != 0xaa {
+			t.Errorf("encode(%+v) wrote past the header", hdr)
+		}
+		if got := decodeRPCHeader(b); got != hdr {
+			t.Errorf("decodeRPCHeader(encode(%+v)) = %+v", hdr, got)
+		}
+	}
+}
+
+func TestRPCHeaderByteOrder(t *testing.T) {
+	b := make([]byte, rpcHdrSize)
+	rpcHeader{Kind: 1, Flags: 2, Method: 0x0304, Slot: 0x05060708, ID: 0x090a0b0c0d0e0f10, Length: 0x11121314}.encode(b)
+	for i := range b {
+		if b[i] != byte(i+1) {
+			t.Fatalf("encode wrote % x, want bytes 1 to %d in order", b, rpcHdrSize)
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Set up a Soft-RoCE (rxe) device so rdmabench can run on a single machine
+# without RDMA hardware. Client and server both use the device and talk to
+# each other through the address of the network interface it is bound to.
+#
+# Usage: scripts/rxe_loopback.sh [netdev]
+# The netdev defaults to the interface of the default route. Run as root.
+set -e
+
+NETDEV=${1:-$(ip -o route get 1.1.1.1 | sed -n 's/.* dev \([^ ]*\).*/\1/p')}
+ADDR=$(ip -o -4 addr show dev "$NETDEV" | awk '{split($4, a, "/"); print a[1]; exit}')
+
+modprobe rdma_rxe
+if ! rdma link show rxe0 >/dev/null 2>&1; then
+	rdma link add rxe0 type rxe netdev "$NETDEV"
+fi
+rdma link show rxe0
+
+echo "run: go run ./cmd/rdmabench -mode loopback -addr $ADDR"
+echo "test: RDMAHANDLER_TEST_ADDR=$ADDR go test ./..."
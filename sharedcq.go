@@ -0,0 +1,85 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// SharedCQ is a completion queue shared by the connections opened on one device.
+//
+// Connections created by an RDMAHandler whose SharedCQ field is set attach their queue
+// pairs to it instead of creating a completion queue of their own. Completions are
+// polled in batches and dispatched to the owning connection by QP number, so a single
+// waiter, or a progress loop calling Poll, makes progress for every attached connection.
+// The queue grows as connections are attached.
+//
+// Example:
+//
+//	cq, err := rdmahandler.NewSharedCQ("", 0, 1024, true)
+//	if err != nil {
+//	    log.Fatalf("Failed to create shared CQ: %v", err)
+//	}
+//	defer cq.Close()
+//	handler := rdmahandler.RDMAHandler{SharedCQ: cq}
+type SharedCQ struct {
+	q *C.struct_comp_queue
+}
+
+// NewSharedCQ opens the device named `device`, or the first device found if it is empty,
+// and creates a completion queue with room for `entries` completions on it. With
+// `blocking` set, waiters sleep on a completion channel once their spin time is over.
+// Only connections on IB port `ibPort`, or the default port if it is 0, can attach to
+// the queue.
+//
+// On success, it returns the queue and nil error. On failure, it returns nil and the
+// error encountered.
+func NewSharedCQ(device string, ibPort int, entries int, blocking bool) (*SharedCQ, error) {
+	if ibPort < 0 {
+		return nil, fmt.Errorf("invalid IB port %d", ibPort)
+	}
+	var devName *C.char
+	if device != "" {
+		devName = C.CString(device)
+		defer C.free(unsafe.Pointer(devName))
+	}
+	var block C.int
+	if blocking {
+		block = 1
+	}
+
+	q := C.comp_queue_open(devName, C.int(ibPort), C.int(entries), block)
+	if q == nil {
+		return nil, fmt.Errorf("failed to create shared completion queue")
+	}
+	return &SharedCQ{q: q}, nil
+}
+
+// IBPort returns the IB port of the connections the queue serves.
+func (cq *SharedCQ) IBPort() int {
+	return int(cq.q.dev.ib_port)
+}
+
+// Poll dispatches the completions currently in the queue to their connections without
+// waiting and returns how many it found. Nothing is dispatched while a connection is
+// already waiting on the queue, as that waiter does the dispatching.
+func (cq *SharedCQ) Poll() (int, error) {
+	n := C.comp_queue_poll(cq.q)
+	if n < 0 {
+		return 0, fmt.Errorf("failed to poll shared completion queue")
+	}
+	return int(n), nil
+}
+
+// Close releases the caller's reference to the queue. The queue is destroyed, and its
+// reference to the cached device released, once every attached connection has been
+// destroyed as well.
+func (cq *SharedCQ) Close() error {
+	if C.comp_queue_put(cq.q) != 0 {
+		return fmt.Errorf("failed to destroy shared completion queue")
+	}
+	return nil
+}
@@ -0,0 +1,87 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"unsafe"
+)
+
+// SharedRQ is a receive queue shared by the connections opened on one device.
+//
+// Connections created by an RDMAHandler whose SharedRQ field is set, typically the
+// connections accepted by a Listener, draw the receive slots used by Recv from the
+// shared queue instead of pre-posting a ring of their own. Receive memory then follows
+// the number of messages in flight across all connections rather than the number of
+// connections. The queue starts with `slots` posted slots; whenever the device reports
+// that fewer than a quarter of that are left, another `slots` are added, up to
+// `maxSlots`.
+//
+// Every connection on the queue uses its slot size as its message size, so the peers
+// must set Options.MessageSize to match. Peers of a connection on a shared queue retry
+// sends that find no free slot indefinitely, unless Options.RNRRetry says otherwise.
+//
+// Example:
+//
+//	rq, err := rdmahandler.NewSharedRQ("", 0, 1024, 16384, 4096)
+//	if err != nil {
+//	    log.Fatalf("Failed to create shared receive queue: %v", err)
+//	}
+//	defer rq.Close()
+//	handler := rdmahandler.RDMAHandler{SharedRQ: rq}
+//	l, err := handler.Listen(8080)
+type SharedRQ struct {
+	q *C.struct_shared_rq
+}
+
+// NewSharedRQ opens the device named `device`, or the first device found if it is empty,
+// and creates a shared receive queue of slots of `messageSize` bytes on its protection
+// domain. Only connections on IB port `ibPort`, or the default port if it is 0, can
+// receive from the queue.
+//
+// On success, it returns the queue and nil error. On failure, it returns nil and the
+// error encountered.
+func NewSharedRQ(device string, ibPort int, slots int, maxSlots int, messageSize int) (*SharedRQ, error) {
+	if slots <= 0 || messageSize <= 0 {
+		return nil, fmt.Errorf("invalid shared receive queue of %d slots of %d bytes", slots, messageSize)
+	}
+	if ibPort < 0 {
+		return nil, fmt.Errorf("invalid IB port %d", ibPort)
+	}
+	var devName *C.char
+	if device != "" {
+		devName = C.CString(device)
+		defer C.free(unsafe.Pointer(devName))
+	}
+
+	q := C.shared_rq_open(devName, C.int(ibPort), C.int(slots), C.int(maxSlots), C.uint32_t(messageSize))
+	if q == nil {
+		return nil, fmt.Errorf("failed to create shared receive queue")
+	}
+	return &SharedRQ{q: q}, nil
+}
+
+// IBPort returns the IB port of the connections the queue serves.
+func (rq *SharedRQ) IBPort() int {
+	return int(rq.q.dev.ib_port)
+}
+
+// Slots returns the number of receive slots the queue has allocated and how many times
+// it grew on reaching its low watermark.
+func (rq *SharedRQ) Slots() (slots int, refills int) {
+	var r C.int
+	n := C.shared_rq_slots(rq.q, &r)
+	return int(n), int(r)
+}
+
+// Close releases the caller's reference to the queue. The queue is destroyed, and its
+// memory returned to the device's pool, once every connection on it has been destroyed
+// as well.
+func (rq *SharedRQ) Close() error {
+	if C.shared_rq_put(rq.q) != 0 {
+		return fmt.Errorf("failed to destroy shared receive queue")
+	}
+	return nil
+}
@@ -0,0 +1,341 @@
+#include <rdma_operations.h>
+
+/******************************************************************************
+Shared receive queue operations
+A shared receive queue feeds the receives of every QP attached to it from one
+pool of slots on the PD, so receive memory follows the number of messages in
+flight across all connections instead of the number of connections. The queue
+starts with one chunk of slots and arms a low watermark; when the device
+reports that fewer slots than that are posted, another chunk is added, up to
+a maximum.
+******************************************************************************/
+/******************************************************************************
+ * Function: shared_rq_grow
+ *
+ * Input
+ * q shared receive queue, locked by the caller
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Add a chunk of slots to the queue and post all of them.
+ ******************************************************************************/
+static int shared_rq_grow(struct shared_rq *q)
+{
+	struct srq_chunk *chunk;
+	int n = q->chunk;
+	int i;
+
+	if (n > q->max_slots - q->slots)
+		n = q->max_slots - q->slots;
+	if (n <= 0)
+		return 1;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+	{
+		log_error("failed to allocate receive slots\n");
+		return 1;
+	}
+	chunk->slots = calloc(n, sizeof(*chunk->slots));
+	chunk->block = pool_get(q->dev->pool, (size_t)n * q->msg_size, 0);
+	if (!chunk->slots || !chunk->block)
+	{
+		log_error("failed to get registered memory for %d receive slots\n", n);
+		if (chunk->block)
+			pool_put(q->dev->pool, chunk->block);
+		free(chunk->slots);
+		free(chunk);
+		return 1;
+	}
+	chunk->next = q->chunks;
+	q->chunks = chunk;
+
+	for (i = 0; i < n; i++)
+	{
+		chunk->slots[i].addr = chunk->block->addr + (size_t)i * q->msg_size;
+		chunk->slots[i].lkey = chunk->block->mr->lkey;
+		if (shared_rq_post(q, &chunk->slots[i]))
+			return 1;
+		q->slots++;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: shared_rq_arm
+ *
+ * Input
+ * q shared receive queue, locked by the caller
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Arm the low watermark, so the device reports when fewer than q->limit
+ * slots are posted. It is not armed once the queue reached its maximum.
+ ******************************************************************************/
+static int shared_rq_arm(struct shared_rq *q)
+{
+	struct ibv_srq_attr attr;
+
+	if (q->slots >= q->max_slots)
+	{
+		log_info("shared receive queue reached its maximum of %d slots\n", q->max_slots);
+		return 0;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.srq_limit = q->limit;
+	if (ibv_modify_srq(q->srq, &attr, IBV_SRQ_LIMIT))
+	{
+		log_error("failed to arm SRQ limit\n");
+		return 1;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: shared_rq_open
+ *
+ * Input
+ * dev_name IB device name, NULL for the first device found
+ * ib_port IB port of the connections sharing the queue, 0 for the default
+ * slots number of slots posted initially and added on every refill
+ * max_slots most slots the queue grows to
+ * msg_size size of a slot, the largest message received
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the new queue with one reference held by the caller, NULL on failure
+ *
+ * Description
+ * Create a shared receive queue on the PD of a device taken from the device
+ * cache and post the first chunk of slots. The queue holds a reference to the
+ * device, whose asynchronous event thread refills it.
+ ******************************************************************************/
+struct shared_rq *shared_rq_open(const char *dev_name, int ib_port, int slots, int max_slots, uint32_t msg_size)
+{
+	struct ibv_srq_init_attr init_attr;
+	struct shared_rq *q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+	{
+		log_error("failed to allocate shared receive queue\n");
+		return NULL;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	q->refcnt = 1;
+	q->msg_size = msg_size;
+
+	q->dev = device_get(dev_name, ib_port ? ib_port : config.ib_port);
+	if (!q->dev)
+		goto shared_rq_open_exit;
+	if (!q->dev->device_attr.max_srq)
+	{
+		log_error("device %s does not support shared receive queues\n", q->dev->name);
+		goto shared_rq_open_exit;
+	}
+	if (max_slots < slots)
+		max_slots = slots;
+	if (max_slots > q->dev->device_attr.max_srq_wr)
+	{
+		log_info("shared receive queue size %d exceeds device limit, using %d\n", max_slots,
+				q->dev->device_attr.max_srq_wr);
+		max_slots = q->dev->device_attr.max_srq_wr;
+	}
+	q->chunk = slots < max_slots ? slots : max_slots;
+	q->max_slots = max_slots;
+	q->limit = (q->chunk + 3) / 4;
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.srq_context = q;
+	init_attr.attr.max_wr = max_slots;
+	init_attr.attr.max_sge = 1;
+	q->srq = ibv_create_srq(q->dev->pd, &init_attr);
+	if (!q->srq)
+	{
+		log_error("failed to create SRQ with %d entries\n", max_slots);
+		goto shared_rq_open_exit;
+	}
+
+	if (device_watch(q->dev))
+		goto shared_rq_open_exit;
+	pthread_mutex_lock(&q->lock);
+	if (shared_rq_grow(q) || shared_rq_arm(q))
+	{
+		pthread_mutex_unlock(&q->lock);
+		goto shared_rq_open_exit;
+	}
+	pthread_mutex_unlock(&q->lock);
+	log_info("SRQ was created with %d slots of %u bytes, growing to %d\n", q->slots, msg_size, max_slots);
+	return q;
+
+shared_rq_open_exit:
+	shared_rq_put(q);
+	return NULL;
+}
+/******************************************************************************
+ * Function: shared_rq_hold
+ *
+ * Input
+ * q shared receive queue
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Take a reference to the queue.
+ ******************************************************************************/
+void shared_rq_hold(struct shared_rq *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->refcnt++;
+	pthread_mutex_unlock(&q->lock);
+}
+/******************************************************************************
+ * Function: shared_rq_put
+ *
+ * Input
+ * q shared receive queue
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Drop a reference to the queue and destroy it with the last one. Every QP
+ * attached to it must have been destroyed by then.
+ ******************************************************************************/
+int shared_rq_put(struct shared_rq *q)
+{
+	struct srq_chunk *chunk;
+	int rc = 0;
+	int last;
+
+	pthread_mutex_lock(&q->lock);
+	last = --q->refcnt == 0;
+	pthread_mutex_unlock(&q->lock);
+	if (!last)
+		return 0;
+
+	/* waits for a limit event being handled to be acknowledged */
+	if (q->srq && ibv_destroy_srq(q->srq))
+	{
+		log_error("failed to destroy SRQ\n");
+		rc = 1;
+	}
+	while (q->chunks)
+	{
+		chunk = q->chunks;
+		q->chunks = chunk->next;
+		pool_put(q->dev->pool, chunk->block);
+		free(chunk->slots);
+		free(chunk);
+	}
+	if (q->dev)
+		if (device_put(q->dev))
+			rc = 1;
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+	return rc;
+}
+/******************************************************************************
+ * Function: shared_rq_post
+ *
+ * Input
+ * q shared receive queue
+ * slot slot to receive into
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * Post a receive request for a slot of the queue. The wr_id carries the slot,
+ * so whichever connection the receive completes on can find and repost it.
+ ******************************************************************************/
+int shared_rq_post(struct shared_rq *q, struct srq_slot *slot)
+{
+	struct ibv_recv_wr rr;
+	struct ibv_recv_wr *bad_wr;
+	struct ibv_sge sge;
+	int rc;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)slot->addr;
+	sge.length = q->msg_size;
+	sge.lkey = slot->lkey;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.next = NULL;
+	rr.wr_id = RECV_WR_FLAG | SRQ_WR_FLAG | (uintptr_t)slot;
+	rr.sg_list = &sge;
+	rr.num_sge = 1;
+
+	rc = ibv_post_srq_recv(q->srq, &rr, &bad_wr);
+	if (rc)
+		log_error("failed to post SRQ RR\n");
+	return rc;
+}
+/******************************************************************************
+ * Function: shared_rq_limit_reached
+ *
+ * Input
+ * q shared receive queue whose low watermark was reached
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Handle IBV_EVENT_SRQ_LIMIT_REACHED: add a chunk of slots and arm the
+ * watermark again. Called from the asynchronous event thread of the device.
+ ******************************************************************************/
+void shared_rq_limit_reached(struct shared_rq *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->refills++;
+	if (!shared_rq_grow(q))
+		shared_rq_arm(q);
+	log_info("SRQ watermark reached, %d slots posted\n", q->slots);
+	pthread_mutex_unlock(&q->lock);
+}
+/******************************************************************************
+ * Function: shared_rq_slots
+ *
+ * Input
+ * q shared receive queue
+ *
+ * Output
+ * refills number of refills done on reaching the watermark
+ *
+ * Returns
+ * number of slots allocated
+ ******************************************************************************/
+int shared_rq_slots(struct shared_rq *q, int *refills)
+{
+	int slots;
+
+	pthread_mutex_lock(&q->lock);
+	slots = q->slots;
+	*refills = q->refills;
+	pthread_mutex_unlock(&q->lock);
+	return slots;
+}
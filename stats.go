@@ -0,0 +1,123 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import "time"
+
+// LogLevel controls what the C layer prints.
+type LogLevel int
+
+const (
+	// LogNone prints nothing, not even errors.
+	LogNone LogLevel = C.LOG_LEVEL_NONE
+	// LogError prints errors only.
+	LogError LogLevel = C.LOG_LEVEL_ERROR
+	// LogInfo additionally prints connection setup progress. This is the default.
+	LogInfo LogLevel = C.LOG_LEVEL_INFO
+	// LogDebug additionally prints every posted work request and completion, which is
+	// expensive and meant for debugging only.
+	LogDebug LogLevel = C.LOG_LEVEL_DEBUG
+)
+
+// SetLogLevel sets the process-wide verbosity of the C layer. It should be called before
+// connections are created.
+func SetLogLevel(level LogLevel) {
+	C.log_level = C.int(level)
+}
+
+// OpStats counts operations of one kind on a connection.
+type OpStats struct {
+	Ops   uint64
+	Bytes uint64
+}
+
+// LatencyBucket counts operations whose post to completion time was below UpperBound
+// and at least the UpperBound of the previous bucket.
+type LatencyBucket struct {
+	UpperBound time.Duration
+	Count      uint64
+}
+
+// Stats is a snapshot of the performance counters of a connection.
+//
+// Operations are counted when posted, receives when they complete. Errors counts failed
+// completions by work completion status, and Timeouts the waits that gave up. Latency is
+// a histogram of post to completion times with power-of-two bucket bounds.
+type Stats struct {
+	Write    OpStats
+	Read     OpStats
+	Send     OpStats
+	Atomic   OpStats
+	Recv     OpStats
+	Errors   map[string]uint64
+	Timeouts uint64
+	Latency  []LatencyBucket
+}
+
+// Stats returns a snapshot of the connection's performance counters. The counters are
+// maintained without locks and can be read while the connection is in use.
+//
+// Example:
+//
+//	s := res.Stats()
+//	log.Printf("writes=%d p99=%v", s.Write.Ops, s.Percentile(0.99))
+func (res *RDMAResources) Stats() Stats {
+	var cs C.struct_conn_stats
+	C.stats_snapshot(res.res, &cs)
+
+	op := func(i int) OpStats {
+		return OpStats{Ops: uint64(cs.ops[i]), Bytes: uint64(cs.bytes[i])}
+	}
+	s := Stats{
+		Write:    op(C.STAT_WRITE),
+		Read:     op(C.STAT_READ),
+		Send:     op(C.STAT_SEND),
+		Atomic:   op(C.STAT_ATOMIC),
+		Recv:     op(C.STAT_RECV),
+		Errors:   map[string]uint64{},
+		Timeouts: uint64(cs.timeouts),
+		Latency:  make([]LatencyBucket, C.LAT_BUCKETS),
+	}
+	for status, n := range cs.errors {
+		if n != 0 {
+			s.Errors[C.GoString(C.ibv_wc_status_str(uint32(status)))] = uint64(n)
+		}
+	}
+	for i, n := range cs.latency {
+		s.Latency[i] = LatencyBucket{UpperBound: latencyBound(i), Count: uint64(n)}
+	}
+	return s
+}
+
+// latencyBound returns the upper bound of latency bucket `i`, which the C layer fills
+// with the post to completion times in [2^i, 2^(i+1)) nanoseconds.
+func latencyBound(i int) time.Duration {
+	return time.Duration(uint64(2) << i)
+}
+
+// Percentile returns the upper bound of the latency bucket holding the `p` quantile of
+// the post to completion times, with `p` between 0 and 1. It returns 0 when nothing has
+// completed yet.
+func (s Stats) Percentile(p float64) time.Duration {
+	var total uint64
+	for _, b := range s.Latency {
+		total += b.Count
+	}
+	if total == 0 {
+		return 0
+	}
+	rank := uint64(p * float64(total))
+	if rank >= total {
+		rank = total - 1
+	}
+	var seen uint64
+	for _, b := range s.Latency {
+		seen += b.Count
+		if seen > rank {
+			return b.UpperBound
+		}
+	}
+	return s.Latency[len(s.Latency)-1].UpperBound
+}
@@ -0,0 +1,54 @@
+package rdmahandler
+
+import (
+	"testing"
+	"time"
+)
+
+func TestLatencyBound(t *testing.T) {
+	tests := []struct {
+		bucket int
+		want   time.Duration
+	}{
+		{0, 2 * time.Nanosecond},
+		{1, 4 * time.Nanosecond},
+		{9, 1024 * time.Nanosecond},
+		{19, 1 << 20 * time.Nanosecond},
+		{39, 1 << 40 * time.Nanosecond},
+	}
+	for _, tt := range tests {
+		if got := latencyBound(tt.bucket); got != tt.want {
+			t.Errorf("latencyBound(%d) = %v, want %v", tt.bucket, got, tt.want)
+		}
+	}
+}
+
+func TestPercentile(t *testing.T) {
+	hist := func(counts map[int]uint64) Stats {
+		s := Stats{Latency: make([]LatencyBucket, 40)}
+		for i := range s.Latency {
+			s.Latency[i] = LatencyBucket{UpperBound: latencyBound(i), Count: counts[i]}
+		}
+		return s
+	}
+	tests := []struct {
+		name   string
+		counts map[int]uint64
+		p      float64
+		want   time.Duration
+	}{
+		{"empty", nil, 0.5, 0},
+		{"single bucket", map[int]uint64{12: 7}, 0.99, latencyBound(12)},
+		{"minimum", map[int]uint64{0: 50, 3: 49, 10: 1}, 0, latencyBound(0)},
+		{"median on bucket edge", map[int]uint64{0: 50, 3: 49, 10: 1}, 0.5, latencyBound(3)},
+		{"median below edge", map[int]uint64{0: 51, 3: 48, 10: 1}, 0.5, latencyBound(0)},
+		{"tail", map[int]uint64{0: 50, 3: 49, 10: 1}, 0.99, latencyBound(10)},
+		{"maximum", map[int]uint64{0: 50, 3: 49, 10: 1}, 1, latencyBound(10)},
+		{"last bucket", map[int]uint64{39: 3}, 0.5, latencyBound(39)},
+	}
+	for _, tt := range tests {
+		if got := hist(tt.counts).Percentile(tt.p); got != tt.want {
+			t.Errorf("%s: Percentile(%v) = %v, want %v", tt.name, tt.p, got, tt.want)
+		}
+	}
+}
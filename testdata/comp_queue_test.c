@@ -0,0 +1,243 @@
+#include "../comp_queue.c"
+
+/******************************************************************************
+Tests of the dispatch table of a completion queue
+comp_queue_attach and comp_queue_detach only use the QP number of a
+connection, so they run on fake QPs without an RDMA device.
+******************************************************************************/
+#define TEST_CONNS 100
+
+static struct ibv_qp qps[TEST_CONNS];
+static struct resources conns[TEST_CONNS];
+static int failures;
+
+#define check(cond, ...)                    \
+	do                                      \
+	{                                       \
+		if (!(cond))                        \
+		{                                   \
+			fprintf(stderr, __VA_ARGS__);   \
+			failures++;                     \
+		}                                   \
+	} while (0)
+
+/******************************************************************************
+ * Function: queue_init
+ *
+ * Input
+ * q completion queue to set up
+ *
+ * Output
+ * q is empty, with room for every connection of the tests
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Set up the fields of a queue the dispatch table uses, without a CQ.
+ ******************************************************************************/
+static void queue_init(struct comp_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	q->cqe = q->max_cqe = TEST_CONNS;
+}
+/******************************************************************************
+ * Function: queue_free
+ *
+ * Input
+ * q completion queue set up by queue_init
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Release the table and lock of a queue.
+ ******************************************************************************/
+static void queue_free(struct comp_queue *q)
+{
+	free(q->table);
+	pthread_mutex_destroy(&q->lock);
+}
+/******************************************************************************
+ * Function: attach
+ *
+ * Input
+ * q completion queue
+ * i index of the connection
+ * qp_num QP number of the connection
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Attach connection i with the given QP number.
+ ******************************************************************************/
+static void attach(struct comp_queue *q, int i, uint32_t qp_num)
+{
+	qps[i].qp_num = qp_num;
+	conns[i].qp = &qps[i];
+	check(!comp_queue_attach(q, &conns[i], 1), "attaching QP 0x%x failed\n", qp_num);
+}
+/******************************************************************************
+ * Function: lookup
+ *
+ * Input
+ * q completion queue
+ * qp_num QP number
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the connection comp_queue_drain dispatches completions of qp_num to
+ ******************************************************************************/
+static struct resources *lookup(struct comp_queue *q, uint32_t qp_num)
+{
+	return q->table_size ? table_slot(q->table, q->table_size, qp_num)->res : NULL;
+}
+/******************************************************************************
+ * Function: home
+ *
+ * Input
+ * size number of slots
+ * qp_num QP number
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * the slot linear probing for qp_num starts at
+ ******************************************************************************/
+static uint32_t home(uint32_t size, uint32_t qp_num)
+{
+	return (qp_num * 2654435761u) & (size - 1);
+}
+/******************************************************************************
+ * Function: colliding
+ *
+ * Input
+ * slot home slot in a table of 8 slots
+ * n number of QP numbers
+ *
+ * Output
+ * out n QP numbers whose probes start at slot
+ *
+ * Returns
+ * none
+ ******************************************************************************/
+static void colliding(uint32_t slot, int n, uint32_t *out)
+{
+	uint32_t qp_num;
+
+	for (qp_num = 1; n; qp_num++)
+		if (home(8, qp_num) == slot)
+		{
+			*out++ = qp_num;
+			n--;
+		}
+}
+/******************************************************************************
+ * Function: test_grow
+ *
+ * Description
+ * Every attached connection stays reachable while the table grows, and the
+ * table stays at most half full.
+ ******************************************************************************/
+static void test_grow(void)
+{
+	struct comp_queue q;
+	int i;
+	int j;
+
+	queue_init(&q);
+	check(!lookup(&q, 1), "empty queue dispatches QP 0x1\n");
+	for (i = 0; i < TEST_CONNS; i++)
+	{
+		attach(&q, i, 0x100 + i);
+		check(q.table_used == (uint32_t)i + 1, "%u connections attached, want %d\n", q.table_used, i + 1);
+		check(q.table_used * 2 <= q.table_size, "%u connections in %u slots\n", q.table_used, q.table_size);
+		check(!(q.table_size & (q.table_size - 1)), "table size %u is no power of two\n", q.table_size);
+		for (j = 0; j <= i; j++)
+			check(lookup(&q, 0x100 + j) == &conns[j], "QP 0x%x lost after attaching %d connections\n", 0x100 + j,
+				  i + 1);
+	}
+	check(q.reserved == TEST_CONNS, "%d CQ entries reserved, want %d\n", q.reserved, TEST_CONNS);
+	check(q.refcnt == TEST_CONNS, "%d references, want %d\n", q.refcnt, TEST_CONNS);
+
+	for (i = 0; i < TEST_CONNS; i += 2)
+		comp_queue_detach(&q, &conns[i], 1);
+	for (i = 0; i < TEST_CONNS; i++)
+		check(lookup(&q, 0x100 + i) == (i % 2 ? &conns[i] : NULL), "QP 0x%x dispatched wrongly after detaching\n",
+			  0x100 + i);
+	check(q.table_used == TEST_CONNS / 2, "%u connections attached, want %d\n", q.table_used, TEST_CONNS / 2);
+	queue_free(&q);
+}
+/******************************************************************************
+ * Function: test_cluster
+ *
+ * Input
+ * slot home slot of the colliding QP numbers
+ * victim index in the cluster of the connection to detach
+ *
+ * Description
+ * Colliding QP numbers occupy consecutive slots from their home slot, wrapping
+ * around the end of the table, and detaching one of them from anywhere in the
+ * cluster keeps the others reachable and lets it be attached again.
+ ******************************************************************************/
+static void test_cluster(uint32_t slot, int victim)
+{
+	struct comp_queue q;
+	uint32_t qp_nums[4];
+	int i;
+
+	queue_init(&q);
+	colliding(slot, 4, qp_nums);
+	for (i = 0; i < 4; i++)
+		attach(&q, i, qp_nums[i]);
+	check(q.table_size == 8, "table of %u slots, want 8\n", q.table_size);
+	for (i = 0; i < 4; i++)
+		check(q.table[(slot + i) & 7].res == &conns[i], "QP 0x%x is not in slot %u\n", qp_nums[i], (slot + i) & 7);
+
+	comp_queue_detach(&q, &conns[victim], 1);
+	for (i = 0; i < 4; i++)
+		check(lookup(&q, qp_nums[i]) == (i == victim ? NULL : &conns[i]),
+			  "QP 0x%x dispatched wrongly after detaching QP 0x%x from slot %u\n", qp_nums[i], qp_nums[victim],
+			  (slot + victim) & 7);
+	check(!q.table[(slot + 3) & 7].res, "cluster at slot %u was not compacted\n", slot);
+	check(q.table_used == 3, "%u connections attached, want 3\n", q.table_used);
+	check(q.reserved == 3, "%d CQ entries reserved, want 3\n", q.reserved);
+
+	/* detaching a connection that is not attached changes nothing */
+	comp_queue_detach(&q, &conns[victim], 1);
+	check(q.table_used == 3, "detaching twice left %u connections, want 3\n", q.table_used);
+
+	attach(&q, victim, qp_nums[victim]);
+	for (i = 0; i < 4; i++)
+		check(lookup(&q, qp_nums[i]) == &conns[i], "QP 0x%x lost after attaching QP 0x%x again\n", qp_nums[i],
+			  qp_nums[victim]);
+	queue_free(&q);
+}
+
+int main(void)
+{
+	int slot;
+	int victim;
+
+	test_grow();
+	for (slot = 0; slot < 8; slot += 6)
+		for (victim = 0; victim < 4; victim++)
+			test_cluster(slot, victim);
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
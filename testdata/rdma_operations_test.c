@@ -0,0 +1,222 @@
+#include "../rdma_operations.c"
+
+/******************************************************************************
+Tests of post_batch
+ibv_post_send calls the post_send operation of the QP's context, which the
+tests replace to accept or reject each work request, so batches are posted
+without an RDMA device.
+******************************************************************************/
+#define TEST_OPS 8
+#define TEST_WRS 64
+
+static struct ibv_context ctx;
+static struct ibv_qp qp;
+static struct comp_queue queue;
+static struct resources conn;
+static uint64_t post_ns[MAX_SEND_WR];
+static uint64_t data[TEST_OPS];
+static struct batch_op ops[TEST_OPS];
+static int reject[TEST_WRS]; /* the fake send queue rejects the i-th work request */
+static struct ibv_send_wr posted[TEST_WRS];
+static int nposted;
+static int nseen;
+static int failures;
+
+#define check(cond, ...)                    \
+	do                                      \
+	{                                       \
+		if (!(cond))                        \
+		{                                   \
+			fprintf(stderr, __VA_ARGS__);   \
+			failures++;                     \
+		}                                   \
+	} while (0)
+
+/******************************************************************************
+ * Function: fake_post_send
+ *
+ * Input
+ * qp QP the work requests are posted to
+ * wr chain of work requests
+ *
+ * Output
+ * bad_wr first work request that was not posted
+ *
+ * Returns
+ * 0 on success, ENOMEM once a work request is rejected
+ *
+ * Description
+ * Record the work requests of a chain up to the first one marked in reject.
+ * Completions are not simulated; the connection's async_done follows the
+ * posted work requests so async_reserve never polls.
+ ******************************************************************************/
+static int fake_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+	for (; wr; wr = wr->next)
+	{
+		if (reject[nseen++])
+		{
+			*bad_wr = wr;
+			return ENOMEM;
+		}
+		posted[nposted++] = *wr;
+		conn.async_done = wr->wr_id;
+	}
+	return 0;
+}
+/******************************************************************************
+ * Function: setup
+ *
+ * Input
+ * send_depth send queue depth of the connection
+ *
+ * Output
+ * the connection is fresh, the fake send queue takes every work request and
+ * ops holds TEST_OPS 8-byte writes
+ *
+ * Returns
+ * none
+ ******************************************************************************/
+static void setup(int send_depth)
+{
+	int i;
+
+	memset(&conn, 0, sizeof(conn));
+	memset(reject, 0, sizeof(reject));
+	nposted = 0;
+	nseen = 0;
+	ctx.ops.post_send = fake_post_send;
+	qp.context = &ctx;
+	conn.qp = &qp;
+	conn.cq = &queue;
+	conn.send_depth = send_depth;
+	conn.async_post_ns = post_ns;
+	for (i = 0; i < TEST_OPS; i++)
+	{
+		ops[i].opcode = IBV_WR_RDMA_WRITE;
+		ops[i].sge.addr = (uintptr_t)&data[i];
+		ops[i].sge.length = sizeof(data[i]);
+		ops[i].remote_addr = i * sizeof(data[i]);
+	}
+}
+/******************************************************************************
+ * Function: check_posted
+ *
+ * Input
+ * name name of the test case
+ * n number of work requests that should have been posted
+ * signaled bit i set if the i-th of them should be signaled
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Check the posted work requests, whose wr_ids count up from 1.
+ ******************************************************************************/
+static void check_posted(const char *name, int n, unsigned signaled)
+{
+	int i;
+
+	check(nposted == n, "%s: %d work requests posted, want %d\n", name, nposted, n);
+	for (i = 0; i < nposted && i < n; i++)
+	{
+		check(posted[i].wr_id == (uint64_t)i + 1, "%s: work request %d has wr_id %" PRIu64 "\n", name, i,
+			  posted[i].wr_id);
+		check(!!(posted[i].send_flags & IBV_SEND_SIGNALED) == !!(signaled & (1u << i)),
+			  "%s: work request %d is signaled=%d\n", name, i, !!(posted[i].send_flags & IBV_SEND_SIGNALED));
+	}
+}
+/******************************************************************************
+ * Function: check_batch
+ *
+ * Input
+ * name name of the test case
+ * rc result of post_batch
+ * want_rc expected result
+ * wr_id wr_id post_batch returned
+ * want_wr_id expected wr_id, also the expected async_posted
+ * writes expected number of writes counted in the statistics
+ * bytes expected number of bytes counted in the statistics
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ ******************************************************************************/
+static void check_batch(const char *name, int rc, int want_rc, uint64_t wr_id, uint64_t want_wr_id,
+						uint64_t writes, uint64_t bytes)
+{
+	check(rc == want_rc, "%s: post_batch returned %d, want %d\n", name, rc, want_rc);
+	check(wr_id == want_wr_id, "%s: wr_id %" PRIu64 ", want %" PRIu64 "\n", name, wr_id, want_wr_id);
+	check(conn.async_posted == want_wr_id, "%s: async_posted %" PRIu64 ", want %" PRIu64 "\n", name,
+		  conn.async_posted, want_wr_id);
+	check(conn.stats.ops[STAT_WRITE] == writes, "%s: %" PRIu64 " writes counted, want %" PRIu64 "\n", name,
+		  conn.stats.ops[STAT_WRITE], writes);
+	check(conn.stats.bytes[STAT_WRITE] == bytes, "%s: %" PRIu64 " bytes counted, want %" PRIu64 "\n", name,
+		  conn.stats.bytes[STAT_WRITE], bytes);
+}
+
+int main(void)
+{
+	uint64_t wr_id;
+	int rc;
+
+	log_level = LOG_LEVEL_NONE;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	setup(MAX_SEND_WR);
+	rc = post_batch(&conn, ops, 5, 0, &wr_id);
+	check_batch("complete", rc, 0, wr_id, 5, 5, 40);
+	check_posted("complete", 5, 1u << 4);
+
+	/* the posted prefix ends unsignaled, an empty write completes it */
+	setup(MAX_SEND_WR);
+	reject[3] = 1;
+	rc = post_batch(&conn, ops, 5, 0, &wr_id);
+	check_batch("unsignaled prefix", rc, 1, wr_id, 4, 4, 24);
+	check_posted("unsignaled prefix", 4, 1u << 3);
+	check(posted[3].opcode == IBV_WR_RDMA_WRITE && !posted[3].num_sge,
+		  "unsignaled prefix: completion is not an empty write\n");
+	check(!conn.failed, "unsignaled prefix: connection failed\n");
+
+	/* the posted prefix ends signaled and needs no empty write */
+	setup(MAX_SEND_WR);
+	reject[2] = 1;
+	rc = post_batch(&conn, ops, 5, 2, &wr_id);
+	check_batch("signaled prefix", rc, 1, wr_id, 2, 2, 16);
+	check_posted("signaled prefix", 2, 1u << 1);
+
+	/* nothing was posted, so there is nothing to wait for */
+	setup(MAX_SEND_WR);
+	reject[0] = 1;
+	rc = post_batch(&conn, ops, 5, 0, &wr_id);
+	check_batch("nothing posted", rc, 1, wr_id, 0, 0, 0);
+	check_posted("nothing posted", 0, 0);
+
+	/* a later chain fails: the earlier one went out whole */
+	setup(4);
+	reject[3] = 1;
+	rc = post_batch(&conn, ops, 7, 0, &wr_id);
+	check_batch("second chain", rc, 1, wr_id, 3, 3, 24);
+	check_posted("second chain", 3, 1u << 2);
+
+	/* the empty write fails too: waits end on the failed connection */
+	setup(MAX_SEND_WR);
+	reject[3] = 1;
+	reject[4] = 1;
+	rc = post_batch(&conn, ops, 5, 0, &wr_id);
+	check_batch("completion rejected", rc, 1, wr_id, 4, 3, 24);
+	check_posted("completion rejected", 3, 0);
+	check(conn.failed, "completion rejected: connection did not fail\n");
+
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,172 @@
+package rdmahandler
+
+/*
+#include "rdma_operations.h"
+*/
+import "C"
+import (
+	"fmt"
+	"io"
+	"unsafe"
+)
+
+// Segment is a range of a PoolBuffer taking part in a vectored operation.
+type Segment struct {
+	Buf    *PoolBuffer
+	Offset int
+	Length int
+}
+
+// WriteV sends the concatenation of `pieces` to the remote peer as a single message, to
+// be read with Read or ReadV.
+//
+// The pieces, for example a header, a body and a trailer, are copied one after the other
+// straight into the registered buffer behind the frame header, so they need not be
+// concatenated into one slice first. The message is otherwise framed and transferred
+// exactly as by Write.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns nil. On failure, it returns an error detailing the issue encountered.
+//
+// Example:
+//
+//	err := h.WriteV(clientRes, [][]byte{header, body, trailer}, "client")
+//	if err != nil {
+//	    log.Fatalf("RDMA write failed: %v", err)
+//	}
+func (h *RDMAHandler) WriteV(res *RDMAResources, pieces [][]byte, character string) error {
+	if res.lease != leaseNone {
+		return fmt.Errorf("%s: buffer is leased", character)
+	}
+	length := 0
+	for _, p := range pieces {
+		length += len(p)
+	}
+	if length > res.maxPayload() {
+		return fmt.Errorf("%s: message of %d bytes exceeds buffer capacity of %d bytes", character, length, res.maxPayload())
+	}
+	dst := unsafe.Slice((*byte)(res.payload()), length)
+	n := 0
+	for _, p := range pieces {
+		n += copy(dst[n:], p)
+	}
+	return writeFrame(res, length, character)
+}
+
+// ReadV reads a message like Read and scatters its payload over `pieces`, filling each
+// completely before moving on to the next.
+//
+// If the pieces are too small for the received message, nothing is copied, the message
+// is discarded and io.ErrShortBuffer is returned along with the size of the message.
+//
+// On success, it returns the number of bytes copied and nil error. On failure, it returns
+// the error encountered.
+func (h *RDMAHandler) ReadV(res *RDMAResources, pieces [][]byte, character string) (int, error) {
+	if res.lease != leaseNone {
+		return 0, fmt.Errorf("%s: buffer is leased", character)
+	}
+	length, err := readFrame(res, character)
+	if err != nil {
+		return 0, err
+	}
+	room := 0
+	for _, p := range pieces {
+		room += len(p)
+	}
+	n := 0
+	if length <= room {
+		src := unsafe.Slice((*byte)(res.rxPayload()), length)
+		for _, p := range pieces {
+			if n == length {
+				break
+			}
+			n += copy(p, src[n:])
+		}
+	}
+	if err := finishRead(res, character); err != nil {
+		return 0, err
+	}
+	if n < length {
+		return length, io.ErrShortBuffer
+	}
+	return n, nil
+}
+
+// WriteVAsync starts an RDMA write gathering `segs` into consecutive bytes at `offset` in
+// the remote peer's buffer, without copying them.
+//
+// Every segment becomes its own scatter/gather entry of the work request, so data kept
+// in registered memory in several places, such as a header and a payload borrowed
+// separately from the pool, goes out in one transfer. Up to the QP's limit of entries
+// per work request, see QPAttributes, the write is a single work request; longer lists
+// are split into several work requests covering consecutive ranges, and the Completion
+// tracks the last of them. The segments must not be modified or released until the
+// write completes.
+//
+// `character` is used in error messages to identify the operation or the role of the peer
+// (e.g., "client" or "server").
+//
+// On success, it returns a Completion to wait on and nil error. On failure, it returns nil
+// and the error encountered.
+//
+// Example:
+//
+//	c, err := h.WriteVAsync(clientRes, 0, []rdmahandler.Segment{
+//	    {Buf: hdr, Length: hdrLen},
+//	    {Buf: body, Length: bodyLen},
+//	}, "client")
+func (h *RDMAHandler) WriteVAsync(res *RDMAResources, offset int, segs []Segment, character string) (*Completion, error) {
+	return postRegionSegments(res, C.IBV_WR_RDMA_WRITE, "", segs, offset, character)
+}
+
+// ReadVAsync starts an RDMA read of consecutive bytes at `offset` in the remote peer's
+// buffer, scattering them over `segs` in order. It is otherwise like WriteVAsync; the
+// data is available in the segments once the Completion is waited for.
+func (h *RDMAHandler) ReadVAsync(res *RDMAResources, offset int, segs []Segment, character string) (*Completion, error) {
+	return postRegionSegments(res, C.IBV_WR_RDMA_READ, "", segs, offset, character)
+}
+
+// postAsyncSegments posts an asynchronous operation between `segs` and consecutive bytes
+// at `offset` in the remote `region`, nil for the connection buffer. The caller checked
+// the remote range.
+func postAsyncSegments(res *RDMAResources, opcode C.int, segs []Segment, region *C.struct_region_desc, offset int, character string) (*Completion, error) {
+	sges := make([]C.struct_ibv_sge, 0, len(segs))
+	for i, s := range segs {
+		sge, err := s.sge(res)
+		if err != nil {
+			return nil, fmt.Errorf("%s: segment %d %v", character, i, err)
+		}
+		if s.Length == 0 {
+			continue
+		}
+		sges = append(sges, sge)
+	}
+
+	var sgList *C.struct_ibv_sge
+	if len(sges) > 0 {
+		sgList = &sges[0]
+	}
+	var wrID C.uint64_t
+	if C.post_async_region(res.res, opcode, sgList, C.int(len(sges)), region, C.size_t(offset), &wrID) != 0 {
+		return nil, fmt.Errorf("%s: failed to post SR", character)
+	}
+	return &Completion{res: res, wrID: wrID, character: character}, nil
+}
+
+// sge returns the SGE of the segment after checking that it lies within its buffer, which
+// must be registered on the device of `res`.
+func (s Segment) sge(res *RDMAResources) (C.struct_ibv_sge, error) {
+	if s.Buf == nil || s.Buf.blk == nil || s.Buf.dev != res.res.dev {
+		return C.struct_ibv_sge{}, fmt.Errorf("does not belong to the connection's device")
+	}
+	if s.Offset < 0 || s.Length < 0 || s.Offset+s.Length > s.Buf.size {
+		return C.struct_ibv_sge{}, fmt.Errorf("exceeds buffer of %d bytes", s.Buf.size)
+	}
+	return C.struct_ibv_sge{
+		addr:   C.uint64_t(uintptr(unsafe.Pointer(s.Buf.blk.addr)) + uintptr(s.Offset)),
+		length: C.uint32_t(s.Length),
+		lkey:   s.Buf.blk.mr.lkey,
+	}, nil
+}